@@ -0,0 +1,43 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Main program for the benchmarks.  The end-to-end benchmarks expect the
+   same local XMPP test environment as the unit tests.  Results can be
+   written as JSON with the standard --benchmark_format=json or
+   --benchmark_out flags of Google Benchmark.  */
+
+#include <benchmark/benchmark.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <cstdlib>
+
+int
+main (int argc, char** argv)
+{
+  google::InitGoogleLogging (argv[0]);
+
+  /* Let the benchmark library consume its own arguments first, so that
+     only our flags are left for gflags.  */
+  benchmark::Initialize (&argc, argv);
+  gflags::ParseCommandLineFlags (&argc, &argv, true);
+
+  benchmark::RunSpecifiedBenchmarks ();
+  return EXIT_SUCCESS;
+}
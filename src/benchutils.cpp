@@ -0,0 +1,252 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "benchutils.hpp"
+
+#include "metrics.hpp"
+
+#include <xayautil/cryptorand.hpp>
+
+#include <glog/logging.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <thread>
+
+namespace
+{
+
+/** Total number of allocations done through operator new.  */
+std::atomic<uint64_t> allocations(0);
+
+/**
+ * Allocates memory with malloc and counts the allocation.
+ */
+void*
+CountedAlloc (const std::size_t size) noexcept
+{
+  allocations.fetch_add (1, std::memory_order_relaxed);
+  return std::malloc (size == 0 ? 1 : size);
+}
+
+} // anonymous namespace
+
+/* Replacements of the global allocation functions, so that we can count
+   allocations in the benchmarks.  They simply forward to malloc/free.  */
+
+void*
+operator new (const std::size_t size)
+{
+  void* res = CountedAlloc (size);
+  if (res == nullptr)
+    throw std::bad_alloc ();
+  return res;
+}
+
+void*
+operator new[] (const std::size_t size)
+{
+  return operator new (size);
+}
+
+void*
+operator new (const std::size_t size, const std::nothrow_t&) noexcept
+{
+  return CountedAlloc (size);
+}
+
+void*
+operator new[] (const std::size_t size, const std::nothrow_t&) noexcept
+{
+  return CountedAlloc (size);
+}
+
+void
+operator delete (void* ptr) noexcept
+{
+  std::free (ptr);
+}
+
+void
+operator delete[] (void* ptr) noexcept
+{
+  std::free (ptr);
+}
+
+void
+operator delete (void* ptr, std::size_t) noexcept
+{
+  std::free (ptr);
+}
+
+void
+operator delete[] (void* ptr, std::size_t) noexcept
+{
+  std::free (ptr);
+}
+
+namespace xmppbroadcast
+{
+
+/* ************************************************************************** */
+
+std::string
+LatencyRecorder::Prepare (const size_t size)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const uint64_t index = sent.size ();
+  std::string res(std::max<size_t> (size, sizeof (index)), 'x');
+  std::memcpy (&res[0], &index, sizeof (index));
+
+  sent.push_back (Clock::now ());
+  return res;
+}
+
+void
+LatencyRecorder::Received (const std::string& payload)
+{
+  const auto now = Clock::now ();
+
+  uint64_t index;
+  if (payload.size () < sizeof (index))
+    return;
+  std::memcpy (&index, payload.data (), sizeof (index));
+
+  std::lock_guard<std::mutex> lock(mut);
+  if (index >= sent.size ())
+    return;
+
+  const std::chrono::duration<double, std::micro> latency = now - sent[index];
+  latencies.push_back (latency.count ());
+  cv.notify_all ();
+}
+
+bool
+LatencyRecorder::WaitForAll (const std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(mut);
+  return cv.wait_for (lock, timeout, [this] ()
+    {
+      return latencies.size () >= sent.size ();
+    });
+}
+
+void
+LatencyRecorder::Reset ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  sent.clear ();
+  latencies.clear ();
+}
+
+void
+LatencyRecorder::Report (benchmark::State& state, const size_t payloadSize)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  state.SetItemsProcessed (latencies.size ());
+  state.SetBytesProcessed (latencies.size () * payloadSize);
+
+  if (latencies.empty ())
+    return;
+
+  const auto percentile = [this] (const double p)
+    {
+      const size_t n = (latencies.size () - 1) * p;
+      std::nth_element (latencies.begin (), latencies.begin () + n,
+                        latencies.end ());
+      return latencies[n];
+    };
+  state.counters["p50_us"] = percentile (0.50);
+  state.counters["p99_us"] = percentile (0.99);
+}
+
+/* ************************************************************************** */
+
+xaya::uint256
+NewChannelId ()
+{
+  xaya::CryptoRand rnd;
+  return rnd.Get<xaya::uint256> ();
+}
+
+uint64_t
+GetRoomJoins ()
+{
+  const auto& joins = MetricsRegistry::Default ().GetHistogram (
+      "xmppbroadcast_room_join_seconds", "", Histogram::LatencyBounds ());
+  return joins.GetCumulativeCounts ().back ();
+}
+
+bool
+WaitForRoomJoins (const uint64_t target,
+                  const std::chrono::milliseconds timeout)
+{
+  const auto deadline = std::chrono::steady_clock::now () + timeout;
+  while (GetRoomJoins () < target)
+    {
+      if (std::chrono::steady_clock::now () > deadline)
+        {
+          LOG (WARNING)
+              << "Timeout waiting for room joins, have " << GetRoomJoins ()
+              << " of " << target;
+          return false;
+        }
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+    }
+
+  return true;
+}
+
+size_t
+GetResidentMemory ()
+{
+  /* The second field of /proc/self/statm is the resident set size
+     in pages.  This only works on Linux.  */
+  std::ifstream in("/proc/self/statm");
+  size_t total, resident;
+  if (!(in >> total >> resident))
+    return 0;
+
+  return resident * sysconf (_SC_PAGESIZE);
+}
+
+uint64_t
+GetAllocations ()
+{
+  return allocations.load (std::memory_order_relaxed);
+}
+
+void
+AllocationCounter::Report (benchmark::State& state) const
+{
+  const uint64_t total = GetAllocations () - start;
+  state.counters["allocs_per_op"]
+      = benchmark::Counter (total, benchmark::Counter::kAvgIterations);
+}
+
+/* ************************************************************************** */
+
+} // namespace xmppbroadcast
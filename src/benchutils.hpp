@@ -0,0 +1,162 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_BENCHUTILS_HPP
+#define XMPPBROADCAST_BENCHUTILS_HPP
+
+#include <xayautil/uint256.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+/**
+ * Helper for end-to-end benchmarks, which creates payloads to send and
+ * records the latency when they are received.  Each payload contains an
+ * index, which is used to look up its send time on receipt.  Payloads can
+ * be prepared and received from different threads.
+ */
+class LatencyRecorder
+{
+
+private:
+
+  using Clock = std::chrono::steady_clock;
+
+  /** Send times of all prepared payloads by index.  */
+  std::vector<Clock::time_point> sent;
+
+  /** Latencies (in microseconds) of all received payloads.  */
+  std::vector<double> latencies;
+
+  /** Mutex for the data and condition variable.  */
+  std::mutex mut;
+
+  /** Signalled when payloads are received.  */
+  std::condition_variable cv;
+
+public:
+
+  LatencyRecorder () = default;
+
+  LatencyRecorder (const LatencyRecorder&) = delete;
+  void operator= (const LatencyRecorder&) = delete;
+
+  /**
+   * Returns a new payload of the given size (at least eight bytes), and
+   * records the current time as its send time.
+   */
+  std::string Prepare (size_t size);
+
+  /**
+   * Records that the given payload has been received.  Unknown payloads
+   * are ignored.
+   */
+  void Received (const std::string& payload);
+
+  /**
+   * Waits until all prepared payloads have been received, or the timeout
+   * passes.  Returns true if all were received.
+   */
+  bool WaitForAll (std::chrono::milliseconds timeout);
+
+  /**
+   * Clears all data, e.g. after a warm-up phase.
+   */
+  void Reset ();
+
+  /**
+   * Reports the number of messages processed and latency percentiles
+   * (as counters p50_us and p99_us) to the benchmark state.
+   */
+  void Report (benchmark::State& state, size_t payloadSize);
+
+};
+
+/**
+ * Returns a new random channel ID, so that different benchmark runs
+ * do not interfere with each other.
+ */
+xaya::uint256 NewChannelId ();
+
+/**
+ * Returns the number of MUC rooms that have been joined successfully
+ * in this process so far (as counted in the library metrics).
+ */
+uint64_t GetRoomJoins ();
+
+/**
+ * Waits until the number of joined rooms reaches the given value or
+ * the timeout passes.  Returns true if all were joined.
+ */
+bool WaitForRoomJoins (uint64_t target, std::chrono::milliseconds timeout);
+
+/**
+ * Returns the resident memory of the current process in bytes, or zero
+ * if it cannot be determined.
+ */
+size_t GetResidentMemory ();
+
+/**
+ * Returns the total number of heap allocations (calls to the global
+ * operator new) made so far in the benchmark process.  This is counted
+ * by replacing operator new in the benchmark binary.
+ */
+uint64_t GetAllocations ();
+
+/**
+ * Counts the heap allocations made during a benchmark loop and reports
+ * them per iteration as counter "allocs_per_op".  Allocations from other
+ * threads are included, so this should be used for single-threaded
+ * microbenchmarks only.
+ */
+class AllocationCounter
+{
+
+private:
+
+  /** The total number of allocations at the start.  */
+  const uint64_t start;
+
+public:
+
+  AllocationCounter ()
+    : start(GetAllocations ())
+  {}
+
+  AllocationCounter (const AllocationCounter&) = delete;
+  void operator= (const AllocationCounter&) = delete;
+
+  /**
+   * Reports the allocations since construction to the benchmark state.
+   */
+  void Report (benchmark::State& state) const;
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_BENCHUTILS_HPP
@@ -0,0 +1,201 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/connectionwriter.hpp"
+
+#include "metrics.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace xmppbroadcast
+{
+
+ConnectionWriter::ConnectionWriter (const SendFcn& s, const size_t q)
+  : send(s), quantum(q), stop(false),
+    worker([this] () { Run (); })
+{}
+
+ConnectionWriter::~ConnectionWriter ()
+{
+  stop = true;
+  events.Notify ();
+  worker.join ();
+}
+
+void
+ConnectionWriter::SetWeight (const gloox::JID& room, const unsigned weight)
+{
+  CHECK_GT (weight, 0);
+
+  std::lock_guard<std::mutex> lock(mutWeights);
+  if (weight == 1)
+    weights.erase (room.bare ());
+  else
+    weights[room.bare ()] = weight;
+}
+
+void
+ConnectionWriter::Enqueue (const gloox::JID& room,
+                           std::vector<std::unique_ptr<MessageStanza>> msgs)
+{
+  if (msgs.empty ())
+    return;
+
+  Pending p;
+  p.out.room = room;
+  p.out.msgs = std::move (msgs);
+  p.enqueued = std::chrono::steady_clock::now ();
+
+  if (incoming.Push (std::move (p)))
+    events.Notify ();
+}
+
+void
+ConnectionWriter::Run ()
+{
+  auto& rounds = MetricsRegistry::Default ().GetCounter (
+      "xmppbroadcast_writer_rounds_total",
+      "Number of rounds of messages sent by the connection writer");
+  auto& deferred = MetricsRegistry::Default ().GetCounter (
+      "xmppbroadcast_writer_deferred_total",
+      "Number of times messages of a room were deferred to the next"
+      " writer round because of the fairness quantum");
+
+  /* A message waiting to be sent, with the time it was enqueued.  */
+  using Queued = std::pair<std::unique_ptr<MessageStanza>,
+                           std::chrono::steady_clock::time_point>;
+
+  /* Messages waiting to be sent for a room, and its scheduling state.  */
+  struct Backlog
+  {
+    gloox::JID room;
+    std::deque<Queued> msgs;
+    size_t deficit = 0;
+    MetricsRegistry::LabelHandle metrics;
+    Histogram* delay = nullptr;
+  };
+
+  /* Backlogs by bare room JID, and the rooms with a backlog in the
+     order they are visited.  */
+  std::map<std::string, Backlog> backlogs;
+  std::deque<std::string> active;
+
+  while (!stop)
+    {
+      for (auto& p : incoming.PopAll ())
+        {
+          const std::string key = p.out.room.bare ();
+          auto mit = backlogs.find (key);
+          if (mit == backlogs.end ())
+            {
+              mit = backlogs.emplace (key, Backlog ()).first;
+              auto& b = mit->second;
+              b.room = p.out.room;
+              b.metrics = MetricsRegistry::LabelHandle (
+                  MetricsRegistry::Default (), "room", p.out.room.username ());
+              b.delay = &MetricsRegistry::Default ().GetHistogram (
+                  "xmppbroadcast_writer_queue_seconds",
+                  "Time messages wait in the connection writer",
+                  Histogram::LatencyBounds (),
+                  {{"room", p.out.room.username ()}});
+              active.push_back (key);
+            }
+          for (auto& m : p.out.msgs)
+            mit->second.msgs.emplace_back (std::move (m), p.enqueued);
+        }
+
+      if (active.empty ())
+        {
+          const auto wait = events.PrepareWait ();
+          if (!incoming.Empty () || stop)
+            events.CancelWait ();
+          else
+            events.Wait (wait);
+          continue;
+        }
+
+      std::map<std::string, unsigned> currentWeights;
+      {
+        std::lock_guard<std::mutex> lock(mutWeights);
+        currentWeights = weights;
+      }
+
+      /* Visit each room with a backlog once, and let it send as much as
+         fits into its deficit.  Rooms that still have messages left move
+         to the back of the order and keep their deficit.  */
+      const auto now = std::chrono::steady_clock::now ();
+      std::vector<MucTransport::Outgoing> out;
+      const size_t num = active.size ();
+      for (size_t i = 0; i < num; ++i)
+        {
+          const std::string key = std::move (active.front ());
+          active.pop_front ();
+
+          auto mit = backlogs.find (key);
+          CHECK (mit != backlogs.end ());
+          auto& b = mit->second;
+
+          const auto wit = currentWeights.find (key);
+          const unsigned weight
+              = (wit == currentWeights.end () ? 1 : wit->second);
+          b.deficit += quantum * weight;
+
+          MucTransport::Outgoing cur;
+          cur.room = b.room;
+          while (!b.msgs.empty ())
+            {
+              const size_t size = b.msgs.front ().first->GetData ().size ();
+              if (quantum > 0 && size > b.deficit)
+                break;
+              b.deficit -= std::min (size, b.deficit);
+
+              b.delay->ObserveDuration (now - b.msgs.front ().second);
+              cur.msgs.push_back (std::move (b.msgs.front ().first));
+              b.msgs.pop_front ();
+            }
+          if (!cur.msgs.empty ())
+            out.push_back (std::move (cur));
+
+          if (b.msgs.empty ())
+            backlogs.erase (mit);
+          else
+            {
+              deferred.Increment ();
+              active.push_back (key);
+            }
+        }
+
+      /* With large messages, it can take a few rounds until a room
+         has enough deficit to send anything.  */
+      if (out.empty ())
+        continue;
+
+      VLOG (2) << "Writer sending to " << out.size () << " rooms";
+      rounds.Increment ();
+      send (std::move (out));
+    }
+}
+
+} // namespace xmppbroadcast
@@ -0,0 +1,223 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/connectionwriter.hpp"
+
+#include <gtest/gtest.h>
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+/**
+ * Records the rounds sent by a ConnectionWriter.  The first round blocks
+ * until released, so that tests can build up a backlog.
+ */
+class RoundRecorder
+{
+
+private:
+
+  std::mutex mut;
+  std::condition_variable cv;
+
+  /** Whether the first round may complete.  */
+  bool released = false;
+
+  /** Per round, the messages sent to each room.  */
+  std::vector<std::map<std::string, std::vector<std::string>>> rounds;
+
+  /** Total number of messages sent.  */
+  size_t total = 0;
+
+public:
+
+  void
+  Send (std::vector<MucTransport::Outgoing> out)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    cv.wait (lock, [this] () { return released; });
+
+    rounds.emplace_back ();
+    for (const auto& o : out)
+      for (const auto& m : o.msgs)
+        {
+          rounds.back ()[o.room.bare ()].push_back (m->GetData ());
+          ++total;
+        }
+    cv.notify_all ();
+  }
+
+  void
+  Release ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    released = true;
+    cv.notify_all ();
+  }
+
+  /**
+   * Waits for the given total number of messages, and returns
+   * the rounds sent.
+   */
+  std::vector<std::map<std::string, std::vector<std::string>>>
+  WaitFor (const size_t num)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    cv.wait (lock, [this, num] () { return total >= num; });
+    return rounds;
+  }
+
+};
+
+/**
+ * Constructs a list of messages.
+ */
+std::vector<std::unique_ptr<MessageStanza>>
+Messages (const std::vector<std::string>& data)
+{
+  std::vector<std::unique_ptr<MessageStanza>> res;
+  for (const auto& d : data)
+    res.push_back (std::make_unique<MessageStanza> (d));
+  return res;
+}
+
+using ConnectionWriterTests = testing::Test;
+
+TEST_F (ConnectionWriterTests, FairRounds)
+{
+  const gloox::JID room1("room1@muc.example.com");
+  const gloox::JID room2("room2@muc.example.com");
+
+  RoundRecorder rec;
+  ConnectionWriter writer([&rec] (std::vector<MucTransport::Outgoing> out)
+    {
+      rec.Send (std::move (out));
+    }, 2);
+
+  /* The first message is picked up right away, and its round blocks
+     until we release it.  In the mean time, we build up backlogs.  */
+  writer.Enqueue (room1, Messages ({"0"}));
+  writer.Enqueue (room1, Messages ({"a", "b", "c", "d", "e"}));
+  writer.Enqueue (room2, Messages ({"x"}));
+  writer.Enqueue (room1, Messages ({"f"}));
+  writer.Enqueue (room2, Messages ({"y", "z"}));
+  rec.Release ();
+
+  const auto rounds = rec.WaitFor (10);
+
+  /* With a quantum of two bytes, each room gets at most two messages
+     of one byte per round, and their order is kept.
+     Room2 is not starved by the larger backlog of room1.  */
+  std::vector<std::string> all1, all2;
+  for (const auto& r : rounds)
+    for (const auto& entry : r)
+      {
+        EXPECT_LE (entry.second.size (), 2);
+        auto& all = (entry.first == room1.bare () ? all1 : all2);
+        all.insert (all.end (), entry.second.begin (), entry.second.end ());
+      }
+  EXPECT_EQ (all1, std::vector<std::string> (
+      {"0", "a", "b", "c", "d", "e", "f"}));
+  EXPECT_EQ (all2, std::vector<std::string> ({"x", "y", "z"}));
+
+  /* Room2's messages are all sent before room1's backlog is done.  */
+  ASSERT_GE (rounds.size (), 4);
+  EXPECT_EQ (rounds.back ().count (room2.bare ()), 0);
+}
+
+TEST_F (ConnectionWriterTests, Weights)
+{
+  const gloox::JID room1("room1@muc.example.com");
+  const gloox::JID room2("room2@muc.example.com");
+
+  RoundRecorder rec;
+  ConnectionWriter writer([&rec] (std::vector<MucTransport::Outgoing> out)
+    {
+      rec.Send (std::move (out));
+    }, 2);
+  writer.SetWeight (room1, 3);
+
+  writer.Enqueue (room2, Messages ({"0"}));
+  writer.Enqueue (room1, Messages ({"a", "b", "c", "d", "e", "f", "g"}));
+  writer.Enqueue (room2, Messages ({"v", "w", "x", "y", "z"}));
+  rec.Release ();
+
+  /* Room1 gets three times the bandwidth of room2.  */
+  const auto rounds = rec.WaitFor (13);
+  for (const auto& r : rounds)
+    for (const auto& entry : r)
+      EXPECT_LE (entry.second.size (), entry.first == room1.bare () ? 6 : 2);
+  EXPECT_EQ (rounds.back ().count (room1.bare ()), 0);
+}
+
+TEST_F (ConnectionWriterTests, LargeMessages)
+{
+  const gloox::JID room1("room1@muc.example.com");
+  const gloox::JID room2("room2@muc.example.com");
+
+  RoundRecorder rec;
+  ConnectionWriter writer([&rec] (std::vector<MucTransport::Outgoing> out)
+    {
+      rec.Send (std::move (out));
+    }, 2);
+
+  /* Messages larger than the quantum are sent once enough deficit
+     has accumulated.  */
+  writer.Enqueue (room1, Messages ({"0"}));
+  writer.Enqueue (room1, Messages ({"large message"}));
+  writer.Enqueue (room2, Messages ({"a", "b", "c"}));
+  rec.Release ();
+
+  const auto rounds = rec.WaitFor (5);
+  EXPECT_EQ (rounds.back ().count (room2.bare ()), 0);
+  EXPECT_EQ (rounds.back ().at (room1.bare ()),
+             std::vector<std::string> ({"large message"}));
+}
+
+TEST_F (ConnectionWriterTests, UnlimitedQuantum)
+{
+  const gloox::JID room("room@muc.example.com");
+
+  RoundRecorder rec;
+  ConnectionWriter writer([&rec] (std::vector<MucTransport::Outgoing> out)
+    {
+      rec.Send (std::move (out));
+    }, 0);
+
+  writer.Enqueue (room, Messages ({"first"}));
+  writer.Enqueue (room, Messages ({"a", "b", "c", "d", "e"}));
+  rec.Release ();
+
+  /* Depending on timing, the first message may or may not be sent
+     in the same round as the others, but the backlog is sent at once.  */
+  const auto rounds = rec.WaitFor (6);
+  ASSERT_LE (rounds.size (), 2);
+  EXPECT_GE (rounds.back ().at (room.bare ()).size (), 5);
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
@@ -0,0 +1,72 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/dedup.hpp"
+
+#include <xayautil/hash.hpp>
+
+#include <glog/logging.h>
+
+namespace xmppbroadcast
+{
+
+DuplicateFilter::DuplicateFilter (const size_t cap, const Clock::duration age)
+  : capacity(cap), maxAge(age)
+{
+  CHECK_GT (capacity, 0);
+}
+
+void
+DuplicateFilter::Expire (const Clock::time_point now)
+{
+  while (!entries.empty () && now - entries.back ().lastSeen > maxAge)
+    {
+      byDigest.erase (entries.back ().digest);
+      entries.pop_back ();
+    }
+}
+
+bool
+DuplicateFilter::IsDuplicate (const std::string& payload,
+                              const Clock::time_point now)
+{
+  Expire (now);
+
+  const xaya::uint256 digest = xaya::SHA256::Hash (payload);
+  const auto mit = byDigest.find (digest);
+  if (mit != byDigest.end ())
+    {
+      /* Move the entry to the front, as it has been seen again.  */
+      mit->second->lastSeen = now;
+      entries.splice (entries.begin (), entries, mit->second);
+      return true;
+    }
+
+  if (entries.size () >= capacity)
+    {
+      byDigest.erase (entries.back ().digest);
+      entries.pop_back ();
+    }
+
+  entries.push_front ({digest, now});
+  byDigest.emplace (digest, entries.begin ());
+
+  return false;
+}
+
+} // namespace xmppbroadcast
@@ -0,0 +1,120 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/dedup.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstring>
+#include <string>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+class DuplicateFilterTests : public testing::Test
+{
+
+protected:
+
+  /** A fixed starting time for the tests.  */
+  const DuplicateFilter::Clock::time_point start;
+
+  DuplicateFilterTests ()
+    : start(DuplicateFilter::Clock::now ())
+  {}
+
+  /**
+   * Returns the time at the given number of seconds after start.
+   */
+  DuplicateFilter::Clock::time_point
+  At (const int seconds) const
+  {
+    return start + std::chrono::seconds (seconds);
+  }
+
+};
+
+TEST_F (DuplicateFilterTests, Basic)
+{
+  DuplicateFilter filter(10, std::chrono::minutes (1));
+
+  EXPECT_FALSE (filter.IsDuplicate ("foo", At (0)));
+  EXPECT_FALSE (filter.IsDuplicate ("bar", At (0)));
+  EXPECT_TRUE (filter.IsDuplicate ("foo", At (1)));
+  EXPECT_TRUE (filter.IsDuplicate ("bar", At (1)));
+  EXPECT_FALSE (filter.IsDuplicate ("baz", At (1)));
+  EXPECT_FALSE (filter.IsDuplicate ("", At (1)));
+  EXPECT_TRUE (filter.IsDuplicate ("", At (1)));
+  EXPECT_EQ (filter.Size (), 4);
+}
+
+TEST_F (DuplicateFilterTests, DistinctPayloadsOfSameSize)
+{
+  DuplicateFilter filter(10'000, std::chrono::minutes (1));
+
+  /* Payloads are compared by a cryptographic hash, so none of these
+     can be mistaken for each other.  */
+  for (unsigned i = 0; i < 10'000; ++i)
+    {
+      std::string payload(sizeof (i), '\0');
+      std::memcpy (&payload[0], &i, sizeof (i));
+      ASSERT_FALSE (filter.IsDuplicate (payload, At (0))) << i;
+    }
+  EXPECT_EQ (filter.Size (), 10'000);
+}
+
+TEST_F (DuplicateFilterTests, Capacity)
+{
+  DuplicateFilter filter(2, std::chrono::minutes (1));
+
+  EXPECT_FALSE (filter.IsDuplicate ("a", At (0)));
+  EXPECT_FALSE (filter.IsDuplicate ("b", At (0)));
+
+  /* Seeing a again makes b the least-recently used one.  */
+  EXPECT_TRUE (filter.IsDuplicate ("a", At (0)));
+  EXPECT_FALSE (filter.IsDuplicate ("c", At (0)));
+  EXPECT_EQ (filter.Size (), 2);
+
+  EXPECT_TRUE (filter.IsDuplicate ("a", At (0)));
+  EXPECT_TRUE (filter.IsDuplicate ("c", At (0)));
+  EXPECT_FALSE (filter.IsDuplicate ("b", At (0)));
+}
+
+TEST_F (DuplicateFilterTests, Expiry)
+{
+  DuplicateFilter filter(10, std::chrono::seconds (10));
+
+  EXPECT_FALSE (filter.IsDuplicate ("a", At (0)));
+  EXPECT_FALSE (filter.IsDuplicate ("b", At (5)));
+  EXPECT_TRUE (filter.IsDuplicate ("a", At (10)));
+  EXPECT_TRUE (filter.IsDuplicate ("b", At (15)));
+
+  /* a was last seen at 10, b at 15.  */
+  EXPECT_FALSE (filter.IsDuplicate ("a", At (21)));
+  EXPECT_TRUE (filter.IsDuplicate ("b", At (21)));
+  EXPECT_EQ (filter.Size (), 2);
+
+  EXPECT_FALSE (filter.IsDuplicate ("c", At (100)));
+  EXPECT_EQ (filter.Size (), 1);
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
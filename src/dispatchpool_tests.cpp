@@ -0,0 +1,199 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/dispatchpool.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+using DispatchPoolTests = testing::Test;
+
+TEST_F (DispatchPoolTests, OrderPerKey)
+{
+  constexpr size_t keys = 10;
+  constexpr int perKey = 1'000;
+
+  std::mutex mut;
+  std::vector<std::vector<int>> received(keys);
+
+  DispatchPool pool(3, 100);
+  for (int i = 0; i < perKey; ++i)
+    for (size_t k = 0; k < keys; ++k)
+      pool.Post (k, &received[k], [&, k, i] ()
+        {
+          std::lock_guard<std::mutex> lock(mut);
+          received[k].push_back (i);
+        });
+
+  for (size_t k = 0; k < keys; ++k)
+    pool.Flush (k);
+
+  for (size_t k = 0; k < keys; ++k)
+    {
+      ASSERT_EQ (received[k].size (), perKey);
+      for (int i = 0; i < perKey; ++i)
+        EXPECT_EQ (received[k][i], i);
+    }
+}
+
+TEST_F (DispatchPoolTests, Cancel)
+{
+  DispatchPool pool(1, 100);
+
+  std::atomic<bool> started(false);
+  std::atomic<bool> release(false);
+  std::atomic<int> runA(0);
+  std::atomic<int> runB(0);
+  int a, b;
+
+  pool.Post (0, &a, [&] ()
+    {
+      started = true;
+      while (!release)
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+      ++runA;
+    });
+  for (int i = 0; i < 10; ++i)
+    {
+      pool.Post (0, &a, [&] () { ++runA; });
+      pool.Post (0, &b, [&] () { ++runB; });
+    }
+
+  while (!started)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  /* Cancel waits for the running task of a to finish.  */
+  std::thread releaser([&] ()
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+      release = true;
+    });
+  pool.Cancel (0, &a);
+  EXPECT_EQ (runA, 1);
+  releaser.join ();
+
+  pool.Flush (0);
+  EXPECT_EQ (runA, 1);
+  EXPECT_EQ (runB, 10);
+}
+
+TEST_F (DispatchPoolTests, CancelUnblocksPost)
+{
+  DispatchPool pool(1, 1);
+
+  int owner;
+  std::atomic<bool> stopped(false);
+  std::atomic<bool> posting(false);
+  std::atomic<int> runs(0);
+
+  /* The running task stops posting for the owner and cancels it, like
+     a task destroying a channel would.  Meanwhile another thread is
+     blocked posting to the full queue, and must drop its task instead
+     of queueing it once there is space.  */
+  pool.Post (0, &owner, [&] ()
+    {
+      while (!posting)
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+      std::this_thread::sleep_for (std::chrono::milliseconds (50));
+
+      stopped = true;
+      pool.Cancel (0, &owner);
+      ++runs;
+    });
+  pool.Post (0, &owner, [&] () { ++runs; });
+
+  std::thread poster([&] ()
+    {
+      posting = true;
+      pool.Post (0, &owner, [&] () { ++runs; },
+                 [&] () { return stopped.load (); });
+    });
+  poster.join ();
+
+  pool.Flush (0);
+  EXPECT_EQ (runs, 1);
+}
+
+TEST_F (DispatchPoolTests, BoundedQueue)
+{
+  DispatchPool pool(1, 2);
+
+  std::atomic<bool> release(false);
+  std::atomic<int> done(0);
+  int owner;
+
+  const auto task = [&] ()
+    {
+      while (!release)
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+      ++done;
+    };
+
+  /* One task is running and two are queued, so the fourth blocks until
+     the tasks are released.  */
+  std::atomic<int> posted(0);
+  std::thread poster([&] ()
+    {
+      for (int i = 0; i < 4; ++i)
+        {
+          pool.Post (0, &owner, task);
+          ++posted;
+        }
+    });
+
+  std::this_thread::sleep_for (std::chrono::milliseconds (50));
+  EXPECT_EQ (posted, 3);
+
+  release = true;
+  poster.join ();
+  pool.Flush (0);
+  EXPECT_EQ (done, 4);
+}
+
+TEST_F (DispatchPoolTests, PostFromTaskDoesNotBlock)
+{
+  DispatchPool pool(1, 1);
+
+  std::atomic<int> done(0);
+  int owner;
+
+  /* The queue is full while the first task posts its follow-ups,
+     but that must not deadlock.  */
+  pool.Post (0, &owner, [&] ()
+    {
+      for (int i = 0; i < 3; ++i)
+        pool.Post (0, &owner, [&] () { ++done; });
+    });
+
+  pool.Flush (0);
+  pool.Flush (0);
+  EXPECT_EQ (done, 3);
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
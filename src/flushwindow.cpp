@@ -0,0 +1,78 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/flushwindow.hpp"
+
+#include <algorithm>
+
+namespace xmppbroadcast
+{
+
+namespace
+{
+
+/** Weight of a new sample in the smoothed rate estimate.  */
+constexpr double RATE_SMOOTHING = 0.25;
+
+/**
+ * If nothing was flushed for this many times the maximum delay, traffic
+ * is considered idle regardless of the rate estimate.
+ */
+constexpr int IDLE_FACTOR = 2;
+
+} // anonymous namespace
+
+FlushWindow::FlushWindow (const Clock::duration d)
+  : maxDelay(d)
+{}
+
+FlushWindow::Clock::duration
+FlushWindow::GetDelay (const Clock::time_point now) const
+{
+  if (maxDelay <= Clock::duration::zero ())
+    return Clock::duration::zero ();
+
+  /* After a pause, the messages are sent right away.  The flush then
+     lowers the rate estimate as well.  */
+  if (now - lastFlush > IDLE_FACTOR * maxDelay)
+    return Clock::duration::zero ();
+
+  /* Only hold back if we expect at least one more message to arrive
+     during the window; otherwise it would just add latency.  */
+  const std::chrono::duration<double> window = maxDelay;
+  if (rate * window.count () < 1.0)
+    return Clock::duration::zero ();
+
+  return maxDelay;
+}
+
+void
+FlushWindow::Flushed (const size_t num, const Clock::time_point now)
+{
+  /* Clamp the interval, so that two flushes at the same time (e.g. with
+     a coarse clock) do not yield an infinite rate.  */
+  const std::chrono::duration<double> elapsed
+      = std::max<Clock::duration> (now - lastFlush,
+                                   std::chrono::microseconds (1));
+  const double sample = num / elapsed.count ();
+
+  rate = RATE_SMOOTHING * sample + (1.0 - RATE_SMOOTHING) * rate;
+  lastFlush = now;
+}
+
+} // namespace xmppbroadcast
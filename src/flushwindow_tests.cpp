@@ -0,0 +1,118 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/flushwindow.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+using FlushWindowTests = testing::Test;
+
+TEST_F (FlushWindowTests, Disabled)
+{
+  FlushWindow::Clock::time_point now;
+  FlushWindow window(microseconds (0));
+
+  for (unsigned i = 0; i < 100; ++i)
+    {
+      now += microseconds (10);
+      window.Flushed (10, now);
+    }
+  EXPECT_EQ (window.GetDelay (now), microseconds (0));
+}
+
+TEST_F (FlushWindowTests, IdleSendsImmediately)
+{
+  FlushWindow::Clock::time_point now;
+  FlushWindow window(microseconds (200));
+
+  /* Single messages every 10ms are too rare to wait for more.  */
+  for (unsigned i = 0; i < 10; ++i)
+    {
+      now += milliseconds (10);
+      EXPECT_EQ (window.GetDelay (now), microseconds (0));
+      window.Flushed (1, now);
+    }
+}
+
+TEST_F (FlushWindowTests, HoldsUnderLoad)
+{
+  FlushWindow::Clock::time_point now;
+  FlushWindow window(microseconds (200));
+
+  /* Batches of 10 messages every 100us, i.e. 100k messages per second.  */
+  for (unsigned i = 0; i < 20; ++i)
+    {
+      now += microseconds (100);
+      window.Flushed (10, now);
+    }
+  EXPECT_GT (window.GetRate (), 50'000);
+  EXPECT_EQ (window.GetDelay (now + microseconds (50)), microseconds (200));
+}
+
+TEST_F (FlushWindowTests, AdaptsWhenTrafficStops)
+{
+  FlushWindow::Clock::time_point now;
+  FlushWindow window(microseconds (200));
+
+  for (unsigned i = 0; i < 20; ++i)
+    {
+      now += microseconds (100);
+      window.Flushed (10, now);
+    }
+
+  /* After a pause, the next message is sent right away even though the
+     rate estimate is still high.  */
+  now += milliseconds (5);
+  EXPECT_EQ (window.GetDelay (now), microseconds (0));
+
+  /* When messages keep arriving only occasionally, the estimate drops
+     and they are not held back anymore even when close together.  */
+  for (unsigned i = 0; i < 20; ++i)
+    {
+      window.Flushed (1, now);
+      now += milliseconds (5);
+    }
+  EXPECT_LT (window.GetRate (), 1'000);
+  window.Flushed (1, now);
+  EXPECT_EQ (window.GetDelay (now + microseconds (100)), microseconds (0));
+}
+
+TEST_F (FlushWindowTests, SameTimeFlushes)
+{
+  FlushWindow::Clock::time_point now;
+  FlushWindow window(microseconds (200));
+
+  now += microseconds (100);
+  window.Flushed (1, now);
+  window.Flushed (1, now);
+  EXPECT_GT (window.GetRate (), 0);
+  EXPECT_EQ (window.GetDelay (now), microseconds (200));
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
@@ -0,0 +1,142 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/fragments.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace xmppbroadcast
+{
+
+std::vector<std::string>
+SplitPayload (const std::string& data, const size_t maxSize)
+{
+  CHECK_GT (maxSize, 0);
+
+  std::vector<std::string> res;
+  res.reserve (std::max<size_t> (1, (data.size () + maxSize - 1) / maxSize));
+  for (size_t pos = 0; pos < data.size (); pos += maxSize)
+    res.push_back (data.substr (pos, maxSize));
+  if (res.empty ())
+    res.emplace_back ();
+
+  return res;
+}
+
+FragmentBuffer::FragmentBuffer (const size_t b, const Clock::duration t)
+  : maxBytes(b), timeout(t)
+{}
+
+void
+FragmentBuffer::Remove (const std::list<Entry>::iterator it,
+                        const bool complete)
+{
+  if (!complete)
+    {
+      VLOG (1)
+          << "Dropping partial message " << it->id << " from " << it->sender
+          << " with " << it->next << " of " << it->count << " fragments";
+      ++dropped;
+    }
+
+  bytes -= it->data.size ();
+  bySender.erase (it->sender);
+  entries.erase (it);
+}
+
+void
+FragmentBuffer::Expire (const Clock::time_point now)
+{
+  while (!entries.empty () && now - entries.front ().started > timeout)
+    Remove (entries.begin (), false);
+}
+
+FragmentBuffer::Result
+FragmentBuffer::Add (const std::string& sender, const uint64_t id,
+                     const unsigned index, const unsigned count,
+                     const std::string& data, std::string& msg,
+                     const Clock::time_point now)
+{
+  Expire (now);
+
+  if (index >= count)
+    return Result::DROPPED;
+
+  auto mit = bySender.find (sender);
+  if (mit != bySender.end ())
+    {
+      const auto it = mit->second;
+      if (it->id != id || it->next != index || it->count != count)
+        {
+          /* A fragment of a different message or out of sequence means
+             that we missed something.  The buffered data is useless then,
+             but the fragment may start a new message.  */
+          Remove (it, false);
+          mit = bySender.end ();
+        }
+    }
+
+  if (mit == bySender.end ())
+    {
+      if (index != 0)
+        return Result::DROPPED;
+
+      /* A single fragment is a complete message by itself.  */
+      if (count == 1)
+        {
+          msg = data;
+          return Result::COMPLETE;
+        }
+
+      entries.push_back ({sender, id, count, 0, std::string (), now});
+      mit = bySender.emplace (sender, std::prev (entries.end ())).first;
+    }
+
+  const auto it = mit->second;
+  it->data += data;
+  ++it->next;
+  bytes += data.size ();
+
+  if (it->next == it->count)
+    {
+      bytes -= it->data.size ();
+      msg = std::move (it->data);
+      it->data.clear ();
+      Remove (it, true);
+      return Result::COMPLETE;
+    }
+
+  /* Enforce the memory limit by dropping the oldest partial messages,
+     which may include the current one.  */
+  bool self = false;
+  while (bytes > maxBytes)
+    {
+      CHECK (!entries.empty ());
+      if (entries.begin () == it)
+        self = true;
+      Remove (entries.begin (), false);
+      if (self)
+        break;
+    }
+
+  return self ? Result::DROPPED : Result::INCOMPLETE;
+}
+
+} // namespace xmppbroadcast
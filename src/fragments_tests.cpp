@@ -0,0 +1,165 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/fragments.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+using SplitPayloadTests = testing::Test;
+
+TEST_F (SplitPayloadTests, Works)
+{
+  EXPECT_EQ (SplitPayload ("", 3), std::vector<std::string> ({""}));
+  EXPECT_EQ (SplitPayload ("ab", 3), std::vector<std::string> ({"ab"}));
+  EXPECT_EQ (SplitPayload ("abc", 3), std::vector<std::string> ({"abc"}));
+  EXPECT_EQ (SplitPayload ("abcdefg", 3),
+             std::vector<std::string> ({"abc", "def", "g"}));
+}
+
+class FragmentBufferTests : public testing::Test
+{
+
+protected:
+
+  using Result = FragmentBuffer::Result;
+
+  /** A fixed starting time for the tests.  */
+  const FragmentBuffer::Clock::time_point start;
+
+  /** Output for completed messages.  */
+  std::string msg;
+
+  FragmentBufferTests ()
+    : start(FragmentBuffer::Clock::now ())
+  {}
+
+  /**
+   * Returns the time at the given number of seconds after start.
+   */
+  FragmentBuffer::Clock::time_point
+  At (const int seconds) const
+  {
+    return start + std::chrono::seconds (seconds);
+  }
+
+};
+
+TEST_F (FragmentBufferTests, Reassembly)
+{
+  FragmentBuffer buf(1'000, std::chrono::minutes (1));
+
+  EXPECT_EQ (buf.Add ("a", 1, 0, 3, "foo", msg, At (0)), Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("b", 1, 0, 2, "xy", msg, At (0)), Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("a", 1, 1, 3, "bar", msg, At (1)), Result::INCOMPLETE);
+  EXPECT_EQ (buf.Size (), 2);
+  EXPECT_EQ (buf.GetBytes (), 8);
+
+  EXPECT_EQ (buf.Add ("b", 1, 1, 2, "z", msg, At (1)), Result::COMPLETE);
+  EXPECT_EQ (msg, "xyz");
+  EXPECT_EQ (buf.Add ("a", 1, 2, 3, "baz", msg, At (2)), Result::COMPLETE);
+  EXPECT_EQ (msg, "foobarbaz");
+
+  EXPECT_EQ (buf.Size (), 0);
+  EXPECT_EQ (buf.GetBytes (), 0);
+  EXPECT_EQ (buf.TakeDropped (), 0);
+}
+
+TEST_F (FragmentBufferTests, SingleFragment)
+{
+  FragmentBuffer buf(1'000, std::chrono::minutes (1));
+  EXPECT_EQ (buf.Add ("a", 1, 0, 1, "foo", msg, At (0)), Result::COMPLETE);
+  EXPECT_EQ (msg, "foo");
+  EXPECT_EQ (buf.Size (), 0);
+}
+
+TEST_F (FragmentBufferTests, OutOfSequence)
+{
+  FragmentBuffer buf(1'000, std::chrono::minutes (1));
+
+  /* Without the start, later fragments are dropped.  */
+  EXPECT_EQ (buf.Add ("a", 1, 1, 3, "bar", msg, At (0)), Result::DROPPED);
+  EXPECT_EQ (buf.TakeDropped (), 0);
+
+  /* A missing fragment drops the partial message.  */
+  EXPECT_EQ (buf.Add ("a", 2, 0, 3, "foo", msg, At (0)), Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("a", 2, 2, 3, "baz", msg, At (0)), Result::DROPPED);
+  EXPECT_EQ (buf.TakeDropped (), 1);
+  EXPECT_EQ (buf.Size (), 0);
+
+  /* A new message from the same sender replaces a partial one.  */
+  EXPECT_EQ (buf.Add ("a", 3, 0, 2, "foo", msg, At (0)), Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("a", 4, 0, 2, "abc", msg, At (0)), Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("a", 4, 1, 2, "def", msg, At (0)), Result::COMPLETE);
+  EXPECT_EQ (msg, "abcdef");
+  EXPECT_EQ (buf.TakeDropped (), 1);
+
+  /* Invalid indices are rejected.  */
+  EXPECT_EQ (buf.Add ("a", 5, 2, 2, "foo", msg, At (0)), Result::DROPPED);
+  EXPECT_EQ (buf.Size (), 0);
+}
+
+TEST_F (FragmentBufferTests, Timeout)
+{
+  FragmentBuffer buf(1'000, std::chrono::seconds (10));
+
+  EXPECT_EQ (buf.Add ("a", 1, 0, 2, "foo", msg, At (0)), Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("b", 1, 0, 2, "foo", msg, At (5)), Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("a", 1, 1, 2, "bar", msg, At (11)), Result::DROPPED);
+  EXPECT_EQ (buf.Add ("b", 1, 1, 2, "bar", msg, At (11)), Result::COMPLETE);
+  EXPECT_EQ (msg, "foobar");
+  EXPECT_EQ (buf.TakeDropped (), 1);
+  EXPECT_EQ (buf.GetBytes (), 0);
+}
+
+TEST_F (FragmentBufferTests, MemoryLimit)
+{
+  FragmentBuffer buf(10, std::chrono::minutes (1));
+
+  /* The oldest partial message is dropped to make room.  */
+  EXPECT_EQ (buf.Add ("a", 1, 0, 3, "12345", msg, At (0)),
+             Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("b", 1, 0, 3, "12345", msg, At (1)),
+             Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("b", 1, 1, 3, "12", msg, At (2)), Result::INCOMPLETE);
+  EXPECT_EQ (buf.TakeDropped (), 1);
+  EXPECT_EQ (buf.Size (), 1);
+  EXPECT_EQ (buf.GetBytes (), 7);
+
+  /* A message that does not fit by itself is dropped as well.  */
+  EXPECT_EQ (buf.Add ("b", 1, 2, 3, "abcd", msg, At (3)), Result::COMPLETE);
+  EXPECT_EQ (msg, "1234512abcd");
+  EXPECT_EQ (buf.Add ("c", 1, 0, 3, "12345", msg, At (3)),
+             Result::INCOMPLETE);
+  EXPECT_EQ (buf.Add ("c", 1, 1, 3, "123456", msg, At (3)), Result::DROPPED);
+  EXPECT_EQ (buf.Add ("c", 1, 2, 3, "x", msg, At (3)), Result::DROPPED);
+  EXPECT_EQ (buf.TakeDropped (), 1);
+  EXPECT_EQ (buf.Size (), 0);
+  EXPECT_EQ (buf.GetBytes (), 0);
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
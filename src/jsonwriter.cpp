@@ -0,0 +1,186 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/jsonwriter.hpp"
+
+#include <cstdio>
+
+namespace xmppbroadcast
+{
+
+namespace
+{
+
+/** The base64 alphabet.  */
+constexpr const char* BASE64_CHARS
+    = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+} // anonymous namespace
+
+void
+JsonWriter::Separator ()
+{
+  if (needComma)
+    out += ',';
+  needComma = true;
+}
+
+void
+JsonWriter::BeginObject ()
+{
+  Separator ();
+  out += '{';
+  needComma = false;
+}
+
+void
+JsonWriter::EndObject ()
+{
+  out += '}';
+  needComma = true;
+}
+
+void
+JsonWriter::BeginArray ()
+{
+  Separator ();
+  out += '[';
+  needComma = false;
+}
+
+void
+JsonWriter::EndArray ()
+{
+  out += ']';
+  needComma = true;
+}
+
+void
+JsonWriter::Key (const char* key)
+{
+  Separator ();
+  out += '"';
+  out += key;
+  out += "\":";
+  needComma = false;
+}
+
+void
+JsonWriter::Int (const int64_t val)
+{
+  Separator ();
+  out += std::to_string (val);
+}
+
+void
+JsonWriter::UInt (const uint64_t val)
+{
+  Separator ();
+  out += std::to_string (val);
+}
+
+void
+JsonWriter::Bool (const bool val)
+{
+  Separator ();
+  out += (val ? "true" : "false");
+}
+
+void
+JsonWriter::String (const std::string& val)
+{
+  Separator ();
+  out += '"';
+  for (const char c : val)
+    switch (c)
+      {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char> (c) < 0x20)
+          {
+            char buf[8];
+            std::snprintf (buf, sizeof (buf), "\\u%04x",
+                           static_cast<unsigned> (c));
+            out += buf;
+          }
+        else
+          out += c;
+        break;
+      }
+  out += '"';
+}
+
+void
+JsonWriter::Base64 (const std::string& data)
+{
+  Separator ();
+
+  const size_t start = out.size ();
+  out.resize (start + Base64Size (data.size ()));
+  char* ptr = &out[start];
+
+  *(ptr++) = '"';
+
+  const auto* in = reinterpret_cast<const unsigned char*> (data.data ());
+  size_t remaining = data.size ();
+  for (; remaining >= 3; in += 3, remaining -= 3)
+    {
+      const uint32_t block = (in[0] << 16) | (in[1] << 8) | in[2];
+      *(ptr++) = BASE64_CHARS[(block >> 18) & 0x3F];
+      *(ptr++) = BASE64_CHARS[(block >> 12) & 0x3F];
+      *(ptr++) = BASE64_CHARS[(block >> 6) & 0x3F];
+      *(ptr++) = BASE64_CHARS[block & 0x3F];
+    }
+
+  if (remaining > 0)
+    {
+      uint32_t block = in[0] << 16;
+      if (remaining == 2)
+        block |= in[1] << 8;
+
+      *(ptr++) = BASE64_CHARS[(block >> 18) & 0x3F];
+      *(ptr++) = BASE64_CHARS[(block >> 12) & 0x3F];
+      *(ptr++) = (remaining == 2 ? BASE64_CHARS[(block >> 6) & 0x3F] : '=');
+      *(ptr++) = '=';
+    }
+
+  *(ptr++) = '"';
+}
+
+void
+JsonWriter::Raw (const std::string& json)
+{
+  Separator ();
+  out += json;
+}
+
+} // namespace xmppbroadcast
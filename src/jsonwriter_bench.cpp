@@ -0,0 +1,133 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Benchmarks for writing the JSON response of a receive call, comparing
+   our JsonWriter to building a Json::Value and serialising it with
+   jsoncpp (as jsonrpccpp does).  */
+
+#include "private/jsonwriter.hpp"
+
+#include <xayautil/base64.hpp>
+
+#include <json/json.h>
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+/**
+ * Constructs a list of (binary) messages of the given number and size.
+ */
+std::vector<std::string>
+GetMessages (const size_t num, const size_t size)
+{
+  std::vector<std::string> res;
+  for (size_t i = 0; i < num; ++i)
+    {
+      std::string msg(size, '\0');
+      for (size_t j = 0; j < size; ++j)
+        msg[j] = static_cast<char> (i + j);
+      res.push_back (std::move (msg));
+    }
+  return res;
+}
+
+/**
+ * Sets the arguments for the receive benchmarks, which are the number
+ * of messages and their size.
+ */
+void
+ReceiveArgs (benchmark::internal::Benchmark* b)
+{
+  for (const int num : {1, 10, 100, 1'000})
+    for (const int size : {32, 1'024, 16'384})
+      b->Args ({num, size});
+}
+
+/**
+ * Sets the bytes processed for a receive benchmark.
+ */
+void
+SetBytesProcessed (benchmark::State& state)
+{
+  state.SetBytesProcessed (state.iterations ()
+                            * state.range (0) * state.range (1));
+}
+
+void
+ReceiveJsonCpp (benchmark::State& state)
+{
+  const auto messages = GetMessages (state.range (0), state.range (1));
+
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+
+  for (auto _ : state)
+    {
+      Json::Value msgArr(Json::arrayValue);
+      for (const auto& m : messages)
+        msgArr.append (xaya::EncodeBase64 (m));
+
+      Json::Value res(Json::objectValue);
+      res["messages"] = msgArr;
+      res["seq"] = static_cast<Json::Int64> (messages.size ());
+
+      const std::string out = Json::writeString (builder, res);
+      benchmark::DoNotOptimize (out.data ());
+    }
+
+  SetBytesProcessed (state);
+}
+BENCHMARK (ReceiveJsonCpp)->Apply (ReceiveArgs);
+
+void
+ReceiveJsonWriter (benchmark::State& state)
+{
+  const auto messages = GetMessages (state.range (0), state.range (1));
+
+  /* The output buffer is reused between iterations, as it would be
+     if the server reused its response buffers.  */
+  std::string out;
+  for (auto _ : state)
+    {
+      out.clear ();
+      JsonWriter w(out);
+      w.BeginObject ();
+      w.Key ("messages");
+      w.BeginArray ();
+      for (const auto& m : messages)
+        w.Base64 (m);
+      w.EndArray ();
+      w.Key ("seq");
+      w.UInt (messages.size ());
+      w.EndObject ();
+      benchmark::DoNotOptimize (out.data ());
+    }
+
+  SetBytesProcessed (state);
+}
+BENCHMARK (ReceiveJsonWriter)->Apply (ReceiveArgs);
+
+} // anonymous namespace
+} // namespace xmppbroadcast
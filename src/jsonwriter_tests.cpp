@@ -0,0 +1,106 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/jsonwriter.hpp"
+
+#include <json/json.h>
+
+#include <gtest/gtest.h>
+
+#include <sstream>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+/**
+ * Parses a given string as JSON.
+ */
+Json::Value
+ParseJson (const std::string& str)
+{
+  std::istringstream in(str);
+  Json::Value res;
+  in >> res;
+  return res;
+}
+
+using JsonWriterTests = testing::Test;
+
+TEST_F (JsonWriterTests, Structure)
+{
+  std::string out;
+  JsonWriter w(out);
+
+  w.BeginObject ();
+  w.Key ("a");
+  w.Int (-5);
+  w.Key ("b");
+  w.BeginArray ();
+  w.UInt (1);
+  w.Bool (true);
+  w.Bool (false);
+  w.BeginObject ();
+  w.EndObject ();
+  w.BeginArray ();
+  w.EndArray ();
+  w.Raw ("null");
+  w.EndArray ();
+  w.Key ("c");
+  w.String ("foo");
+  w.EndObject ();
+
+  EXPECT_EQ (out, R"({"a":-5,"b":[1,true,false,{},[],null],"c":"foo"})");
+}
+
+TEST_F (JsonWriterTests, StringEscaping)
+{
+  const std::string str("quote \" backslash \\ newline \n tab \t\x01 äöü");
+
+  std::string out;
+  JsonWriter w(out);
+  w.String (str);
+
+  EXPECT_EQ (ParseJson ("[" + out + "]")[0].asString (), str);
+}
+
+TEST_F (JsonWriterTests, Base64)
+{
+  const std::pair<std::string, std::string> tests[] =
+    {
+      {"", ""},
+      {"f", "Zg=="},
+      {"fo", "Zm8="},
+      {"foo", "Zm9v"},
+      {"foob", "Zm9vYg=="},
+      {std::string ("\0\xFF\x80", 3), "AP+A"},
+    };
+
+  for (const auto& t : tests)
+    {
+      std::string out = "prefix";
+      JsonWriter w(out);
+      w.Base64 (t.first);
+      EXPECT_EQ (out, "prefix\"" + t.second + "\"");
+      EXPECT_EQ (out.size (), 6 + JsonWriter::Base64Size (t.first.size ()));
+    }
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
@@ -0,0 +1,275 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/loopbacktransport.hpp"
+
+#include <glog/logging.h>
+
+namespace xmppbroadcast
+{
+
+/* ************************************************************************** */
+
+/**
+ * A room joined through a LoopbackTransport.
+ */
+class LoopbackNetwork::LoopbackRoom : public MucTransport::Room
+{
+
+private:
+
+  /** The network this is on.  */
+  LoopbackNetwork& network;
+
+  /** The bare JID of the room.  */
+  const gloox::JID room;
+
+  /** Our occupant ID.  */
+  const uint64_t id;
+
+public:
+
+  explicit LoopbackRoom (LoopbackNetwork& n, const gloox::JID& r,
+                         const uint64_t i)
+    : network(n), room(r), id(i)
+  {}
+
+  ~LoopbackRoom ()
+  {
+    Leave ();
+
+    /* Wait for any event that may be using our handler right now.  */
+    std::lock_guard<std::recursive_mutex> lock(network.mutDelivery);
+  }
+
+  void
+  Leave () override
+  {
+    network.RemoveOccupant (room, id);
+  }
+
+};
+
+LoopbackNetwork::LoopbackNetwork (const std::chrono::microseconds l)
+  : latency(l)
+{
+  worker = std::thread ([this] ()
+    {
+      Run ();
+    });
+}
+
+LoopbackNetwork::~LoopbackNetwork ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stopping = true;
+    cv.notify_all ();
+  }
+
+  worker.join ();
+}
+
+void
+LoopbackNetwork::Run ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (!stopping)
+    {
+      if (events.empty ())
+        {
+          cv.wait (lock);
+          continue;
+        }
+
+      const auto due = events.top ().due;
+      if (std::chrono::steady_clock::now () < due)
+        {
+          cv.wait_until (lock, due);
+          continue;
+        }
+
+      const auto fn = events.top ().fn;
+      events.pop ();
+
+      lock.unlock ();
+      {
+        std::lock_guard<std::recursive_mutex> delivery(mutDelivery);
+        fn ();
+      }
+      lock.lock ();
+    }
+}
+
+void
+LoopbackNetwork::Schedule (std::function<void ()> fn)
+{
+  Event e;
+  e.due = std::chrono::steady_clock::now () + latency;
+  e.order = nextEventOrder++;
+  e.fn = std::move (fn);
+
+  events.push (std::move (e));
+  cv.notify_all ();
+}
+
+MucTransport::RoomHandler*
+LoopbackNetwork::GetHandler (const gloox::JID& room, const uint64_t id)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = rooms.find (room);
+  if (mit == rooms.end ())
+    return nullptr;
+
+  const auto oit = mit->second.find (id);
+  if (oit == mit->second.end ())
+    return nullptr;
+
+  return oit->second.handler;
+}
+
+void
+LoopbackNetwork::RemoveOccupant (const gloox::JID& room, const uint64_t id)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = rooms.find (room);
+  if (mit == rooms.end ())
+    return;
+
+  mit->second.erase (id);
+  if (mit->second.empty ())
+    rooms.erase (mit);
+}
+
+/* ************************************************************************** */
+
+bool
+LoopbackTransport::Connect ()
+{
+  connected = true;
+  return true;
+}
+
+void
+LoopbackTransport::Disconnect ()
+{
+  if (!connected)
+    return;
+
+  /* As with a real XMPP connection, the handler is called while we are
+     still marked as connected for an explicit disconnect.  */
+  NotifyDisconnect ();
+  connected = false;
+}
+
+void
+LoopbackTransport::SimulateConnectionLoss ()
+{
+  if (connected.exchange (false))
+    NotifyDisconnect ();
+}
+
+std::unique_ptr<MucTransport::Room>
+LoopbackTransport::JoinRoom (const gloox::JID& roomWithNick,
+                             RoomHandler& handler)
+{
+  const gloox::JID room = roomWithNick.bareJID ();
+  VLOG (1) << "Joining loopback room " << roomWithNick.full ();
+
+  std::lock_guard<std::mutex> lock(network.mut);
+
+  const uint64_t id = network.nextOccupantId++;
+  network.rooms[room].emplace (id, LoopbackNetwork::Occupant {
+      this, roomWithNick, &handler,
+  });
+
+  LoopbackNetwork* net = &network;
+  network.Schedule ([net, room, id] ()
+    {
+      auto* h = net->GetHandler (room, id);
+      if (h != nullptr)
+        h->RoomJoined ();
+    });
+
+  return std::make_unique<LoopbackNetwork::LoopbackRoom> (network, room, id);
+}
+
+void
+LoopbackTransport::Send (const gloox::JID& room,
+                         std::vector<std::unique_ptr<MessageStanza>> msgs)
+{
+  if (!connected || msgs.empty ())
+    return;
+
+  std::lock_guard<std::mutex> lock(network.mut);
+
+  /* Only occupants of a room can send messages to it.  We also need our
+     nick in the room as sender of the messages.  */
+  const auto mit = network.rooms.find (room);
+  if (mit == network.rooms.end ())
+    return;
+  const gloox::JID* from = nullptr;
+  for (const auto& entry : mit->second)
+    if (entry.second.transport == this)
+      {
+        from = &entry.second.nickJid;
+        break;
+      }
+  if (from == nullptr)
+    {
+      LOG (WARNING) << "Not sending to loopback room we are not in";
+      return;
+    }
+
+  using Batch = std::vector<std::unique_ptr<MessageStanza>>;
+  std::shared_ptr<const Batch> batch
+      = std::make_shared<Batch> (std::move (msgs));
+
+  LoopbackNetwork* net = &network;
+  const gloox::JID sender = *from;
+  network.Schedule ([net, room, sender, batch] ()
+    {
+      std::vector<uint64_t> ids;
+      {
+        std::lock_guard<std::mutex> lock(net->mut);
+        const auto mit = net->rooms.find (room);
+        if (mit == net->rooms.end ())
+          return;
+        for (const auto& entry : mit->second)
+          ids.push_back (entry.first);
+      }
+
+      /* Handlers cannot go away while we process the event, as destroying
+         a room handle waits on the delivery lock.  So we just need to check
+         each occupant once for the whole batch.  */
+      for (const auto id : ids)
+        {
+          auto* h = net->GetHandler (room, id);
+          if (h == nullptr)
+            continue;
+          for (const auto& m : *batch)
+            h->RoomMessage (sender, *m);
+        }
+    });
+}
+
+/* ************************************************************************** */
+
+} // namespace xmppbroadcast
@@ -40,6 +40,8 @@ DEFINE_string (cafile, "",
 DEFINE_int32 (port, 0, "port for the JSON-RPC broadcast server");
 DEFINE_bool (listen_locally, true,
              "whether the RPC server should listen locally");
+DEFINE_int32 (stream_port, 0,
+              "if set, port for the HTTP streaming subscription endpoint");
 
 /**
  * Exception thrown for invalid usage.
@@ -84,6 +86,8 @@ main (int argc, char** argv)
                                    FLAGS_muc);
       if (!FLAGS_cafile.empty ())
         srv.SetRootCA (FLAGS_cafile);
+      if (FLAGS_stream_port != 0)
+        srv.EnableStreaming (FLAGS_stream_port);
       srv.Start (FLAGS_port, FLAGS_listen_locally);
       srv.Wait ();
 
@@ -0,0 +1,395 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "metrics.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+namespace xmppbroadcast
+{
+
+/* ************************************************************************** */
+
+Histogram::Histogram (const std::vector<double>& b)
+  : bounds(b), counts(new std::atomic<uint64_t>[b.size () + 1]), sum(0.0)
+{
+  CHECK (std::is_sorted (bounds.begin (), bounds.end ()))
+      << "Histogram bounds must be sorted";
+  for (size_t i = 0; i <= bounds.size (); ++i)
+    counts[i].store (0, std::memory_order_relaxed);
+}
+
+void
+Histogram::Observe (const double val)
+{
+  const auto it = std::lower_bound (bounds.begin (), bounds.end (), val);
+  counts[it - bounds.begin ()].fetch_add (1, std::memory_order_relaxed);
+
+  /* There is no fetch_add for atomic doubles before C++20.  */
+  double cur = sum.load (std::memory_order_relaxed);
+  while (!sum.compare_exchange_weak (cur, cur + val,
+                                     std::memory_order_relaxed))
+    ;
+}
+
+std::vector<uint64_t>
+Histogram::GetCumulativeCounts () const
+{
+  std::vector<uint64_t> res;
+  res.reserve (bounds.size () + 1);
+
+  uint64_t total = 0;
+  for (size_t i = 0; i <= bounds.size (); ++i)
+    {
+      total += counts[i].load (std::memory_order_relaxed);
+      res.push_back (total);
+    }
+
+  return res;
+}
+
+std::vector<double>
+Histogram::LatencyBounds ()
+{
+  return {
+    0.0001, 0.00025, 0.0005,
+    0.001, 0.0025, 0.005,
+    0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5,
+    1.0, 2.5, 5.0, 10.0,
+  };
+}
+
+/* ************************************************************************** */
+
+namespace
+{
+
+/**
+ * Formats a floating-point value for the Prometheus output.
+ */
+std::string
+FormatDouble (const double val)
+{
+  char buf[32];
+  std::snprintf (buf, sizeof (buf), "%.9g", val);
+  return buf;
+}
+
+/**
+ * Formats a set of labels as {name="value",...}, or returns the empty
+ * string if there are none.
+ */
+std::string
+FormatLabels (const MetricsRegistry::Labels& labels)
+{
+  if (labels.empty ())
+    return "";
+
+  std::string res = "{";
+  bool first = true;
+  for (const auto& l : labels)
+    {
+      if (!first)
+        res += ',';
+      first = false;
+
+      res += l.first;
+      res += "=\"";
+      for (const char c : l.second)
+        switch (c)
+          {
+          case '\\':
+            res += "\\\\";
+            break;
+          case '"':
+            res += "\\\"";
+            break;
+          case '\n':
+            res += "\\n";
+            break;
+          default:
+            res += c;
+            break;
+          }
+      res += '"';
+    }
+  res += '}';
+
+  return res;
+}
+
+} // anonymous namespace
+
+/**
+ * All metrics with a given name (and thus type), one for each set
+ * of label values.
+ */
+struct MetricsRegistry::Family
+{
+
+  /** The help text.  */
+  std::string help;
+
+  /** The type of metrics in this family.  */
+  Type type;
+
+  /* The metrics themselves with their labels, keyed by the formatted
+     labels.  Only the map corresponding to the family's type is used.  */
+  std::map<std::string, std::pair<Labels, std::unique_ptr<Counter>>> counters;
+  std::map<std::string, std::pair<Labels, std::unique_ptr<Gauge>>> gauges;
+  std::map<std::string, std::pair<Labels, std::unique_ptr<Histogram>>>
+      histograms;
+
+};
+
+MetricsRegistry::MetricsRegistry () = default;
+MetricsRegistry::~MetricsRegistry () = default;
+
+MetricsRegistry&
+MetricsRegistry::Default ()
+{
+  static MetricsRegistry instance;
+  return instance;
+}
+
+MetricsRegistry::Family&
+MetricsRegistry::GetFamily (const std::string& name, const std::string& help,
+                            const Type type)
+{
+  auto& ptr = families[name];
+  if (ptr == nullptr)
+    {
+      ptr = std::make_unique<Family> ();
+      ptr->help = help;
+      ptr->type = type;
+    }
+
+  CHECK (ptr->type == type) << "Metric " << name << " has a different type";
+  return *ptr;
+}
+
+Counter&
+MetricsRegistry::GetCounter (const std::string& name, const std::string& help,
+                             const Labels& labels)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  auto& entry = GetFamily (name, help, Type::COUNTER)
+                  .counters[FormatLabels (labels)];
+  if (entry.second == nullptr)
+    {
+      entry.first = labels;
+      entry.second = std::make_unique<Counter> ();
+    }
+  return *entry.second;
+}
+
+Gauge&
+MetricsRegistry::GetGauge (const std::string& name, const std::string& help,
+                           const Labels& labels)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  auto& entry = GetFamily (name, help, Type::GAUGE)
+                  .gauges[FormatLabels (labels)];
+  if (entry.second == nullptr)
+    {
+      entry.first = labels;
+      entry.second = std::make_unique<Gauge> ();
+    }
+  return *entry.second;
+}
+
+Histogram&
+MetricsRegistry::GetHistogram (const std::string& name,
+                               const std::string& help,
+                               const std::vector<double>& bounds,
+                               const Labels& labels)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  auto& entry = GetFamily (name, help, Type::HISTOGRAM)
+                  .histograms[FormatLabels (labels)];
+  if (entry.second == nullptr)
+    {
+      entry.first = labels;
+      entry.second = std::make_unique<Histogram> (bounds);
+    }
+  return *entry.second;
+}
+
+std::string
+MetricsRegistry::ToPrometheusText () const
+{
+  std::ostringstream out;
+
+  std::lock_guard<std::mutex> lock(mut);
+  for (const auto& entry : families)
+    {
+      const auto& name = entry.first;
+      const auto& f = *entry.second;
+
+      out << "# HELP " << name << ' ' << f.help << '\n';
+      switch (f.type)
+        {
+        case Type::COUNTER:
+          out << "# TYPE " << name << " counter\n";
+          for (const auto& m : f.counters)
+            out << name << m.first
+                << ' ' << m.second.second->Get () << '\n';
+          break;
+
+        case Type::GAUGE:
+          out << "# TYPE " << name << " gauge\n";
+          for (const auto& m : f.gauges)
+            out << name << m.first
+                << ' ' << m.second.second->Get () << '\n';
+          break;
+
+        case Type::HISTOGRAM:
+          out << "# TYPE " << name << " histogram\n";
+          for (const auto& m : f.histograms)
+            {
+              const auto& h = *m.second.second;
+              const auto& bounds = h.GetBounds ();
+              const auto counts = h.GetCumulativeCounts ();
+
+              Labels labels = m.second.first;
+              for (size_t i = 0; i < counts.size (); ++i)
+                {
+                  labels["le"] = (i < bounds.size ()
+                                    ? FormatDouble (bounds[i]) : "+Inf");
+                  out << name << "_bucket" << FormatLabels (labels)
+                      << ' ' << counts[i] << '\n';
+                }
+
+              out << name << "_sum" << m.first
+                  << ' ' << FormatDouble (h.GetSum ()) << '\n';
+              out << name << "_count" << m.first
+                  << ' ' << counts.back () << '\n';
+            }
+          break;
+        }
+    }
+
+  return out.str ();
+}
+
+namespace
+{
+
+/**
+ * Removes all entries from a map of metrics whose labels contain
+ * the given name / value pair.
+ */
+template <typename Map>
+  void
+  RemoveWithLabel (Map& metrics, const std::string& name,
+                   const std::string& value)
+{
+  for (auto it = metrics.begin (); it != metrics.end (); )
+    {
+      const auto& labels = it->second.first;
+      const auto lit = labels.find (name);
+      if (lit != labels.end () && lit->second == value)
+        it = metrics.erase (it);
+      else
+        ++it;
+    }
+}
+
+} // anonymous namespace
+
+void
+MetricsRegistry::AcquireLabel (const std::string& name,
+                               const std::string& value)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  ++labelHandles[std::make_pair (name, value)];
+}
+
+void
+MetricsRegistry::ReleaseLabel (const std::string& name,
+                               const std::string& value)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = labelHandles.find (std::make_pair (name, value));
+  CHECK (mit != labelHandles.end ());
+  CHECK_GT (mit->second, 0);
+  if (--mit->second > 0)
+    return;
+  labelHandles.erase (mit);
+
+  for (auto& entry : families)
+    {
+      auto& f = *entry.second;
+      RemoveWithLabel (f.counters, name, value);
+      RemoveWithLabel (f.gauges, name, value);
+      RemoveWithLabel (f.histograms, name, value);
+    }
+}
+
+/* ************************************************************************** */
+
+MetricsRegistry::LabelHandle::LabelHandle (MetricsRegistry& r,
+                                           const std::string& n,
+                                           const std::string& v)
+  : registry(&r), name(n), value(v)
+{
+  registry->AcquireLabel (name, value);
+}
+
+MetricsRegistry::LabelHandle::~LabelHandle ()
+{
+  Reset ();
+}
+
+MetricsRegistry::LabelHandle::LabelHandle (LabelHandle&& o)
+  : registry(o.registry), name(std::move (o.name)), value(std::move (o.value))
+{
+  o.registry = nullptr;
+}
+
+MetricsRegistry::LabelHandle&
+MetricsRegistry::LabelHandle::operator= (LabelHandle&& o)
+{
+  if (this != &o)
+    {
+      Reset ();
+      registry = o.registry;
+      name = std::move (o.name);
+      value = std::move (o.value);
+      o.registry = nullptr;
+    }
+  return *this;
+}
+
+void
+MetricsRegistry::LabelHandle::Reset ()
+{
+  if (registry != nullptr)
+    registry->ReleaseLabel (name, value);
+  registry = nullptr;
+}
+
+/* ************************************************************************** */
+
+} // namespace xmppbroadcast
@@ -0,0 +1,336 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_METRICS_HPP
+#define XMPPBROADCAST_METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+/* ************************************************************************** */
+
+/**
+ * A monotonically increasing counter.  Updates are relaxed atomic
+ * operations, so that they are cheap enough for hot code paths.
+ */
+class Counter
+{
+
+private:
+
+  /** The current value.  */
+  std::atomic<uint64_t> value;
+
+public:
+
+  Counter ()
+    : value(0)
+  {}
+
+  Counter (const Counter&) = delete;
+  void operator= (const Counter&) = delete;
+
+  void
+  Increment (const uint64_t n = 1)
+  {
+    value.fetch_add (n, std::memory_order_relaxed);
+  }
+
+  uint64_t
+  Get () const
+  {
+    return value.load (std::memory_order_relaxed);
+  }
+
+};
+
+/**
+ * A gauge, i.e. a value that can go up and down (like a queue depth).
+ */
+class Gauge
+{
+
+private:
+
+  /** The current value.  */
+  std::atomic<int64_t> value;
+
+public:
+
+  Gauge ()
+    : value(0)
+  {}
+
+  Gauge (const Gauge&) = delete;
+  void operator= (const Gauge&) = delete;
+
+  void
+  Add (const int64_t n)
+  {
+    value.fetch_add (n, std::memory_order_relaxed);
+  }
+
+  void
+  Set (const int64_t n)
+  {
+    value.store (n, std::memory_order_relaxed);
+  }
+
+  int64_t
+  Get () const
+  {
+    return value.load (std::memory_order_relaxed);
+  }
+
+};
+
+/**
+ * A histogram with fixed bucket boundaries.  Observing a value is
+ * lock-free; a snapshot read while other threads observe values may
+ * be slightly inconsistent between the buckets and the sum, which is
+ * fine for monitoring.
+ */
+class Histogram
+{
+
+private:
+
+  /** Upper bounds of the buckets (in increasing order).  */
+  const std::vector<double> bounds;
+
+  /**
+   * Number of observations per bucket (not cumulative).  The last entry
+   * is for values above all bounds.
+   */
+  std::unique_ptr<std::atomic<uint64_t>[]> counts;
+
+  /** Sum of all observed values.  */
+  std::atomic<double> sum;
+
+public:
+
+  /**
+   * Constructs a histogram with the given bucket boundaries, which must
+   * be sorted in increasing order.
+   */
+  explicit Histogram (const std::vector<double>& b);
+
+  Histogram () = delete;
+  Histogram (const Histogram&) = delete;
+  void operator= (const Histogram&) = delete;
+
+  /**
+   * Records a value.
+   */
+  void Observe (double val);
+
+  /**
+   * Records a duration, which is observed in seconds.
+   */
+  template <typename Rep, typename Period>
+    void
+    ObserveDuration (const std::chrono::duration<Rep, Period> d)
+  {
+    Observe (std::chrono::duration<double> (d).count ());
+  }
+
+  const std::vector<double>&
+  GetBounds () const
+  {
+    return bounds;
+  }
+
+  /**
+   * Returns the cumulative bucket counts, with one entry per bound
+   * plus a final one for all observations.
+   */
+  std::vector<uint64_t> GetCumulativeCounts () const;
+
+  double
+  GetSum () const
+  {
+    return sum.load (std::memory_order_relaxed);
+  }
+
+  /**
+   * Returns bucket bounds suitable for latencies measured in seconds,
+   * from 100us to 10s.
+   */
+  static std::vector<double> LatencyBounds ();
+
+};
+
+/* ************************************************************************** */
+
+/**
+ * A set of metrics, which can be exported in the Prometheus text
+ * exposition format.  Metrics are identified by their name and
+ * a set of labels.  Looking them up locks the registry, but the returned
+ * references stay valid for its lifetime; hot code paths should thus look
+ * up their metrics once and then just update them.
+ *
+ * Metrics for short-lived entities (like a room) can be tied to a
+ * LabelHandle for their label value.  Once the last handle for it is
+ * destroyed, all metrics with that label value are removed, so that
+ * the registry does not grow without bound in long-running processes.
+ *
+ * The library records its metrics in the Default() registry, which
+ * is also what the RPC server exposes.
+ */
+class MetricsRegistry
+{
+
+public:
+
+  class LabelHandle;
+
+  /** Labels of a metric, as name / value pairs.  */
+  using Labels = std::map<std::string, std::string>;
+
+private:
+
+  /** The type of a metric family.  */
+  enum class Type
+  {
+    COUNTER,
+    GAUGE,
+    HISTOGRAM,
+  };
+
+  struct Family;
+
+  /** Mutex for the families and label handle counts.  */
+  mutable std::mutex mut;
+
+  /** All metric families by name.  */
+  std::map<std::string, std::unique_ptr<Family>> families;
+
+  /** Number of active LabelHandle instances per label name and value.  */
+  std::map<std::pair<std::string, std::string>, unsigned> labelHandles;
+
+  /**
+   * Registers a new handle for the given label value.
+   */
+  void AcquireLabel (const std::string& name, const std::string& value);
+
+  /**
+   * Unregisters a handle for the given label value, and removes all
+   * metrics with it if this was the last one.
+   */
+  void ReleaseLabel (const std::string& name, const std::string& value);
+
+  /**
+   * Returns the family with the given name, creating it if needed.
+   * CHECK-fails if it exists with a different type.  Must be called
+   * with the lock held.
+   */
+  Family& GetFamily (const std::string& name, const std::string& help,
+                     Type type);
+
+public:
+
+  MetricsRegistry ();
+  ~MetricsRegistry ();
+
+  MetricsRegistry (const MetricsRegistry&) = delete;
+  void operator= (const MetricsRegistry&) = delete;
+
+  Counter& GetCounter (const std::string& name, const std::string& help,
+                       const Labels& labels = {});
+  Gauge& GetGauge (const std::string& name, const std::string& help,
+                   const Labels& labels = {});
+
+  /**
+   * Returns a histogram.  The bounds are only used if it gets created by
+   * this call; all histograms of a family should use the same bounds.
+   */
+  Histogram& GetHistogram (const std::string& name, const std::string& help,
+                           const std::vector<double>& bounds,
+                           const Labels& labels = {});
+
+  /**
+   * Returns all metrics in the Prometheus text format.
+   */
+  std::string ToPrometheusText () const;
+
+  /**
+   * Returns the process-wide registry used by the library.
+   */
+  static MetricsRegistry& Default ();
+
+};
+
+/**
+ * RAII handle that keeps the metrics with a given label value (e.g. those
+ * of one room) in the registry.  Code using such metrics must hold a handle
+ * as long as it uses references to them.
+ */
+class MetricsRegistry::LabelHandle
+{
+
+private:
+
+  /** The registry this is for, or null if the handle is empty.  */
+  MetricsRegistry* registry = nullptr;
+
+  /** The label name.  */
+  std::string name;
+
+  /** The label value.  */
+  std::string value;
+
+  /**
+   * Releases the label value (if this is not empty).
+   */
+  void Reset ();
+
+public:
+
+  /**
+   * Constructs an empty handle.
+   */
+  LabelHandle () = default;
+
+  explicit LabelHandle (MetricsRegistry& r,
+                        const std::string& n, const std::string& v);
+
+  ~LabelHandle ();
+
+  LabelHandle (LabelHandle&& o);
+  LabelHandle& operator= (LabelHandle&& o);
+
+  LabelHandle (const LabelHandle&) = delete;
+  void operator= (const LabelHandle&) = delete;
+
+};
+
+/* ************************************************************************** */
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_METRICS_HPP
@@ -0,0 +1,144 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "metrics.hpp"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+using MetricsTests = testing::Test;
+
+TEST_F (MetricsTests, CounterAndGauge)
+{
+  MetricsRegistry reg;
+
+  auto& c = reg.GetCounter ("foo_total", "help");
+  c.Increment ();
+  c.Increment (41);
+  EXPECT_EQ (c.Get (), 42);
+  EXPECT_EQ (&reg.GetCounter ("foo_total", "help"), &c);
+
+  auto& g = reg.GetGauge ("depth", "help", {{"room", "a"}});
+  g.Add (5);
+  g.Add (-2);
+  EXPECT_EQ (g.Get (), 3);
+  g.Set (-1);
+  EXPECT_EQ (g.Get (), -1);
+  EXPECT_NE (&reg.GetGauge ("depth", "help", {{"room", "b"}}), &g);
+}
+
+TEST_F (MetricsTests, LabelHandles)
+{
+  MetricsRegistry reg;
+  reg.GetCounter ("total", "help").Increment ();
+
+  {
+    MetricsRegistry::LabelHandle a1(reg, "room", "a");
+    reg.GetCounter ("foo_total", "help", {{"room", "a"}}).Increment (2);
+    reg.GetGauge ("depth", "help", {{"room", "a"}, {"x", "y"}}).Set (3);
+    reg.GetHistogram ("h", "help", {1.0}, {{"room", "a"}}).Observe (0.5);
+    reg.GetCounter ("foo_total", "help", {{"room", "b"}}).Increment (4);
+
+    MetricsRegistry::LabelHandle a2(reg, "room", "a");
+    MetricsRegistry::LabelHandle moved(std::move (a1));
+    a1 = std::move (a2);
+
+    const std::string text = reg.ToPrometheusText ();
+    EXPECT_NE (text.find ("foo_total{room=\"a\"} 2"), std::string::npos);
+    EXPECT_NE (text.find ("depth{room=\"a\",x=\"y\"} 3"),
+               std::string::npos);
+  }
+
+  /* All metrics for room a are gone, but the others are still there.  */
+  const std::string text = reg.ToPrometheusText ();
+  EXPECT_EQ (text.find ("room=\"a\""), std::string::npos);
+  EXPECT_NE (text.find ("foo_total{room=\"b\"} 4"), std::string::npos);
+  EXPECT_NE (text.find ("total 1"), std::string::npos);
+
+  /* Looking a metric up again creates it fresh.  */
+  EXPECT_EQ (reg.GetCounter ("foo_total", "help", {{"room", "a"}}).Get (), 0);
+}
+
+TEST_F (MetricsTests, ConcurrentUpdates)
+{
+  MetricsRegistry reg;
+  auto& c = reg.GetCounter ("foo_total", "help");
+
+  constexpr unsigned threads = 4;
+  constexpr unsigned perThread = 10'000;
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < threads; ++i)
+    workers.emplace_back ([&c] ()
+      {
+        for (unsigned j = 0; j < perThread; ++j)
+          c.Increment ();
+      });
+  for (auto& w : workers)
+    w.join ();
+
+  EXPECT_EQ (c.Get (), threads * perThread);
+}
+
+TEST_F (MetricsTests, Histogram)
+{
+  Histogram h({1.0, 2.0, 5.0});
+  h.Observe (0.5);
+  h.Observe (1.0);
+  h.Observe (3.0);
+  h.Observe (10.0);
+
+  EXPECT_EQ (h.GetCumulativeCounts (),
+             std::vector<uint64_t> ({2, 2, 3, 4}));
+  EXPECT_DOUBLE_EQ (h.GetSum (), 14.5);
+}
+
+TEST_F (MetricsTests, PrometheusText)
+{
+  MetricsRegistry reg;
+  reg.GetCounter ("a_total", "The A", {{"x", "q\"uote"}}).Increment (3);
+  reg.GetGauge ("b", "The B").Set (-7);
+  reg.GetHistogram ("c_seconds", "The C", {0.5, 1.0}, {{"m", "foo"}})
+      .Observe (0.75);
+
+  EXPECT_EQ (reg.ToPrometheusText (),
+             "# HELP a_total The A\n"
+             "# TYPE a_total counter\n"
+             "a_total{x=\"q\\\"uote\"} 3\n"
+             "# HELP b The B\n"
+             "# TYPE b gauge\n"
+             "b -7\n"
+             "# HELP c_seconds The C\n"
+             "# TYPE c_seconds histogram\n"
+             "c_seconds_bucket{le=\"0.5\",m=\"foo\"} 0\n"
+             "c_seconds_bucket{le=\"1\",m=\"foo\"} 1\n"
+             "c_seconds_bucket{le=\"+Inf\",m=\"foo\"} 1\n"
+             "c_seconds_sum{m=\"foo\"} 0.75\n"
+             "c_seconds_count{m=\"foo\"} 1\n");
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
@@ -0,0 +1,72 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/mpscqueue.hpp"
+
+namespace xmppbroadcast
+{
+
+EventCount::Key
+EventCount::PrepareWait ()
+{
+  waiters.fetch_add (1);
+  return epoch.load ();
+}
+
+void
+EventCount::CancelWait ()
+{
+  waiters.fetch_sub (1);
+}
+
+void
+EventCount::Wait (const Key key)
+{
+  std::unique_lock<std::mutex> lock(mut);
+  cv.wait (lock, [this, key] () { return epoch.load () != key; });
+  waiters.fetch_sub (1);
+}
+
+bool
+EventCount::WaitUntil (const Key key,
+                       const std::chrono::steady_clock::time_point timeout)
+{
+  std::unique_lock<std::mutex> lock(mut);
+  const bool res = cv.wait_until (lock, timeout, [this, key] ()
+    {
+      return epoch.load () != key;
+    });
+  waiters.fetch_sub (1);
+  return res;
+}
+
+void
+EventCount::Notify ()
+{
+  /* This load is ordered after the producer's change to the condition
+     (all operations are sequentially consistent).  If it does not see
+     a waiter, then the waiter's check of the condition will see it.  */
+  if (waiters.load () == 0)
+    return;
+
+  std::lock_guard<std::mutex> lock(mut);
+  epoch.fetch_add (1);
+  cv.notify_all ();
+}
+
+} // namespace xmppbroadcast
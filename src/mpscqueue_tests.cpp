@@ -0,0 +1,160 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/mpscqueue.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+using MpscQueueTests = testing::Test;
+
+TEST_F (MpscQueueTests, Order)
+{
+  MpscQueue<std::string> q;
+  EXPECT_TRUE (q.Empty ());
+  EXPECT_EQ (q.PopAll (), std::vector<std::string> ());
+
+  EXPECT_TRUE (q.Push ("a"));
+  EXPECT_FALSE (q.Push ("b"));
+  EXPECT_FALSE (q.Push (std::vector<std::string> ({"c", "d"})));
+  EXPECT_FALSE (q.Push (std::vector<std::string> ()));
+  EXPECT_FALSE (q.Empty ());
+  EXPECT_EQ (q.PopAll (), std::vector<std::string> ({"a", "b", "c", "d"}));
+
+  EXPECT_TRUE (q.Empty ());
+  EXPECT_TRUE (q.Push (std::vector<std::string> ({"e"})));
+  EXPECT_EQ (q.PopAll (), std::vector<std::string> ({"e"}));
+}
+
+TEST_F (MpscQueueTests, MoveOnlyAndDestruction)
+{
+  auto q = std::make_unique<MpscQueue<std::unique_ptr<int>>> ();
+  q->Push (std::make_unique<int> (1));
+  q->Push (std::make_unique<int> (2));
+
+  const auto values = q->PopAll ();
+  ASSERT_EQ (values.size (), 2);
+  EXPECT_EQ (*values[0], 1);
+  EXPECT_EQ (*values[1], 2);
+
+  /* Values still queued are destroyed with the queue.  */
+  q->Push (std::make_unique<int> (3));
+  q.reset ();
+}
+
+TEST_F (MpscQueueTests, ManyProducers)
+{
+  constexpr int producers = 4;
+  constexpr int perProducer = 10'000;
+
+  MpscQueue<int> q;
+  EventCount ec;
+  std::atomic<int> done(0);
+
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; ++p)
+    threads.emplace_back ([&, p] ()
+      {
+        for (int i = 0; i < perProducer; ++i)
+          if (q.Push (p * perProducer + i))
+            ec.Notify ();
+        ++done;
+        ec.Notify ();
+      });
+
+  /* Each producer's values must be received in order.  */
+  std::vector<int> next(producers);
+  int received = 0;
+  while (received < producers * perProducer)
+    {
+      const auto key = ec.PrepareWait ();
+      if (!q.Empty () || done == producers)
+        ec.CancelWait ();
+      else
+        ec.Wait (key);
+
+      for (const int v : q.PopAll ())
+        {
+          const int p = v / perProducer;
+          ASSERT_EQ (v % perProducer, next[p]);
+          ++next[p];
+          ++received;
+        }
+    }
+
+  for (auto& t : threads)
+    t.join ();
+  EXPECT_TRUE (q.Empty ());
+}
+
+using EventCountTests = testing::Test;
+
+TEST_F (EventCountTests, NotifyBeforeWait)
+{
+  EventCount ec;
+  const auto key = ec.PrepareWait ();
+  ec.Notify ();
+  ec.Wait (key);
+}
+
+TEST_F (EventCountTests, WaitUntilTimeout)
+{
+  EventCount ec;
+  const auto key = ec.PrepareWait ();
+  EXPECT_FALSE (ec.WaitUntil (key, std::chrono::steady_clock::now ()
+                                      + std::chrono::milliseconds (10)));
+}
+
+TEST_F (EventCountTests, NotifyWakesWaiter)
+{
+  EventCount ec;
+  std::atomic<bool> flag(false);
+
+  std::thread waiter([&] ()
+    {
+      while (true)
+        {
+          const auto key = ec.PrepareWait ();
+          if (flag)
+            {
+              ec.CancelWait ();
+              break;
+            }
+          ec.Wait (key);
+        }
+    });
+
+  std::this_thread::sleep_for (std::chrono::milliseconds (10));
+  flag = true;
+  ec.Notify ();
+  waiter.join ();
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
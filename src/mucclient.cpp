@@ -19,9 +19,11 @@
 #include "private/mucclient.hpp"
 
 #include "private/stanzas.hpp"
+#include "private/xmpptransport.hpp"
 
 #include <xayautil/cryptorand.hpp>
 
+#include <algorithm>
 #include <sstream>
 
 namespace xmppbroadcast
@@ -29,17 +31,190 @@ namespace xmppbroadcast
 
 DEFINE_int32 (xmppbroadcast_refresh_ms, 30'000,
               "Milliseconds between refresh / reconnection attempts");
+DEFINE_bool (xmppbroadcast_timestamp_messages, false,
+             "If true, attach timestamps and sequence numbers to sent"
+             " messages for measuring end-to-end latency");
+DEFINE_int32 (xmppbroadcast_ack_timeout_ms, 10'000,
+              "Milliseconds after which a message sent with acknowledgement"
+              " is considered lost if the room has not reflected it");
+DEFINE_int32 (xmppbroadcast_dedup_size, 0,
+              "If positive, suppress received messages whose payload"
+              " matches one of this many recently received ones");
+DEFINE_int32 (xmppbroadcast_dedup_ms, 60'000,
+              "Milliseconds for which received payloads are remembered"
+              " for duplicate suppression");
+DEFINE_int32 (xmppbroadcast_dispatch_threads, 0,
+              "If positive, process received messages on this many worker"
+              " threads (sharded by room) instead of the receiving thread");
+DEFINE_int32 (xmppbroadcast_dispatch_queue, 10'000,
+              "Maximum number of received messages queued per dispatch"
+              " thread before receiving blocks");
+DEFINE_bool (xmppbroadcast_shared_writer, false,
+             "If true, messages of all channels are sent together by one"
+             " writer thread for the connection");
+DEFINE_int32 (xmppbroadcast_writer_quantum_bytes, 16'384,
+              "Payload bytes per round and unit of weight that each channel"
+              " may send through the shared writer (zero for no limit)");
+DEFINE_int32 (xmppbroadcast_rate_bytes, 0,
+              "If positive, limit the payload bytes sent per second on"
+              " the connection to this");
+DEFINE_int32 (xmppbroadcast_rate_stanzas, 0,
+              "If positive, limit the messages sent per second on"
+              " the connection to this");
+DEFINE_int32 (xmppbroadcast_rate_burst_ms, 1'000,
+              "With rate limits, allow bursts of this many milliseconds"
+              " at the full rate");
+DEFINE_int32 (xmppbroadcast_flush_window_us, 0,
+              "If positive, hold queued messages for up to this many"
+              " microseconds while traffic is high, to send larger batches");
+DEFINE_int32 (xmppbroadcast_fragment_bytes, 0,
+              "If positive, split message payloads larger than this into"
+              " fragments sent as separate stanzas");
+DEFINE_int32 (xmppbroadcast_reassembly_bytes, 64 << 20,
+              "Maximum payload bytes buffered per channel for reassembling"
+              " fragmented messages");
+DEFINE_int32 (xmppbroadcast_reassembly_timeout_ms, 30'000,
+              "Milliseconds after which partially received fragmented"
+              " messages are dropped");
+DEFINE_int32 (xmppbroadcast_reactor_threads, 0,
+              "If positive, run sending and refreshing on this many event"
+              " loop threads instead of one thread per room");
+DEFINE_bool (xmppbroadcast_suppress_echo, false,
+             "If true, messages we sent ourselves are not passed on as"
+             " received when the room reflects them back");
+
+/* ************************************************************************** */
+
+namespace
+{
+
+/**
+ * Returns the metrics counter for disconnects with the given reason.
+ */
+Counter&
+DisconnectCounter (const std::string& reason)
+{
+  return MetricsRegistry::Default ().GetCounter (
+      "xmppbroadcast_disconnects_total",
+      "Number of disconnects from the XMPP server or rooms",
+      {{"reason", reason}});
+}
+
+/**
+ * Returns a per-room metrics counter.
+ */
+Counter&
+RoomCounter (const std::string& name, const std::string& help,
+             const gloox::JID& room)
+{
+  return MetricsRegistry::Default ().GetCounter (name, help,
+                                                 {{"room", room.username ()}});
+}
+
+/**
+ * Returns the room JID with a random nick as resource.
+ */
+gloox::JID
+WithRandomNick (const gloox::JID& room)
+{
+  /* The nick names in the room have to be unique in order to avoid failures
+     when joining.  Thus we simply use a random value, which will be (almost)
+     guaranteed to be unique.  This also allows us to recognise our own
+     messages reflected by the room.  */
+  xaya::CryptoRand rnd;
+  const auto nick = rnd.Get<xaya::uint256> ();
+
+  gloox::JID res = room;
+  res.setResource (nick.ToHex ());
+  return res;
+}
+
+/**
+ * Returns the current time in microseconds since the epoch, as used
+ * for message timestamps.
+ */
+uint64_t
+CurrentTimestamp ()
+{
+  const auto now = std::chrono::system_clock::now ().time_since_epoch ();
+  return std::chrono::duration_cast<std::chrono::microseconds> (now).count ();
+}
+
+/**
+ * Returns the time difference in seconds from a given timestamp to now.
+ * Timestamps from other nodes may be slightly in the future due to clock
+ * differences, in which case this returns zero.
+ */
+double
+SecondsSince (const uint64_t ts)
+{
+  const uint64_t now = CurrentTimestamp ();
+  return (now > ts ? now - ts : 0) / 1e6;
+}
+
+/**
+ * Returns the histogram for one-way latency of received messages.
+ */
+Histogram&
+MessageLatencyHistogram ()
+{
+  static Histogram& res = MetricsRegistry::Default ().GetHistogram (
+      "xmppbroadcast_message_latency_seconds",
+      "Time from queuing a message on the sender until it is received",
+      Histogram::LatencyBounds ());
+  return res;
+}
+
+/**
+ * Returns the histogram for the time messages spent in our send queue.
+ */
+Histogram&
+SendQueueTimeHistogram ()
+{
+  static Histogram& res = MetricsRegistry::Default ().GetHistogram (
+      "xmppbroadcast_send_queue_seconds",
+      "Time sent messages spent in the send queue",
+      Histogram::LatencyBounds ());
+  return res;
+}
+
+} // anonymous namespace
 
 /* ************************************************************************** */
 
 MucClient::MucClient (const std::string& g,
                       const gloox::JID& j, const std::string& password,
                       const std::string& s)
-  : XmppClient(j, password), gameId(g), server(s)
+  : MucClient(g, std::make_unique<XmppTransport> (j, password), s)
+{}
+
+MucClient::MucClient (const std::string& g, std::unique_ptr<MucTransport> t,
+                      const std::string& s)
+  : gameId(g), server(s), transport(std::move (t))
 {
-  RunWithClient ([] (gloox::Client& c)
+  if (FLAGS_xmppbroadcast_dispatch_threads > 0)
+    dispatch = std::make_unique<DispatchPool> (
+        FLAGS_xmppbroadcast_dispatch_threads,
+        FLAGS_xmppbroadcast_dispatch_queue);
+  if (FLAGS_xmppbroadcast_reactor_threads > 0)
+    reactor = std::make_unique<Reactor> (FLAGS_xmppbroadcast_reactor_threads);
+  if (FLAGS_xmppbroadcast_rate_bytes > 0
+        || FLAGS_xmppbroadcast_rate_stanzas > 0)
+    pacer = std::make_unique<SendPacer> (
+        std::max (FLAGS_xmppbroadcast_rate_bytes, 0),
+        std::max (FLAGS_xmppbroadcast_rate_stanzas, 0),
+        std::chrono::milliseconds (FLAGS_xmppbroadcast_rate_burst_ms));
+  if (FLAGS_xmppbroadcast_shared_writer)
+    writer = std::make_unique<ConnectionWriter> (
+        [this] (std::vector<MucTransport::Outgoing> out)
+          {
+            SendPaced (std::move (out));
+          },
+        std::max (FLAGS_xmppbroadcast_writer_quantum_bytes, 0));
+
+  transport->SetDisconnectHandler ([this] ()
     {
-      c.registerStanzaExtension (new MessageStanza ());
+      HandleDisconnect ();
     });
 }
 
@@ -51,7 +226,7 @@ MucClient::~MucClient ()
 bool
 MucClient::Connect ()
 {
-  return XmppClient::Connect (-1);
+  return transport->Connect ();
 }
 
 void
@@ -65,10 +240,22 @@ MucClient::Disconnect ()
 
   /* This calls HandleDisconnect, which obtains the mutex lock again.
      Thus release the lock for this call.  */
-  XmppClient::Disconnect ();
+  transport->Disconnect ();
 
+  /* The channels are destructed after releasing the lock.  */
+  decltype (channels) old;
   std::lock_guard<std::mutex> lock(mut);
-  channels.clear ();
+  old.swap (channels);
+}
+
+bool
+MucClient::SetChannelWeight (const xaya::uint256& id, const unsigned weight)
+{
+  if (writer == nullptr)
+    return false;
+
+  writer->SetWeight (GetRoomJid (id), weight);
+  return true;
 }
 
 gloox::JID
@@ -80,9 +267,114 @@ MucClient::GetRoomJid (const xaya::uint256& channelId) const
   return gloox::JID (res.str ());
 }
 
+MucClient::Channel*
+MucClient::LookupChannel (const xaya::uint256& id)
+{
+  if (!IsConnected ())
+    return nullptr;
+
+  /* An inactive channel is only destructed after releasing the lock
+     (see ChannelDeleter).  */
+  ChannelPtr inactive;
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = channels.find (id);
+  if (mit != channels.end ())
+    {
+      if (mit->second->IsActive ())
+        return mit->second.get ();
+
+      inactive = std::move (mit->second);
+      channels.erase (mit);
+      return nullptr;
+    }
+
+  auto newChannel = CreateChannel (GetRoomJid (id));
+  auto* res = newChannel.get ();
+  channels.emplace (id, std::move (newChannel));
+  return res;
+}
+
+std::vector<MucClient::PacedChunk>
+MucClient::SplitForPacer (std::vector<MucTransport::Outgoing> out) const
+{
+  CHECK (pacer != nullptr);
+
+  std::vector<PacedChunk> res;
+  for (auto& o : out)
+    {
+      /* Messages of a room may be split across chunks.  Then the rest
+         of them starts a new entry in the next chunk.  */
+      bool started = false;
+      for (auto& m : o.msgs)
+        {
+          const size_t size = m->GetData ().size ();
+          if (res.empty ()
+                || !pacer->FitsBurst (res.back ().numStanzas + 1,
+                                      res.back ().numBytes + size))
+            {
+              res.emplace_back ();
+              started = false;
+            }
+
+          auto& chunk = res.back ();
+          if (!started)
+            {
+              chunk.out.push_back ({o.room, {}});
+              started = true;
+            }
+          chunk.out.back ().msgs.push_back (std::move (m));
+          ++chunk.numStanzas;
+          chunk.numBytes += size;
+        }
+    }
+
+  return res;
+}
+
+void
+MucClient::SendPaced (std::vector<MucTransport::Outgoing> out)
+{
+  if (pacer == nullptr)
+    {
+      transport->SendAll (std::move (out));
+      return;
+    }
+
+  for (auto& chunk : SplitForPacer (std::move (out)))
+    {
+      pacer->Pace (chunk.numStanzas, chunk.numBytes);
+      transport->SendAll (std::move (chunk.out));
+    }
+}
+
+void
+MucClient::RemoveChannel (const xaya::uint256& id)
+{
+  RemoveChannelIf (id, [] () { return true; });
+}
+
+void
+MucClient::RemoveChannelIf (const xaya::uint256& id,
+                            const std::function<bool ()>& pred)
+{
+  /* The channel is destructed (and thus leaves) after releasing the lock.  */
+  ChannelPtr removed;
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = channels.find (id);
+  if (mit == channels.end () || !pred ())
+    return;
+
+  removed = std::move (mit->second);
+  channels.erase (mit);
+}
+
 void
 MucClient::HandleDisconnect ()
 {
+  /* Channels removed are destructed after releasing the lock.  */
+  decltype (channels) old;
   std::lock_guard<std::mutex> lock(mut);
 
   /* If we are still connected (i.e. this is an explicit request to
@@ -90,11 +382,22 @@ MucClient::HandleDisconnect ()
      Otherwise (we were force-disconnected), just clean up the channels.  */
   if (IsConnected ())
     {
+      DisconnectCounter ("requested").Increment ();
       for (auto& entry : channels)
         entry.second->Leave ();
     }
   else
-    channels.clear ();
+    {
+      DisconnectCounter ("connection_lost").Increment ();
+      old.swap (channels);
+    }
+}
+
+void
+MucClient::ChannelDeleter::operator() (Channel* c) const
+{
+  c->StopDispatch ();
+  delete c;
 }
 
 std::unique_ptr<MucClient::Channel>
@@ -111,7 +414,11 @@ MucClient::Refresh ()
   if (!IsConnected ())
     {
       LOG (INFO) << "MUC client is disconnected, attempting reconnect...";
-      Connect ();
+      const bool success = Connect ();
+      MetricsRegistry::Default ().GetCounter (
+          "xmppbroadcast_reconnects_total",
+          "Number of reconnection attempts to the XMPP server",
+          {{"result", success ? "success" : "failure"}}).Increment ();
     }
 }
 
@@ -128,7 +435,24 @@ MucClient::Refresher::~Refresher ()
     shouldStop = true;
     cv.notify_all ();
   }
-  runner.join ();
+
+  if (runner != nullptr)
+    runner->join ();
+  else
+    {
+      client.reactor->Cancel (0, this);
+      if (refreshing.valid ())
+        refreshing.wait ();
+    }
+}
+
+void
+MucClient::Refresher::Start ()
+{
+  if (client.reactor != nullptr)
+    client.reactor->Post (0, this, [this] () { RunOnReactor (); });
+  else
+    runner = std::make_unique<std::thread> ([this] () { Run (); });
 }
 
 void
@@ -144,26 +468,75 @@ MucClient::Refresher::Run ()
     }
 }
 
+void
+MucClient::Refresher::RunOnReactor ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (shouldStop)
+    return;
+
+  /* Reconnecting blocks until the connection attempt is done, which
+     must not stall other tasks on the reactor.  Thus the refresh itself
+     runs on a short-lived thread of its own.  If the previous one has
+     not finished yet (e.g. a slow connection attempt), this round
+     is skipped.  */
+  if (!refreshing.valid ()
+        || refreshing.wait_for (std::chrono::seconds (0))
+              == std::future_status::ready)
+    refreshing = std::async (std::launch::async,
+                             [this] () { client.Refresh (); });
+
+  client.reactor->PostAt (0, this, std::chrono::steady_clock::now () + intv,
+                          [this] () { RunOnReactor (); });
+}
+
 /* ************************************************************************** */
 
 MucClient::Channel::Channel (MucClient& c, const gloox::JID& j)
-  : client(c), roomJid(j), left(false)
+  : client(c), roomJid(j), ownJid(WithRandomNick (roomJid)), left(false),
+    stopSender(false),
+    flushWindow(std::chrono::microseconds (
+        std::max (FLAGS_xmppbroadcast_flush_window_us, 0))),
+    joined(false),
+    fragments(std::max (FLAGS_xmppbroadcast_reassembly_bytes, 0),
+              std::chrono::milliseconds (
+                  FLAGS_xmppbroadcast_reassembly_timeout_ms)),
+    dispatchKey(std::hash<std::string> () (roomJid.bare ())),
+    dispatchStopped(false),
+    joinStart(std::chrono::steady_clock::now ()),
+    roomMetrics(MetricsRegistry::Default (), "room", roomJid.username ()),
+    messagesSent(RoomCounter ("xmppbroadcast_messages_sent_total",
+                              "Number of messages sent", roomJid)),
+    bytesSent(RoomCounter ("xmppbroadcast_bytes_sent_total",
+                           "Payload bytes of messages sent", roomJid)),
+    messagesReceived(RoomCounter ("xmppbroadcast_messages_received_total",
+                                  "Number of messages received", roomJid)),
+    bytesReceived(RoomCounter ("xmppbroadcast_bytes_received_total",
+                               "Payload bytes of messages received", roomJid)),
+    sendQueueDepth(MetricsRegistry::Default ().GetGauge (
+        "xmppbroadcast_send_queue_depth",
+        "Number of messages queued for sending",
+        {{"room", roomJid.username ()}})),
+    messageGaps(RoomCounter ("xmppbroadcast_message_gaps_total",
+                             "Number of messages detected as missing based"
+                             " on sender sequence numbers", roomJid)),
+    duplicates(RoomCounter ("xmppbroadcast_duplicates_suppressed_total",
+                            "Number of received messages suppressed as"
+                            " duplicates", roomJid)),
+    flushesHeld(RoomCounter ("xmppbroadcast_flushes_held_total",
+                             "Number of send batches held back by the"
+                             " flush window", roomJid)),
+    fragmentsDropped(RoomCounter ("xmppbroadcast_fragments_dropped_total",
+                                  "Number of partially received fragmented"
+                                  " messages dropped", roomJid))
 {
-  /* The nick names in the room are not used for anything.  But they have to be
-     unique in order to avoid failures when joining.  Thus we simply use
-     a random value, which will be (almost) guaranteed to be unique.  */
-  xaya::CryptoRand rnd;
-  const auto nick = rnd.Get<xaya::uint256> ();
-  gloox::JID roomWithNick = roomJid;
-  roomWithNick.setResource (nick.ToHex ());
+  if (FLAGS_xmppbroadcast_dedup_size > 0)
+    dedup = std::make_unique<DuplicateFilter> (
+        FLAGS_xmppbroadcast_dedup_size,
+        std::chrono::milliseconds (FLAGS_xmppbroadcast_dedup_ms));
 
-  gloox::MUCRoomHandler* handler = this;
-  client.RunWithClient ([&] (gloox::Client& c)
-    {
-      LOG (INFO) << "Attempting to join room " << roomWithNick.full ();
-      room = std::make_unique<gloox::MUCRoom> (&c, roomWithNick, handler);
-      room->join ();
-    });
+  MucTransport::RoomHandler& handler = *this;
+  room = client.transport->JoinRoom (ownJid, handler);
 }
 
 MucClient::Channel::~Channel ()
@@ -172,10 +545,27 @@ MucClient::Channel::~Channel ()
 
   Leave ();
 
+  /* Close the room handle right away, which guarantees that the transport
+     does not call us anymore.  Otherwise its callbacks could still touch
+     members that are declared after the room, and thus destroyed before it.
+     This may wait for a running callback, which might need our lock.  */
+  lock.unlock ();
+  room.reset ();
+  lock.lock ();
+
   /* Make sure to wake up the sender thread if there is one, so we can
      join it without getting into a deadlock.  */
   stopSender = true;
-  cvSendQueue.notify_all ();
+  sendEvents.Notify ();
+
+  /* With a reactor, make sure that none of our tasks is pending or running.
+     The room is closed already, so that its events do not post new ones.  */
+  if (client.reactor != nullptr)
+    {
+      lock.unlock ();
+      client.reactor->Cancel (dispatchKey, this);
+      lock.lock ();
+    }
 
   if (sender != nullptr)
     {
@@ -184,50 +574,314 @@ MucClient::Channel::~Channel ()
       sender.reset ();
       lock.lock ();
     }
+
+  /* Messages still in the queue will never be sent.  */
+  const auto unsent = sendQueue.PopAll ();
+  sendQueueDepth.Add (-static_cast<int64_t> (unsent.size ()));
+  for (const auto& m : unsent)
+    if (m.ack != nullptr)
+      m.ack->set_value (false);
+
+  /* The sender thread may have registered more acknowledgements
+     after we left.  */
+  FailAcks ();
 }
 
 void
 MucClient::Channel::RunSendLoop ()
 {
-  std::unique_lock<std::mutex> lock(mut);
   while (!stopSender)
     {
-      if (sendQueue.empty ())
-        cvSendQueue.wait (lock);
-      if (sendQueue.empty () || !client.IsConnected ())
+      /* Besides sending, this thread also takes care of timing out
+         acknowledgements, so wake up for the next deadline as well.  */
+      std::chrono::steady_clock::time_point nextDeadline;
+      const bool hasPending = ExpireAcks (nextDeadline);
+      if (sendQueue.Empty ())
+        {
+          /* Senders only notify if they see us waiting, so check the
+             queue again after announcing the wait.  */
+          const auto key = sendEvents.PrepareWait ();
+          if (!sendQueue.Empty () || stopSender)
+            sendEvents.CancelWait ();
+          else if (hasPending)
+            sendEvents.WaitUntil (key, nextDeadline);
+          else
+            sendEvents.Wait (key);
+          continue;
+        }
+      if (!client.IsConnected ())
         continue;
 
-      /* Move the queue to a local variable, so we can release the general lock
-         while we try to obtain the client lock.  Since only one sender thread
-         is running, this is fine and won't lead to out-of-order messages.  */
-      auto localQueue = std::move (sendQueue);
-      CHECK (sendQueue.empty ());
-      CHECK (!localQueue.empty ());
-      lock.unlock ();
-      client.RunWithClient ([this, &localQueue] (gloox::Client& c)
+      /* While traffic is high, wait a little for more messages to send
+         them in the same batch.  Senders do not notify us while the
+         queue is non-empty, so this only wakes up early to stop.  */
+      const auto hold
+          = flushWindow.GetDelay (std::chrono::steady_clock::now ());
+      if (hold > std::chrono::steady_clock::duration::zero ())
         {
-          VLOG (2)
-              << "Sending " << localQueue.size ()
-              << " queued messages for " << roomJid.full ();
-          while (!localQueue.empty ())
+          flushesHeld.Increment ();
+          const auto key = sendEvents.PrepareWait ();
+          if (stopSender)
+            sendEvents.CancelWait ();
+          else
+            sendEvents.WaitUntil (key, std::chrono::steady_clock::now ()
+                                          + hold);
+        }
+
+      SendQueued ();
+    }
+}
+
+void
+MucClient::Channel::SendQueued ()
+{
+  /* Take all queued messages at once.  Since only one sender thread
+     (or reactor task) runs at a time, this won't lead to out-of-order
+     messages.  */
+  auto localQueue = sendQueue.PopAll ();
+  if (localQueue.empty ())
+    return;
+
+  VLOG (2)
+      << "Sending " << localQueue.size ()
+      << " queued messages for " << roomJid.full ();
+
+  const size_t fragmentSize
+      = std::max (FLAGS_xmppbroadcast_fragment_bytes, 0);
+
+  std::vector<std::unique_ptr<MessageStanza>> stanzas;
+  stanzas.reserve (localQueue.size ());
+  std::vector<std::pair<uint64_t, std::unique_ptr<std::promise<bool>>>> acks;
+  uint64_t bytes = 0;
+  for (auto& m : localQueue)
+    {
+      bytes += m.data.size ();
+
+      /* Payloads too large for a single stanza are sent as fragments
+         in consecutive stanzas.  With the shared writer, other rooms
+         can still send in between them.  */
+      const size_t first = stanzas.size ();
+      if (fragmentSize > 0 && m.data.size () > fragmentSize)
+        {
+          auto parts = SplitPayload (m.data, fragmentSize);
+          const uint64_t id = nextFragmentId++;
+          for (size_t i = 0; i < parts.size (); ++i)
             {
-              auto ext = std::make_unique<MessageStanza> (localQueue.front ());
-              gloox::Message glooxMsg(gloox::Message::Groupchat, roomJid);
-              glooxMsg.addExtension (ext.release ());
-              c.send (glooxMsg);
-              localQueue.pop ();
+              auto ext = std::make_unique<MessageStanza> (
+                  std::move (parts[i]));
+              ext->SetFragment (id, i, parts.size ());
+              stanzas.push_back (std::move (ext));
             }
+        }
+      else
+        stanzas.push_back (
+            std::make_unique<MessageStanza> (std::move (m.data)));
+
+      uint64_t ts = m.queued;
+      if (m.queued != 0)
+        SendQueueTimeHistogram ().Observe (SecondsSince (m.queued));
+      else if (m.ack != nullptr)
+        ts = CurrentTimestamp ();
+      if (ts != 0)
+        for (size_t i = first; i < stanzas.size (); ++i)
+          stanzas[i]->SetTiming (ts, nextSenderSeq++);
+
+      /* The message is delivered when its last fragment is.  */
+      if (m.ack != nullptr)
+        acks.emplace_back (stanzas.back ()->GetSenderSeq (),
+                           std::move (m.ack));
+    }
+
+  /* Register the acknowledgements before sending, so that the reflected
+     messages will find them in any case.  */
+  if (!acks.empty ())
+    {
+      const auto now = std::chrono::steady_clock::now ();
+      const auto deadline = now + std::chrono::milliseconds (
+          FLAGS_xmppbroadcast_ack_timeout_ms);
+
+      std::lock_guard<std::mutex> lockAcks(mutAcks);
+      for (auto& a : acks)
+        {
+          auto& entry = pendingAcks[a.first];
+          entry.promise = std::move (*a.second);
+          entry.sent = now;
+          entry.deadline = deadline;
+        }
+    }
+
+  /* With the shared writer, pacing is done there.  Otherwise it
+     blocks this thread while more messages can be queued up.  On the
+     reactor, the paced chunks are sent by timers instead.  */
+  const size_t num = localQueue.size ();
+  if (client.writer != nullptr)
+    client.writer->Enqueue (roomJid, std::move (stanzas));
+  else if (client.pacer != nullptr)
+    {
+      std::vector<MucTransport::Outgoing> out;
+      out.push_back ({roomJid, std::move (stanzas)});
+      if (client.reactor != nullptr)
+        {
+          for (auto& chunk : client.SplitForPacer (std::move (out)))
+            pacedChunks.push_back (std::move (chunk));
+          SendPacedChunks ();
+        }
+      else
+        client.SendPaced (std::move (out));
+    }
+  else
+    client.transport->Send (roomJid, std::move (stanzas));
+  flushWindow.Flushed (num, std::chrono::steady_clock::now ());
+  messagesSent.Increment (num);
+  bytesSent.Increment (bytes);
+  sendQueueDepth.Add (-static_cast<int64_t> (num));
+}
+
+void
+MucClient::Channel::NotifySender ()
+{
+  if (client.reactor != nullptr)
+    client.reactor->Post (dispatchKey, this, [this] () { RunSendTask (); });
+  else
+    sendEvents.Notify ();
+}
+
+void
+MucClient::Channel::RunSendTask ()
+{
+  /* Before joining, messages are just queued.  RoomJoined posts a task
+     for them once we can send.  While holding back messages, the timer
+     for that sends them.  */
+  if (!joined || stopSender || holding || !pacedChunks.empty ()
+        || !client.IsConnected ())
+    return;
+  if (sendQueue.Empty ())
+    return;
+
+  const auto now = std::chrono::steady_clock::now ();
+  const auto hold = flushWindow.GetDelay (now);
+  if (hold > std::chrono::steady_clock::duration::zero ())
+    {
+      flushesHeld.Increment ();
+      holding = true;
+      client.reactor->PostAt (dispatchKey, this, now + hold, [this] ()
+        {
+          holding = false;
+          if (stopSender || !client.IsConnected ())
+            return;
+          SendQueued ();
+          ScheduleAckExpiry ();
         });
-      lock.lock ();
+      return;
     }
+
+  SendQueued ();
+  ScheduleAckExpiry ();
+}
+
+void
+MucClient::Channel::SendPacedChunks ()
+{
+  while (!pacedChunks.empty ())
+    {
+      if (!pacedReserved)
+        {
+          auto& chunk = pacedChunks.front ();
+          const auto wait
+              = client.pacer->Reserve (chunk.numStanzas, chunk.numBytes);
+          pacedReserved = true;
+
+          if (wait > SendPacer::Clock::duration::zero ())
+            {
+              client.reactor->PostAt (
+                  dispatchKey, this, std::chrono::steady_clock::now () + wait,
+                  [this] ()
+                    {
+                      if (stopSender)
+                        return;
+                      SendPacedChunks ();
+
+                      /* Messages queued while we were waiting have not
+                         been sent, since they must not overtake the paced
+                         ones.  */
+                      if (pacedChunks.empty ())
+                        RunSendTask ();
+                    });
+              return;
+            }
+        }
+
+      client.transport->SendAll (std::move (pacedChunks.front ().out));
+      pacedChunks.pop_front ();
+      pacedReserved = false;
+    }
+}
+
+void
+MucClient::Channel::ScheduleAckExpiry ()
+{
+  std::chrono::steady_clock::time_point next;
+  if (!ExpireAcks (next))
+    return;
+
+  /* Deadlines only increase, so a pending timer that is not later than
+     the next deadline will take care of it.  */
+  const std::chrono::steady_clock::time_point none;
+  if (ackTimer != none && ackTimer <= next)
+    return;
+
+  ackTimer = next;
+  client.reactor->PostAt (dispatchKey, this, next, [this] ()
+    {
+      ackTimer = std::chrono::steady_clock::time_point ();
+      ScheduleAckExpiry ();
+    });
 }
 
 void
 MucClient::Channel::Send (const std::string& msg)
 {
-  std::lock_guard<std::mutex> lock(mut);
-  sendQueue.push (msg);
-  cvSendQueue.notify_one ();
+  const uint64_t queued
+      = FLAGS_xmppbroadcast_timestamp_messages ? CurrentTimestamp () : 0;
+
+  sendQueueDepth.Add (1);
+  if (sendQueue.Push ({msg, queued, nullptr}))
+    NotifySender ();
+}
+
+std::future<bool>
+MucClient::Channel::SendWithAck (const std::string& msg)
+{
+  const uint64_t queued
+      = FLAGS_xmppbroadcast_timestamp_messages ? CurrentTimestamp () : 0;
+
+  auto promise = std::make_unique<std::promise<bool>> ();
+  auto res = promise->get_future ();
+
+  sendQueueDepth.Add (1);
+  if (sendQueue.Push ({msg, queued, std::move (promise)}))
+    NotifySender ();
+
+  return res;
+}
+
+void
+MucClient::Channel::Send (std::vector<std::string> msgs)
+{
+  if (msgs.empty ())
+    return;
+
+  const uint64_t queued
+      = FLAGS_xmppbroadcast_timestamp_messages ? CurrentTimestamp () : 0;
+
+  std::vector<QueuedMessage> batch;
+  batch.reserve (msgs.size ());
+  for (auto& m : msgs)
+    batch.push_back ({std::move (m), queued, nullptr});
+
+  sendQueueDepth.Add (batch.size ());
+  if (sendQueue.Push (std::move (batch)))
+    NotifySender ();
 }
 
 void
@@ -237,94 +891,228 @@ MucClient::Channel::Leave ()
     {
       LOG (INFO) << "Leaving room " << roomJid.full ();
       left = true;
-      room->leave ();
+      room->Leave ();
+      FailAcks ();
     }
 }
 
 void
-MucClient::Channel::handleMUCError (gloox::MUCRoom* r,
-                                    const gloox::StanzaError error)
+MucClient::Channel::RoomMessage (const gloox::JID& from,
+                                 const MessageStanza& msg)
 {
-  CHECK_EQ (r, room.get ());
-  LOG (WARNING)
-      << "Received error for MUC room " << room->name () << ": " << error;
-  left = true;
-  room->leave ();
+  CHECK_EQ (from.bareJID (), roomJid);
+
+  /* Check this before looking at the message, which decodes the payload
+     (which is not needed if we drop it anyway).  */
+  if (left)
+    {
+      VLOG (1) << "Ignoring message on left room " << roomJid.bare ();
+      return;
+    }
+  const bool echo = (from == ownJid);
+  if (echo && msg.HasTiming ())
+    ResolveAck (msg);
+
+  if (FLAGS_xmppbroadcast_suppress_echo && echo)
+    {
+      /* Our own fragments are not reassembled.  Only the last one
+         completes the message, so the others are dropped silently.  */
+      if (msg.IsFragment ()
+            && msg.GetFragmentIndex () + 1 != msg.GetFragmentCount ())
+        return;
+
+      static Counter& echoes = MetricsRegistry::Default ().GetCounter (
+          "xmppbroadcast_echoes_suppressed_total",
+          "Number of own messages reflected back by rooms and ignored");
+      echoes.Increment ();
+      EchoReceived (msg);
+      return;
+    }
+
+  if (!msg.IsValid ())
+    {
+      LOG (WARNING)
+          << "Ignoring invalid message from " << from.full ()
+          << " on room " << roomJid.bare ();
+      return;
+    }
+
+  if (msg.HasTiming ())
+    RecordTiming (from, msg);
+
+  std::string assembled;
+  if (msg.IsFragment ())
+    {
+      const auto res = fragments.Add (
+          from.full (), msg.GetFragmentId (),
+          msg.GetFragmentIndex (), msg.GetFragmentCount (),
+          msg.GetData (), assembled);
+      fragmentsDropped.Increment (fragments.TakeDropped ());
+      if (res != FragmentBuffer::Result::COMPLETE)
+        return;
+    }
+  const std::string& data = msg.IsFragment () ? assembled : msg.GetData ();
+
+  messagesReceived.Increment ();
+  bytesReceived.Increment (data.size ());
+
+  if (client.dispatch == nullptr)
+    {
+      Deliver (data);
+      return;
+    }
+
+  /* The message is only valid during this call, so the payload has to be
+     copied for processing it later.  The post may block while the shard's
+     queue is full, so we must not hold a lock here that StopDispatch
+     needs (it may run on the same shard).  Instead, the pool checks
+     the stop flag atomically with queueing the task.  */
+  client.dispatch->Post (dispatchKey, this, [this, data] ()
+    {
+      Deliver (data);
+    },
+    [this] ()
+    {
+      return dispatchStopped.load ();
+    });
 }
 
-bool
-MucClient::Channel::handleMUCRoomCreation (gloox::MUCRoom* r)
+void
+MucClient::Channel::Deliver (const std::string& data)
 {
-  CHECK_EQ (r, room.get ());
-  LOG (WARNING) << "Creating non-existing MUC room " << roomJid.full ();
-  return true;
+  if (dedup != nullptr && dedup->IsDuplicate (data))
+    {
+      VLOG (1) << "Suppressing duplicate message on room " << roomJid.bare ();
+      duplicates.Increment ();
+      return;
+    }
+
+  MessageReceived (data);
 }
 
 void
-MucClient::Channel::handleMUCMessage (gloox::MUCRoom* r,
-                                      const gloox::Message& msg,
-                                      const bool priv)
+MucClient::Channel::StopDispatch ()
 {
-  CHECK_EQ (r, room.get ());
+  if (client.dispatch == nullptr)
+    return;
+
+  /* Once the flag is set, posts that have not queued their task yet drop
+     it, and Cancel wakes up those waiting for space.  */
+  dispatchStopped = true;
+  client.dispatch->Cancel (dispatchKey, this);
+}
 
-  if (priv)
+void
+MucClient::Channel::RecordTiming (const gloox::JID& from,
+                                  const MessageStanza& msg)
+{
+  MessageLatencyHistogram ().Observe (SecondsSince (msg.GetTimestamp ()));
+
+  const uint64_t seq = msg.GetSenderSeq ();
+  auto mit = lastSenderSeq.find (from.full ());
+  if (mit == lastSenderSeq.end ())
     {
-      LOG (WARNING)
-          << "Ignoring private message on room " << room->name ()
-          << " from " << msg.from ().full ();
+      lastSenderSeq.emplace (from.full (), seq);
       return;
     }
 
-  VLOG (1)
-      << "Received message from " << msg.from ().full ()
-      << " on room " << room->name ();
-  CHECK_EQ (msg.from ().bareJID (), roomJid);
+  if (seq > mit->second + 1)
+    {
+      const uint64_t missing = seq - mit->second - 1;
+      LOG (WARNING)
+          << "Missed " << missing << " messages from " << from.full ()
+          << " on room " << roomJid.bare ();
+      messageGaps.Increment (missing);
+    }
+  mit->second = seq;
+}
+
+bool
+MucClient::Channel::ExpireAcks (std::chrono::steady_clock::time_point& next)
+{
+  const auto now = std::chrono::steady_clock::now ();
+
+  std::lock_guard<std::mutex> lock(mutAcks);
+  auto mit = pendingAcks.begin ();
+  for (; mit != pendingAcks.end () && mit->second.deadline <= now; ++mit)
+    {
+      LOG (WARNING)
+          << "Message " << mit->first << " on room " << roomJid.bare ()
+          << " was not acknowledged in time";
+      mit->second.promise.set_value (false);
+    }
+  pendingAcks.erase (pendingAcks.begin (), mit);
 
-  const auto* ext = msg.findExtension<MessageStanza> (MessageStanza::EXT_TYPE);
-  if (ext != nullptr && ext->IsValid ())
-    MessageReceived (ext->GetData ());
+  if (pendingAcks.empty ())
+    return false;
+
+  next = pendingAcks.begin ()->second.deadline;
+  return true;
 }
 
 void
-MucClient::Channel::handleMUCParticipantPresence (
-    gloox::MUCRoom* r, const gloox::MUCRoomParticipant participant,
-    const gloox::Presence& presence)
-{
-  CHECK_EQ (r, room.get ());
-  VLOG (1)
-      << "Presence for " << participant.jid->full ()
-      << " with flags " << participant.flags
-      << " on room " << room->name ()
-      << ": " << presence.presence ();
-
-  /* We are only interested in self presence, to mark the channel as joined
-     or handle a disconnect.  */
-  if (!(participant.flags & gloox::UserSelf))
+MucClient::Channel::FailAcks ()
+{
+  std::lock_guard<std::mutex> lock(mutAcks);
+  for (auto& entry : pendingAcks)
+    entry.second.promise.set_value (false);
+  pendingAcks.clear ();
+}
+
+void
+MucClient::Channel::ResolveAck (const MessageStanza& msg)
+{
+  std::lock_guard<std::mutex> lock(mutAcks);
+  auto mit = pendingAcks.find (msg.GetSenderSeq ());
+  if (mit == pendingAcks.end ())
     return;
 
-  /* Nick changes also send an unavailable presence.  We want to not consider
-     them as such, though.  */
-  bool unavailable = (presence.presence () == gloox::Presence::Unavailable);
-  if (participant.flags & gloox::UserNickChanged)
-    unavailable = false;
+  static Histogram& latency = MetricsRegistry::Default ().GetHistogram (
+      "xmppbroadcast_send_ack_seconds",
+      "Time from sending a message until the room reflected it back",
+      Histogram::LatencyBounds ());
+  latency.ObserveDuration (std::chrono::steady_clock::now ()
+                              - mit->second.sent);
+
+  mit->second.promise.set_value (true);
+  pendingAcks.erase (mit);
+}
 
-  if (unavailable)
+void
+MucClient::Channel::RoomLeft (const std::string& reason)
+{
+  DisconnectCounter (reason).Increment ();
+  left = true;
+  FailAcks ();
+}
+
+void
+MucClient::Channel::RoomJoined ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (joined)
+    return;
+
+  LOG (INFO) << "We have joined " << roomJid.bare () << " successfully";
+  MetricsRegistry::Default ().GetHistogram (
+      "xmppbroadcast_room_join_seconds",
+      "Time from starting to join a room until the join is confirmed",
+      Histogram::LatencyBounds ())
+    .ObserveDuration (std::chrono::steady_clock::now () - joinStart);
+  joined = true;
+
+  /* Messages may have been queued already before we joined.  */
+  if (client.reactor != nullptr)
     {
-      LOG (WARNING) << "We have been disconnected from " << room->name ();
-      left = true;
+      client.reactor->Post (dispatchKey, this, [this] () { RunSendTask (); });
       return;
     }
 
-  std::lock_guard<std::mutex> lock(mut);
-  if (sender == nullptr)
+  stopSender = false;
+  sender = std::make_unique<std::thread> ([this] ()
     {
-      LOG (INFO) << "We have joined " << room->name () << " successfully";
-      stopSender = false;
-      sender = std::make_unique<std::thread> ([this] ()
-        {
-          RunSendLoop ();
-        });
-    }
+      RunSendLoop ();
+    });
 }
 
 /* ************************************************************************** */
@@ -18,22 +18,41 @@
 
 #include "private/mucclient.hpp"
 
+#include "private/loopbacktransport.hpp"
+
 #include "testutils.hpp"
 
 #include <xayautil/hash.hpp>
 
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 namespace xmppbroadcast
 {
+
+DECLARE_int32 (xmppbroadcast_ack_timeout_ms);
+DECLARE_int32 (xmppbroadcast_dedup_size);
+DECLARE_int32 (xmppbroadcast_dispatch_threads);
+DECLARE_int32 (xmppbroadcast_flush_window_us);
+DECLARE_int32 (xmppbroadcast_fragment_bytes);
+DECLARE_int32 (xmppbroadcast_rate_burst_ms);
+DECLARE_int32 (xmppbroadcast_rate_stanzas);
+DECLARE_int32 (xmppbroadcast_reactor_threads);
+DECLARE_bool (xmppbroadcast_shared_writer);
+DECLARE_bool (xmppbroadcast_suppress_echo);
+DECLARE_bool (xmppbroadcast_timestamp_messages);
+
 namespace
 {
 
 /**
- * Custom channel, which puts received messages into a ReceivedMessages
- * instance for testing.
+ * Custom channel, which puts received messages (and echoes of our own
+ * messages if suppressed) into ReceivedMessages instances for testing.
  */
 class TestChannel : public MucClient::Channel
 {
@@ -43,14 +62,33 @@ private:
   /** The queue of received messages to add to.  */
   ReceivedMessages queue;
 
+  /** The queue of suppressed echo messages.  */
+  ReceivedMessages echoes;
+
+  /** Times at which messages were received, in order.  */
+  std::vector<std::chrono::steady_clock::time_point> arrivals;
+
+  /** Lock for the arrival times.  */
+  std::mutex mutArrivals;
+
 protected:
 
   void
   MessageReceived (const std::string& msg) override
   {
+    {
+      std::lock_guard<std::mutex> lock(mutArrivals);
+      arrivals.push_back (std::chrono::steady_clock::now ());
+    }
     queue.Add (msg);
   }
 
+  void
+  EchoReceived (const MessageStanza& msg) override
+  {
+    echoes.Add (msg.GetData ());
+  }
+
 public:
 
   explicit TestChannel (MucClient& c, const gloox::JID& j)
@@ -66,6 +104,25 @@ public:
     queue.Expect (expected);
   }
 
+  /**
+   * Expects that echoes of the given messages have been received.
+   */
+  void
+  ExpectEchoes (const std::vector<std::string>& expected)
+  {
+    echoes.Expect (expected);
+  }
+
+  /**
+   * Returns the times at which all messages so far were received.
+   */
+  std::vector<std::chrono::steady_clock::time_point>
+  GetArrivals ()
+  {
+    std::lock_guard<std::mutex> lock(mutArrivals);
+    return arrivals;
+  }
+
 };
 
 /**
@@ -76,6 +133,27 @@ public:
 class TestClient : public MucClient
 {
 
+private:
+
+  /** If this uses a loopback transport, the transport instance.  */
+  LoopbackTransport* loopback = nullptr;
+
+  /**
+   * Constructs a client with the given loopback transport, taking
+   * ownership of it.  t must refer to the instance held by owned, so that
+   * we keep a pointer to it after it has been moved into MucClient.
+   */
+  explicit TestClient (const std::string& gameId, LoopbackTransport& t,
+                       std::unique_ptr<LoopbackTransport>&& owned)
+    : MucClient(gameId, std::move (owned), GetServerConfig ().muc),
+      loopback(&t)
+  {}
+
+  explicit TestClient (const std::string& gameId,
+                       std::unique_ptr<LoopbackTransport>&& t)
+    : TestClient(gameId, *t, std::move (t))
+  {}
+
 protected:
 
   std::unique_ptr<Channel>
@@ -92,6 +170,24 @@ public:
     SetRootCA (GetTestCA ());
   }
 
+  /**
+   * Constructs a client connected to the given loopback network instead
+   * of the real XMPP server.
+   */
+  explicit TestClient (const std::string& gameId, LoopbackNetwork& net)
+    : TestClient(gameId, std::make_unique<LoopbackTransport> (net))
+  {}
+
+  /**
+   * Simulates connection loss for a loopback client.
+   */
+  void
+  LoseConnection ()
+  {
+    CHECK (loopback != nullptr);
+    loopback->SimulateConnectionLoss ();
+  }
+
   /**
    * Retrieves the channel for a given ID, and expects it to be there.
    */
@@ -105,7 +201,18 @@ public:
 
 };
 
-using MucClientTests = testing::Test;
+/**
+ * Test fixture that restores all flags a test changes when it is done,
+ * also if it fails in between.
+ */
+class MucClientTests : public testing::Test
+{
+
+private:
+
+  gflags::FlagSaver flags;
+
+};
 
 TEST_F (MucClientTests, BasicConnection)
 {
@@ -157,6 +264,39 @@ TEST_F (MucClientTests, ReceivingMessages)
   channel1.ExpectMessages ({"foo", "bar", "baz"});
 }
 
+TEST_F (MucClientTests, TimestampedMessages)
+{
+  auto& latency = MetricsRegistry::Default ().GetHistogram (
+      "xmppbroadcast_message_latency_seconds", "",
+      Histogram::LatencyBounds ());
+  const uint64_t before = latency.GetCumulativeCounts ().back ();
+
+  TestClient client1("test", 0);
+  TestClient client2("test", 1);
+  ASSERT_TRUE (client1.Connect ());
+  ASSERT_TRUE (client2.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel1 = client1.Get (id);
+  auto& channel2 = client2.Get (id);
+  SleepSome ();
+
+  /* One message is sent without timestamp, to verify that mixing them
+     works fine on the receiving side.  */
+  FLAGS_xmppbroadcast_timestamp_messages = true;
+  channel1.Send ("foo");
+  FLAGS_xmppbroadcast_timestamp_messages = false;
+  channel1.Send ("bar");
+  FLAGS_xmppbroadcast_timestamp_messages = true;
+  channel1.Send ("baz");
+
+  channel2.ExpectMessages ({"foo", "bar", "baz"});
+  channel1.ExpectMessages ({"foo", "bar", "baz"});
+
+  /* Both clients have received the two timestamped messages.  */
+  EXPECT_EQ (latency.GetCumulativeCounts ().back (), before + 4);
+}
+
 TEST_F (MucClientTests, RefreshReconnects)
 {
   /* The interval must be sufficiently longer than the time it takes
@@ -176,5 +316,532 @@ TEST_F (MucClientTests, RefreshReconnects)
   EXPECT_TRUE (client.IsConnected ());
 }
 
+/* ************************************************************************** */
+
+using MucClientLoopbackTests = MucClientTests;
+
+TEST_F (MucClientLoopbackTests, MessageExchange)
+{
+  LoopbackNetwork net;
+  TestClient client1("test", net);
+  TestClient client2("test", net);
+  TestClient other("other", net);
+
+  for (auto* c : {&client1, &client2, &other})
+    ASSERT_TRUE (c->Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel1 = client1.Get (id);
+  auto& channel2 = client2.Get (id);
+  other.Get (id);
+  SleepSome ();
+
+  channel1.Send ("foo");
+  channel1.Send (std::vector<std::string> ({"bar", "baz"}));
+  channel2.ExpectMessages ({"foo", "bar", "baz"});
+  channel1.ExpectMessages ({"foo", "bar", "baz"});
+}
+
+TEST_F (MucClientLoopbackTests, Latency)
+{
+  constexpr auto latency = std::chrono::milliseconds (100);
+  LoopbackNetwork net(latency);
+  TestClient client("test", net);
+  ASSERT_TRUE (client.Connect ());
+
+  const auto start = std::chrono::steady_clock::now ();
+  auto& channel = client.Get (xaya::SHA256::Hash ("foo"));
+  channel.Send ("foo");
+  channel.ExpectMessages ({"foo"});
+
+  /* Both joining and the message delivery are delayed.  */
+  EXPECT_GE (std::chrono::steady_clock::now () - start, 2 * latency);
+}
+
+TEST_F (MucClientLoopbackTests, EchoSuppression)
+{
+  LoopbackNetwork net;
+  TestClient client1("test", net);
+  TestClient client2("test", net);
+  ASSERT_TRUE (client1.Connect ());
+  ASSERT_TRUE (client2.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel1 = client1.Get (id);
+  auto& channel2 = client2.Get (id);
+  SleepSome ();
+
+  FLAGS_xmppbroadcast_suppress_echo = true;
+  channel1.Send ("foo");
+  channel2.Send ("bar");
+  channel1.ExpectEchoes ({"foo"});
+  channel2.ExpectEchoes ({"bar"});
+  FLAGS_xmppbroadcast_suppress_echo = false;
+
+  channel1.Send ("baz");
+  channel1.ExpectMessages ({"bar", "baz"});
+  channel2.ExpectMessages ({"foo", "baz"});
+}
+
+TEST_F (MucClientLoopbackTests, SendWithAck)
+{
+  LoopbackNetwork net;
+  TestClient client1("test", net);
+  TestClient client2("test", net);
+  ASSERT_TRUE (client1.Connect ());
+  ASSERT_TRUE (client2.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel1 = client1.Get (id);
+  auto& channel2 = client2.Get (id);
+
+  /* The ack also works with suppressed echoes, and for messages
+     that are queued before the room is joined.  */
+  FLAGS_xmppbroadcast_suppress_echo = true;
+  auto ack1 = channel1.SendWithAck ("foo");
+  channel1.Send ("bar");
+  auto ack2 = channel1.SendWithAck ("baz");
+  EXPECT_TRUE (ack1.get ());
+  EXPECT_TRUE (ack2.get ());
+  channel1.ExpectEchoes ({"foo", "bar", "baz"});
+
+  channel2.ExpectMessages ({"foo", "bar", "baz"});
+}
+
+TEST_F (MucClientLoopbackTests, AckTimeout)
+{
+  LoopbackNetwork net(std::chrono::milliseconds (200));
+  TestClient client("test", net);
+  ASSERT_TRUE (client.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel = client.Get (id);
+
+  FLAGS_xmppbroadcast_ack_timeout_ms = 50;
+  auto ack = channel.SendWithAck ("foo");
+  EXPECT_FALSE (ack.get ());
+
+  /* The message is still delivered, just too late.  */
+  channel.ExpectMessages ({"foo"});
+}
+
+TEST_F (MucClientLoopbackTests, AckDisconnect)
+{
+  LoopbackNetwork net(std::chrono::milliseconds (100));
+  TestClient client("test", net);
+  ASSERT_TRUE (client.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto ack = client.Get (id).SendWithAck ("foo");
+
+  client.LoseConnection ();
+  EXPECT_FALSE (ack.get ());
+}
+
+TEST_F (MucClientLoopbackTests, DuplicateSuppression)
+{
+  LoopbackNetwork net;
+  TestClient client1("test", net);
+  TestClient client2("test", net);
+  ASSERT_TRUE (client1.Connect ());
+  ASSERT_TRUE (client2.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel1 = client1.Get (id);
+
+  /* Only the receiving channel filters duplicates.  */
+  FLAGS_xmppbroadcast_dedup_size = 10;
+  auto& channel2 = client2.Get (id);
+  SleepSome ();
+
+  channel1.Send (std::vector<std::string> ({"foo", "bar", "foo", "baz"}));
+  channel1.ExpectMessages ({"foo", "bar", "foo", "baz"});
+  channel2.Send ("bar");
+  channel1.ExpectMessages ({"bar"});
+  channel1.Send ("end");
+  channel1.ExpectMessages ({"end"});
+
+  channel2.ExpectMessages ({"foo", "bar", "baz", "end"});
+}
+
+TEST_F (MucClientLoopbackTests, DispatchPool)
+{
+  LoopbackNetwork net;
+  TestClient sender("test", net);
+  FLAGS_xmppbroadcast_dispatch_threads = 2;
+  TestClient receiver("test", net);
+  FLAGS_xmppbroadcast_dispatch_threads = 0;
+  ASSERT_TRUE (sender.Connect ());
+  ASSERT_TRUE (receiver.Connect ());
+
+  std::vector<xaya::uint256> ids;
+  for (const std::string str : {"foo", "bar", "baz", "qux"})
+    {
+      ids.push_back (xaya::SHA256::Hash (str));
+      sender.Get (ids.back ());
+      receiver.Get (ids.back ());
+    }
+  SleepSome ();
+
+  std::vector<std::string> expected;
+  for (int i = 0; i < 100; ++i)
+    expected.push_back (std::to_string (i));
+  for (const auto& id : ids)
+    sender.Get (id).Send (expected);
+
+  /* Messages on each channel are received in order.  */
+  for (const auto& id : ids)
+    receiver.Get (id).ExpectMessages (expected);
+
+  /* Leaving a channel while it may still have queued messages.  */
+  receiver.Get (ids[0]).Leave ();
+  sender.Get (ids[0]).Send (expected);
+  EXPECT_EQ (receiver.GetChannel<TestChannel> (ids[0]), nullptr);
+}
+
+TEST_F (MucClientLoopbackTests, SharedWriter)
+{
+  LoopbackNetwork net;
+  FLAGS_xmppbroadcast_shared_writer = true;
+  TestClient sender("test", net);
+  FLAGS_xmppbroadcast_shared_writer = false;
+  TestClient receiver("test", net);
+  ASSERT_TRUE (sender.Connect ());
+  ASSERT_TRUE (receiver.Connect ());
+
+  std::vector<xaya::uint256> ids;
+  for (const std::string str : {"foo", "bar", "baz"})
+    {
+      ids.push_back (xaya::SHA256::Hash (str));
+      sender.Get (ids.back ());
+      receiver.Get (ids.back ());
+    }
+  SleepSome ();
+
+  std::vector<std::string> expected;
+  for (int i = 0; i < 200; ++i)
+    expected.push_back (std::to_string (i));
+  for (const auto& id : ids)
+    sender.Get (id).Send (expected);
+
+  for (const auto& id : ids)
+    {
+      receiver.Get (id).ExpectMessages (expected);
+      sender.Get (id).ExpectMessages (expected);
+    }
+}
+
+TEST_F (MucClientLoopbackTests, Fragmentation)
+{
+  LoopbackNetwork net;
+  TestClient sender("test", net);
+  TestClient receiver("test", net);
+  ASSERT_TRUE (sender.Connect ());
+  ASSERT_TRUE (receiver.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel = sender.Get (id);
+  receiver.Get (id);
+  SleepSome ();
+
+  /* Messages are split into fragments of this size, and reassembled
+     by the receiver.  */
+  FLAGS_xmppbroadcast_fragment_bytes = 10;
+
+  std::vector<std::string> expected;
+  for (const size_t size : {0, 5, 10, 11, 25, 1'000, 3})
+    {
+      std::string msg(size, 'x');
+      for (size_t i = 0; i < size; ++i)
+        msg[i] = 'a' + i % 26;
+      expected.push_back (msg);
+    }
+  channel.Send (expected);
+  receiver.Get (id).ExpectMessages (expected);
+  channel.ExpectMessages (expected);
+
+  /* Acknowledgements wait for the full message.  */
+  auto ack = channel.SendWithAck (std::string (100, 'y'));
+  EXPECT_TRUE (ack.get ());
+  receiver.Get (id).ExpectMessages ({std::string (100, 'y')});
+}
+
+TEST_F (MucClientLoopbackTests, FragmentedEchoes)
+{
+  LoopbackNetwork net;
+  TestClient sender("test", net);
+  TestClient receiver("test", net);
+  ASSERT_TRUE (sender.Connect ());
+  ASSERT_TRUE (receiver.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel = sender.Get (id);
+  receiver.Get (id);
+  SleepSome ();
+
+  FLAGS_xmppbroadcast_fragment_bytes = 10;
+  FLAGS_xmppbroadcast_suppress_echo = true;
+
+  /* The echo of a fragmented message is reported once, with the last
+     fragment, and neither fragments nor the full message are passed
+     on as received.  */
+  const std::string msg = "abcdefghijklmnopqrstuvwxy";
+  channel.Send ({"short", msg});
+  receiver.Get (id).ExpectMessages ({"short", msg});
+  channel.ExpectEchoes ({"short", "uvwxy"});
+}
+
+TEST_F (MucClientLoopbackTests, RateLimit)
+{
+  LoopbackNetwork net;
+  FLAGS_xmppbroadcast_rate_stanzas = 100;
+  FLAGS_xmppbroadcast_rate_burst_ms = 100;
+  TestClient sender("test", net);
+  FLAGS_xmppbroadcast_rate_stanzas = 0;
+  FLAGS_xmppbroadcast_rate_burst_ms = 1'000;
+  TestClient receiver("test", net);
+  ASSERT_TRUE (sender.Connect ());
+  ASSERT_TRUE (receiver.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel = sender.Get (id);
+  receiver.Get (id);
+  SleepSome ();
+
+  /* The burst allows ten messages right away, the others are paced
+     to 100 per second.  */
+  std::vector<std::string> expected;
+  for (int i = 0; i < 50; ++i)
+    expected.push_back (std::to_string (i));
+
+  const auto start = std::chrono::steady_clock::now ();
+  channel.Send (expected);
+  receiver.Get (id).ExpectMessages (expected);
+  EXPECT_GE (std::chrono::steady_clock::now () - start,
+             std::chrono::milliseconds (350));
+}
+
+TEST_F (MucClientLoopbackTests, RateLimitSpreadsBatches)
+{
+  /* This is tested with the sender thread, the shared writer and
+     the reactor (where paced messages are sent by timers).  */
+  for (const int mode : {0, 1, 2})
+    {
+      LoopbackNetwork net;
+      FLAGS_xmppbroadcast_rate_stanzas = 100;
+      FLAGS_xmppbroadcast_rate_burst_ms = 100;
+      FLAGS_xmppbroadcast_shared_writer = (mode == 1);
+      FLAGS_xmppbroadcast_reactor_threads = (mode == 2 ? 1 : 0);
+      TestClient sender("test", net);
+      FLAGS_xmppbroadcast_rate_stanzas = 0;
+      FLAGS_xmppbroadcast_rate_burst_ms = 1'000;
+      FLAGS_xmppbroadcast_shared_writer = false;
+      FLAGS_xmppbroadcast_reactor_threads = 0;
+      TestClient receiver("test", net);
+      ASSERT_TRUE (sender.Connect ());
+      ASSERT_TRUE (receiver.Connect ());
+
+      const auto id = xaya::SHA256::Hash ("foo");
+      auto& channel = sender.Get (id);
+      receiver.Get (id);
+      SleepSome ();
+
+      /* The second batch is queued while the first is still being paced,
+         and must not overtake it.  */
+      std::vector<std::string> expected;
+      for (int i = 0; i < 50; ++i)
+        expected.push_back (std::to_string (i));
+      channel.Send (std::vector<std::string> (expected.begin (),
+                                              expected.begin () + 25));
+      channel.Send (std::vector<std::string> (expected.begin () + 25,
+                                              expected.end ()));
+      receiver.Get (id).ExpectMessages (expected);
+
+      /* The batches are sent in chunks of at most the burst size (ten
+         messages), each delayed by the pacer.  So every message arrives
+         only once there were tokens for it, i.e. they are spread out
+         rather than sent together after the delay of their batch.  */
+      const auto arrivals = receiver.Get (id).GetArrivals ();
+      ASSERT_EQ (arrivals.size (), expected.size ());
+      for (int i = 10; i < static_cast<int> (arrivals.size ()); ++i)
+        EXPECT_GE (arrivals[i] - arrivals[0],
+                   std::chrono::milliseconds (10 * (i - 9) - 30))
+            << "mode " << mode << ", message " << i;
+    }
+}
+
+TEST_F (MucClientLoopbackTests, FlushWindow)
+{
+  LoopbackNetwork net;
+  FLAGS_xmppbroadcast_flush_window_us = 500;
+  TestClient sender("test", net);
+  FLAGS_xmppbroadcast_flush_window_us = 0;
+  TestClient receiver("test", net);
+  ASSERT_TRUE (sender.Connect ());
+  ASSERT_TRUE (receiver.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel = sender.Get (id);
+  receiver.Get (id);
+  SleepSome ();
+
+  /* Messages sent one by one in quick succession are held back and
+     batched, but must still all arrive in order.  */
+  std::vector<std::string> expected;
+  for (int i = 0; i < 1'000; ++i)
+    {
+      expected.push_back (std::to_string (i));
+      channel.Send (expected.back ());
+    }
+  receiver.Get (id).ExpectMessages (expected);
+
+  /* An isolated message later is sent as well.  */
+  SleepSome ();
+  channel.Send ("last");
+  receiver.Get (id).ExpectMessages ({"last"});
+}
+
+TEST_F (MucClientLoopbackTests, Reactor)
+{
+  LoopbackNetwork net;
+  FLAGS_xmppbroadcast_reactor_threads = 2;
+  FLAGS_xmppbroadcast_flush_window_us = 200;
+  TestClient sender("test", net);
+  FLAGS_xmppbroadcast_flush_window_us = 0;
+  TestClient receiver("test", net);
+  FLAGS_xmppbroadcast_reactor_threads = 0;
+  ASSERT_TRUE (sender.UsesReactor ());
+  ASSERT_TRUE (sender.Connect ());
+  ASSERT_TRUE (receiver.Connect ());
+
+  /* Messages queued before the rooms are joined are sent afterwards.  */
+  std::vector<std::string> expected;
+  for (int i = 0; i < 200; ++i)
+    expected.push_back (std::to_string (i));
+
+  std::vector<xaya::uint256> ids;
+  for (const std::string str : {"foo", "bar", "baz"})
+    {
+      ids.push_back (xaya::SHA256::Hash (str));
+      receiver.Get (ids.back ());
+    }
+  SleepSome ();
+  for (const auto& id : ids)
+    for (const auto& m : expected)
+      sender.Get (id).Send (m);
+
+  for (const auto& id : ids)
+    {
+      receiver.Get (id).ExpectMessages (expected);
+      sender.Get (id).ExpectMessages (expected);
+    }
+
+  auto ack = sender.Get (ids[0]).SendWithAck ("ack");
+  EXPECT_TRUE (ack.get ());
+  receiver.Get (ids[0]).ExpectMessages ({"ack"});
+
+  /* The refresher runs on the reactor as well.  */
+  constexpr auto intv = std::chrono::milliseconds (50);
+  MucClient::Refresher refresher(sender, intv);
+  sender.LoseConnection ();
+  std::this_thread::sleep_for (4 * intv);
+  EXPECT_TRUE (sender.IsConnected ());
+}
+
+TEST_F (MucClientLoopbackTests, ReactorAckTimeout)
+{
+  LoopbackNetwork net(std::chrono::milliseconds (200));
+  FLAGS_xmppbroadcast_reactor_threads = 1;
+  TestClient client("test", net);
+  FLAGS_xmppbroadcast_reactor_threads = 0;
+  ASSERT_TRUE (client.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  auto& channel = client.Get (id);
+
+  FLAGS_xmppbroadcast_ack_timeout_ms = 50;
+  auto ack = channel.SendWithAck ("foo");
+  EXPECT_FALSE (ack.get ());
+
+  channel.ExpectMessages ({"foo"});
+}
+
+TEST_F (MucClientLoopbackTests, ConnectionLoss)
+{
+  LoopbackNetwork net;
+  TestClient client1("test", net);
+  TestClient client2("test", net);
+  ASSERT_TRUE (client1.Connect ());
+  ASSERT_TRUE (client2.Connect ());
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  client1.Get (id);
+  client2.Get (id);
+  SleepSome ();
+
+  client2.LoseConnection ();
+  EXPECT_FALSE (client2.IsConnected ());
+  EXPECT_EQ (client2.GetChannel<TestChannel> (id), nullptr);
+  client1.Get (id).Send ("lost");
+  client1.Get (id).ExpectMessages ({"lost"});
+
+  ASSERT_TRUE (client2.Connect ());
+  auto& channel2 = client2.Get (id);
+  SleepSome ();
+
+  client1.Get (id).Send ("foo");
+  channel2.ExpectMessages ({"foo"});
+  client1.Get (id).ExpectMessages ({"foo"});
+}
+
+/**
+ * Statically typed client with TestChannel instances.
+ */
+class TypedTestClient : public TypedMucClient<TestChannel>
+{
+
+protected:
+
+  std::unique_ptr<TestChannel>
+  CreateTypedChannel (const gloox::JID& j) override
+  {
+    return std::make_unique<TestChannel> (*this, j);
+  }
+
+public:
+
+  explicit TypedTestClient (LoopbackNetwork& net)
+    : TypedMucClient("test", std::make_unique<LoopbackTransport> (net),
+                     GetServerConfig ().muc)
+  {}
+
+};
+
+TEST_F (MucClientLoopbackTests, TypedClient)
+{
+  LoopbackNetwork net;
+  TypedTestClient client1(net);
+  TestClient client2("test", net);
+
+  const auto id = xaya::SHA256::Hash ("foo");
+  EXPECT_EQ (client1.GetChannel (id), nullptr);
+
+  ASSERT_TRUE (client1.Connect ());
+  ASSERT_TRUE (client2.Connect ());
+  TestChannel* channel1 = client1.GetChannel (id);
+  ASSERT_NE (channel1, nullptr);
+  EXPECT_EQ (client1.GetChannel (id), channel1);
+  auto& channel2 = client2.Get (id);
+  SleepSome ();
+
+  channel1->Send ("foo");
+  channel2.ExpectMessages ({"foo"});
+  channel1->ExpectMessages ({"foo"});
+
+  channel1->Leave ();
+  EXPECT_EQ (client1.GetChannel (id), nullptr);
+  EXPECT_NE (client1.GetChannel (id), nullptr);
+}
+
 } // anonymous namespace
 } // namespace xmppbroadcast
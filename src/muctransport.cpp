@@ -0,0 +1,53 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/muctransport.hpp"
+
+#include <utility>
+
+namespace xmppbroadcast
+{
+
+void
+MucTransport::SetDisconnectHandler (const std::function<void ()>& h)
+{
+  std::lock_guard<std::mutex> lock(mutHandler);
+  disconnectHandler = h;
+}
+
+void
+MucTransport::NotifyDisconnect ()
+{
+  std::function<void ()> h;
+  {
+    std::lock_guard<std::mutex> lock(mutHandler);
+    h = disconnectHandler;
+  }
+
+  if (h)
+    h ();
+}
+
+void
+MucTransport::SendAll (std::vector<Outgoing> out)
+{
+  for (auto& o : out)
+    Send (o.room, std::move (o.msgs));
+}
+
+} // namespace xmppbroadcast
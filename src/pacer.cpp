@@ -0,0 +1,174 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/pacer.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <thread>
+
+namespace xmppbroadcast
+{
+
+/* ************************************************************************** */
+
+TokenBucket::TokenBucket (const double r, const double b,
+                          const Clock::time_point now)
+  : rate(r), burst(b), tokens(b), last(now)
+{
+  CHECK_GT (rate, 0.0);
+  CHECK_GT (burst, 0.0);
+}
+
+void
+TokenBucket::Refill (const Clock::time_point now)
+{
+  if (now <= last)
+    return;
+
+  const std::chrono::duration<double> elapsed = now - last;
+  tokens = std::min (burst, tokens + elapsed.count () * rate);
+  last = now;
+}
+
+TokenBucket::Clock::duration
+TokenBucket::Take (const double n, const Clock::time_point now)
+{
+  Refill (now);
+  tokens -= n;
+  if (tokens >= 0.0)
+    return Clock::duration::zero ();
+
+  const std::chrono::duration<double> wait(-tokens / rate);
+  return std::chrono::duration_cast<Clock::duration> (wait);
+}
+
+double
+TokenBucket::GetTokens (const Clock::time_point now)
+{
+  Refill (now);
+  return tokens;
+}
+
+double
+TokenBucket::GetBurst () const
+{
+  return burst;
+}
+
+/* ************************************************************************** */
+
+SendPacer::SendPacer (const double bytesPerSecond,
+                      const double stanzasPerSecond,
+                      const Clock::duration burst,
+                      const NowFcn& n, const SleepFcn& s)
+  : now(n),
+    sleep(s ? s : [] (const Clock::duration d)
+      {
+        std::this_thread::sleep_for (d);
+      }),
+    bytesAvailable(MetricsRegistry::Default ().GetGauge (
+        "xmppbroadcast_pacer_tokens",
+        "Tokens available in the send pacer (negative if in debt)",
+        {{"bucket", "bytes"}})),
+    stanzasAvailable(MetricsRegistry::Default ().GetGauge (
+        "xmppbroadcast_pacer_tokens",
+        "Tokens available in the send pacer (negative if in debt)",
+        {{"bucket", "stanzas"}})),
+    throttled(MetricsRegistry::Default ().GetCounter (
+        "xmppbroadcast_pacer_throttled_total",
+        "Number of sends delayed by the send pacer")),
+    delay(MetricsRegistry::Default ().GetHistogram (
+        "xmppbroadcast_pacer_delay_seconds",
+        "Time sends were delayed by the send pacer",
+        Histogram::LatencyBounds ()))
+{
+  const std::chrono::duration<double> burstSeconds = burst;
+  const auto start = now ();
+
+  /* The burst is at least one stanza / byte, so that the bucket can
+     hold anything at all.  */
+  if (bytesPerSecond > 0)
+    bytes = std::make_unique<TokenBucket> (
+        bytesPerSecond,
+        std::max (1.0, bytesPerSecond * burstSeconds.count ()), start);
+  if (stanzasPerSecond > 0)
+    stanzas = std::make_unique<TokenBucket> (
+        stanzasPerSecond,
+        std::max (1.0, stanzasPerSecond * burstSeconds.count ()), start);
+}
+
+void
+SendPacer::Pace (const size_t numStanzas, const size_t numBytes)
+{
+  const auto wait = Reserve (numStanzas, numBytes);
+  if (wait > Clock::duration::zero ())
+    sleep (wait);
+}
+
+SendPacer::Clock::duration
+SendPacer::Reserve (const size_t numStanzas, const size_t numBytes)
+{
+  Clock::duration wait = Clock::duration::zero ();
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    const auto t = now ();
+
+    /* Tokens are taken from both buckets, and we wait for the one
+       that needs longer.  Since the tokens are reserved right away,
+       concurrent callers queue up behind each other.  */
+    if (bytes != nullptr)
+      {
+        wait = std::max (wait, bytes->Take (numBytes, t));
+        bytesAvailable.Set (bytes->GetTokens (t));
+      }
+    if (stanzas != nullptr)
+      {
+        wait = std::max (wait, stanzas->Take (numStanzas, t));
+        stanzasAvailable.Set (stanzas->GetTokens (t));
+      }
+  }
+
+  if (wait <= Clock::duration::zero ())
+    return Clock::duration::zero ();
+
+  VLOG (2)
+      << "Pacing send of " << numStanzas << " stanzas (" << numBytes
+      << " bytes) for "
+      << std::chrono::duration_cast<std::chrono::microseconds> (wait).count ()
+      << " us";
+  throttled.Increment ();
+  delay.ObserveDuration (wait);
+
+  return wait;
+}
+
+bool
+SendPacer::FitsBurst (const size_t numStanzas, const size_t numBytes) const
+{
+  if (bytes != nullptr && numBytes > bytes->GetBurst ())
+    return false;
+  if (stanzas != nullptr && numStanzas > stanzas->GetBurst ())
+    return false;
+  return true;
+}
+
+/* ************************************************************************** */
+
+} // namespace xmppbroadcast
@@ -0,0 +1,172 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/pacer.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+using TokenBucketTests = testing::Test;
+
+TEST_F (TokenBucketTests, BurstAndRefill)
+{
+  const TokenBucket::Clock::time_point start;
+  TokenBucket bucket(10, 5, start);
+
+  /* The bucket starts full, so a burst is possible right away.  */
+  EXPECT_EQ (bucket.Take (3, start), milliseconds (0));
+  EXPECT_EQ (bucket.Take (2, start), milliseconds (0));
+  EXPECT_DOUBLE_EQ (bucket.GetTokens (start), 0);
+
+  /* Afterwards, tokens are refilled at the rate.  */
+  EXPECT_EQ (bucket.Take (1, start), milliseconds (100));
+  EXPECT_DOUBLE_EQ (bucket.GetTokens (start + milliseconds (300)), 2);
+
+  /* Refilling stops at the burst size.  */
+  EXPECT_DOUBLE_EQ (bucket.GetTokens (start + seconds (10)), 5);
+}
+
+TEST_F (TokenBucketTests, Debt)
+{
+  const TokenBucket::Clock::time_point start;
+  TokenBucket bucket(10, 5, start);
+
+  /* Taking more than the burst size is possible, but needs waiting.  */
+  EXPECT_EQ (bucket.Take (25, start), seconds (2));
+  EXPECT_DOUBLE_EQ (bucket.GetTokens (start), -20);
+  EXPECT_EQ (bucket.Take (5, start + seconds (1)), milliseconds (1'500));
+  EXPECT_DOUBLE_EQ (bucket.GetTokens (start + seconds (3)), 5);
+}
+
+/**
+ * Fake clock for the pacer, which only advances when sleeping.
+ */
+class FakeClock
+{
+
+public:
+
+  TokenBucket::Clock::time_point now;
+  TokenBucket::Clock::duration slept = TokenBucket::Clock::duration::zero ();
+
+  SendPacer::NowFcn
+  Now ()
+  {
+    return [this] () { return now; };
+  }
+
+  SendPacer::SleepFcn
+  Sleep ()
+  {
+    return [this] (const TokenBucket::Clock::duration d)
+      {
+        now += d;
+        slept += d;
+      };
+  }
+
+};
+
+using SendPacerTests = testing::Test;
+
+TEST_F (SendPacerTests, BytesLimit)
+{
+  FakeClock clock;
+  SendPacer pacer(1'000, 0, milliseconds (100), clock.Now (), clock.Sleep ());
+
+  /* The burst of 100 bytes goes through right away.  */
+  pacer.Pace (10, 100);
+  EXPECT_EQ (clock.slept, milliseconds (0));
+
+  /* After that, sending is paced to the rate.  */
+  for (int i = 0; i < 10; ++i)
+    pacer.Pace (1, 100);
+  EXPECT_EQ (clock.slept, seconds (1));
+}
+
+TEST_F (SendPacerTests, StanzasLimit)
+{
+  FakeClock clock;
+  SendPacer pacer(0, 10, seconds (1), clock.Now (), clock.Sleep ());
+
+  pacer.Pace (10, 1'000'000);
+  EXPECT_EQ (clock.slept, milliseconds (0));
+  pacer.Pace (5, 0);
+  EXPECT_EQ (clock.slept, milliseconds (500));
+}
+
+TEST_F (SendPacerTests, BothLimits)
+{
+  FakeClock clock;
+  SendPacer pacer(100, 10, seconds (1), clock.Now (), clock.Sleep ());
+
+  /* The slower of the two limits determines the waiting time.  */
+  pacer.Pace (10, 100);
+  pacer.Pace (1, 50);
+  EXPECT_EQ (clock.slept, milliseconds (500));
+
+  /* While waiting for the bytes, stanza tokens have refilled to four.  */
+  pacer.Pace (20, 0);
+  EXPECT_EQ (clock.slept, milliseconds (2'100));
+}
+
+TEST_F (SendPacerTests, Unlimited)
+{
+  FakeClock clock;
+  SendPacer pacer(0, 0, seconds (1), clock.Now (), clock.Sleep ());
+
+  pacer.Pace (1'000, 1'000'000);
+  EXPECT_EQ (clock.slept, milliseconds (0));
+}
+
+TEST_F (SendPacerTests, Reserve)
+{
+  FakeClock clock;
+  SendPacer pacer(0, 10, seconds (1), clock.Now (), clock.Sleep ());
+
+  /* Reserving does not block, but tokens are taken all the same.  */
+  EXPECT_EQ (pacer.Reserve (10, 0), milliseconds (0));
+  EXPECT_EQ (pacer.Reserve (5, 0), milliseconds (500));
+  EXPECT_EQ (pacer.Reserve (5, 0), milliseconds (1'000));
+  EXPECT_EQ (clock.slept, milliseconds (0));
+}
+
+TEST_F (SendPacerTests, FitsBurst)
+{
+  FakeClock clock;
+  SendPacer pacer(100, 10, seconds (1), clock.Now (), clock.Sleep ());
+
+  EXPECT_TRUE (pacer.FitsBurst (10, 100));
+  EXPECT_FALSE (pacer.FitsBurst (11, 100));
+  EXPECT_FALSE (pacer.FitsBurst (10, 101));
+
+  SendPacer unlimited(0, 0, seconds (1), clock.Now (), clock.Sleep ());
+  EXPECT_TRUE (unlimited.FitsBurst (1'000, 1'000'000));
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
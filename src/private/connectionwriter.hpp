@@ -0,0 +1,135 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_CONNECTIONWRITER_HPP
+#define XMPPBROADCAST_CONNECTIONWRITER_HPP
+
+#include "mpscqueue.hpp"
+#include "muctransport.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+/**
+ * A writer stage for a connection, which collects messages to be sent
+ * from all channels and passes them on to the transport together.  This
+ * way, many active channels result in one access to the connection
+ * (and back-to-back writes) instead of one per channel.
+ *
+ * For fairness, rooms are scheduled with deficit round-robin:  In each
+ * round, every room with a backlog gets a quantum of payload bytes
+ * (multiplied by its weight) added to its deficit, and sends messages
+ * as long as they fit.  Thus a channel with a large backlog cannot starve
+ * the others, and bandwidth is shared according to the weights.
+ */
+class ConnectionWriter
+{
+
+public:
+
+  /** Function that actually sends one round of messages.  */
+  using SendFcn = std::function<void (std::vector<MucTransport::Outgoing>)>;
+
+private:
+
+  /** The function used for sending.  */
+  const SendFcn send;
+
+  /**
+   * Payload bytes added to the deficit of each room per round (for weight
+   * one), or zero for no limit.
+   */
+  const size_t quantum;
+
+  /** Messages enqueued by a channel.  */
+  struct Pending
+  {
+
+    /** The messages and their room.  */
+    MucTransport::Outgoing out;
+
+    /** Time when they were enqueued.  */
+    std::chrono::steady_clock::time_point enqueued;
+
+  };
+
+  /** Messages enqueued by channels and not yet picked up.  */
+  MpscQueue<Pending> incoming;
+
+  /** Weights of rooms by bare JID, for those that have one set.  */
+  std::map<std::string, unsigned> weights;
+
+  /** Lock for the weights.  */
+  std::mutex mutWeights;
+
+  /** Notified when messages are enqueued or we should stop.  */
+  EventCount events;
+
+  /** Set when the thread should stop.  */
+  std::atomic<bool> stop;
+
+  /** The writer thread.  */
+  std::thread worker;
+
+  /**
+   * Runs the loop collecting and sending messages.
+   */
+  void Run ();
+
+public:
+
+  explicit ConnectionWriter (const SendFcn& s, size_t q);
+
+  /**
+   * Stops the writer thread.  Messages not yet sent are dropped.
+   */
+  ~ConnectionWriter ();
+
+  ConnectionWriter () = delete;
+  ConnectionWriter (const ConnectionWriter&) = delete;
+  void operator= (const ConnectionWriter&) = delete;
+
+  /**
+   * Sets the weight of a room, i.e. the share of bandwidth it gets
+   * relative to others (which have weight one by default).  The weight
+   * must be positive.
+   */
+  void SetWeight (const gloox::JID& room, unsigned weight);
+
+  /**
+   * Enqueues messages to be sent to the given room.  This never blocks.
+   */
+  void Enqueue (const gloox::JID& room,
+                std::vector<std::unique_ptr<MessageStanza>> msgs);
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_CONNECTIONWRITER_HPP
@@ -0,0 +1,132 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_DEDUP_HPP
+#define XMPPBROADCAST_DEDUP_HPP
+
+#include <xayautil/uint256.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace xmppbroadcast
+{
+
+/**
+ * Filter for recently seen payloads, used to suppress duplicate messages
+ * on a channel (e.g. when several participants broadcast the same data,
+ * or messages are replayed after a reconnect).
+ *
+ * Payloads are remembered by their SHA-256 hash, in a least-recently-used
+ * list bounded in size.  Since the hash is collision-resistant, different
+ * payloads are not mistaken for duplicates of each other.  Entries also
+ * expire after a maximum age.  This is not thread-safe.
+ */
+class DuplicateFilter
+{
+
+public:
+
+  using Clock = std::chrono::steady_clock;
+
+private:
+
+  /** Data we store for a remembered payload.  */
+  struct Entry
+  {
+
+    /** The payload's SHA-256 hash.  */
+    xaya::uint256 digest;
+
+    /** When the payload was last seen.  */
+    Clock::time_point lastSeen;
+
+  };
+
+  /**
+   * Hasher for digests in the index.  They are uniformly distributed
+   * already, so we can just use some of their bytes.
+   */
+  struct DigestHasher
+  {
+
+    size_t
+    operator() (const xaya::uint256& d) const
+    {
+      size_t res;
+      std::memcpy (&res, d.GetBlob (), sizeof (res));
+      return res;
+    }
+
+  };
+
+  /** Maximum number of payloads to remember.  */
+  const size_t capacity;
+
+  /** Maximum age after which payloads are forgotten.  */
+  const Clock::duration maxAge;
+
+  /** The remembered payloads, with the most recently seen first.  */
+  std::list<Entry> entries;
+
+  /** Index of the entries by digest.  */
+  std::unordered_map<xaya::uint256, std::list<Entry>::iterator, DigestHasher>
+      byDigest;
+
+  /**
+   * Removes entries that are too old at the given time.
+   */
+  void Expire (Clock::time_point now);
+
+public:
+
+  /**
+   * Constructs a filter remembering up to the given number of payloads
+   * for at most the given time.
+   */
+  explicit DuplicateFilter (size_t cap, Clock::duration age);
+
+  DuplicateFilter () = delete;
+  DuplicateFilter (const DuplicateFilter&) = delete;
+  void operator= (const DuplicateFilter&) = delete;
+
+  /**
+   * Checks if the given payload has been seen recently.  If it has not,
+   * it is remembered (so that the next call with it will return true).
+   */
+  bool IsDuplicate (const std::string& payload,
+                    Clock::time_point now = Clock::now ());
+
+  /**
+   * Returns the number of payloads remembered at the moment.
+   */
+  size_t
+  Size () const
+  {
+    return entries.size ();
+  }
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_DEDUP_HPP
@@ -0,0 +1,64 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_DISPATCHPOOL_HPP
+#define XMPPBROADCAST_DISPATCHPOOL_HPP
+
+#include "shardedexecutor.hpp"
+
+#include <cstddef>
+
+namespace xmppbroadcast
+{
+
+/**
+ * A pool of worker threads that runs tasks (processing of received
+ * messages) off the thread receiving them.  Tasks are sharded by a key,
+ * with one thread and queue per shard.  Thus tasks with the same key
+ * (e.g. for the same room) are run in order.
+ *
+ * The queue of each shard is bounded.  When it is full, posting a task
+ * blocks until there is space again, which pushes back on the receiving
+ * side instead of dropping messages.
+ *
+ * See ShardedExecutor for the details of the methods.
+ */
+class DispatchPool : private ShardedExecutor
+{
+
+public:
+
+  using ShardedExecutor::Task;
+
+  /**
+   * Starts a pool with the given number of shards (threads), each
+   * with a queue holding at most the given number of tasks.
+   */
+  explicit DispatchPool (const size_t numShards, const size_t capacity)
+    : ShardedExecutor("dispatch", numShards, capacity)
+  {}
+
+  using ShardedExecutor::Post;
+  using ShardedExecutor::Cancel;
+  using ShardedExecutor::Flush;
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_DISPATCHPOOL_HPP
@@ -0,0 +1,90 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_FLUSHWINDOW_HPP
+#define XMPPBROADCAST_FLUSHWINDOW_HPP
+
+#include <chrono>
+#include <cstddef>
+
+namespace xmppbroadcast
+{
+
+/**
+ * Adaptive policy for how long queued messages are held back before
+ * sending them, similar to Nagle's algorithm.  When messages arrive at a
+ * high rate, holding them for a short window lets more of them be sent in
+ * one batch.  When traffic is idle, messages are sent right away, so that
+ * their latency does not suffer.  The arrival rate is estimated from the
+ * batches flushed before.  This is not thread-safe.
+ */
+class FlushWindow
+{
+
+public:
+
+  using Clock = std::chrono::steady_clock;
+
+private:
+
+  /** Maximum time to hold messages (zero to disable holding).  */
+  const Clock::duration maxDelay;
+
+  /** Smoothed estimate of messages flushed per second.  */
+  double rate = 0.0;
+
+  /** Time of the last flush.  */
+  Clock::time_point lastFlush;
+
+public:
+
+  /**
+   * Constructs the policy with the given maximum delay.
+   */
+  explicit FlushWindow (Clock::duration d);
+
+  FlushWindow () = delete;
+  FlushWindow (const FlushWindow&) = delete;
+  void operator= (const FlushWindow&) = delete;
+
+  /**
+   * Returns how long messages that are pending at the given time should
+   * be held before flushing them (zero to flush right away).
+   */
+  Clock::duration GetDelay (Clock::time_point now) const;
+
+  /**
+   * Records that a batch of the given number of messages was flushed
+   * at the given time.
+   */
+  void Flushed (size_t num, Clock::time_point now);
+
+  /**
+   * Returns the current estimate of the message rate per second.
+   */
+  double
+  GetRate () const
+  {
+    return rate;
+  }
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_FLUSHWINDOW_HPP
@@ -0,0 +1,181 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_FRAGMENTS_HPP
+#define XMPPBROADCAST_FRAGMENTS_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+/**
+ * Splits a payload into pieces of at most the given size.  The result
+ * has at least one element (which is empty for an empty payload).
+ */
+std::vector<std::string> SplitPayload (const std::string& data,
+                                       size_t maxSize);
+
+/**
+ * Buffer for reassembling messages that were split into fragments by the
+ * sender.  Since a sender transmits the fragments of one message in order
+ * and before its next message, we keep at most one partial message per
+ * sender, and fragments have to arrive in sequence.
+ *
+ * The memory used is bounded:  If the buffered data exceeds a maximum size,
+ * the oldest partial messages are dropped.  Partial messages are also
+ * dropped if they are not completed within a timeout.  This is not
+ * thread-safe.
+ */
+class FragmentBuffer
+{
+
+public:
+
+  using Clock = std::chrono::steady_clock;
+
+  /** Result of adding a fragment.  */
+  enum class Result
+  {
+    /** The fragment was buffered, and more are needed.  */
+    INCOMPLETE,
+
+    /** The fragment completed a message.  */
+    COMPLETE,
+
+    /** The fragment was dropped, e.g. because it was out of sequence.  */
+    DROPPED,
+  };
+
+private:
+
+  /** A partially received message.  */
+  struct Entry
+  {
+
+    /** The sender, as used for the index.  */
+    std::string sender;
+
+    /** The sender's ID for the fragmented message.  */
+    uint64_t id;
+
+    /** Total number of fragments.  */
+    unsigned count;
+
+    /** Index of the next expected fragment.  */
+    unsigned next;
+
+    /** The data received so far.  */
+    std::string data;
+
+    /** When the first fragment was received.  */
+    Clock::time_point started;
+
+  };
+
+  /** Maximum number of bytes to buffer in total.  */
+  const size_t maxBytes;
+
+  /** Time after which partial messages are dropped.  */
+  const Clock::duration timeout;
+
+  /** The partial messages, with the oldest first.  */
+  std::list<Entry> entries;
+
+  /** Index of the entries by sender.  */
+  std::unordered_map<std::string, std::list<Entry>::iterator> bySender;
+
+  /** Total size of the buffered data.  */
+  size_t bytes = 0;
+
+  /** Number of partial messages dropped since the last TakeDropped call.  */
+  uint64_t dropped = 0;
+
+  /**
+   * Removes the given entry.  If it was not complete, it is counted
+   * as dropped.
+   */
+  void Remove (std::list<Entry>::iterator it, bool complete);
+
+  /**
+   * Drops partial messages that timed out at the given time.
+   */
+  void Expire (Clock::time_point now);
+
+public:
+
+  /**
+   * Constructs a buffer holding at most the given number of bytes,
+   * and dropping partial messages after the given timeout.
+   */
+  explicit FragmentBuffer (size_t b, Clock::duration t);
+
+  FragmentBuffer () = delete;
+  FragmentBuffer (const FragmentBuffer&) = delete;
+  void operator= (const FragmentBuffer&) = delete;
+
+  /**
+   * Adds a received fragment.  If this completes the message, returns
+   * COMPLETE and sets msg to the reassembled payload.
+   */
+  Result Add (const std::string& sender, uint64_t id,
+              unsigned index, unsigned count, const std::string& data,
+              std::string& msg, Clock::time_point now = Clock::now ());
+
+  /**
+   * Returns the number of partial messages dropped (due to timeouts,
+   * the memory limit or missing fragments) since the last call,
+   * and resets it.
+   */
+  uint64_t
+  TakeDropped ()
+  {
+    const uint64_t res = dropped;
+    dropped = 0;
+    return res;
+  }
+
+  /**
+   * Returns the number of bytes buffered at the moment.
+   */
+  size_t
+  GetBytes () const
+  {
+    return bytes;
+  }
+
+  /**
+   * Returns the number of partial messages buffered at the moment.
+   */
+  size_t
+  Size () const
+  {
+    return entries.size ();
+  }
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_FRAGMENTS_HPP
@@ -0,0 +1,114 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_JSONWRITER_HPP
+#define XMPPBROADCAST_JSONWRITER_HPP
+
+#include <cstdint>
+#include <string>
+
+namespace xmppbroadcast
+{
+
+/**
+ * A minimal streaming JSON writer, which appends compact JSON directly to
+ * an output string.  This is used instead of building a Json::Value tree
+ * for the hot responses of the RPC server (like receive), where most of
+ * the data are base64 strings that are encoded straight into the output.
+ *
+ * The writer does not validate the structure it produces; callers are
+ * responsible for balancing objects / arrays and for putting keys
+ * only inside objects.
+ */
+class JsonWriter
+{
+
+private:
+
+  /** The output string we append to.  */
+  std::string& out;
+
+  /** Whether the next value needs a separating comma before it.  */
+  bool needComma = false;
+
+  /**
+   * Writes a separating comma if needed, and marks that the value
+   * following it will need one.
+   */
+  void Separator ();
+
+public:
+
+  /**
+   * Constructs a writer that appends to the given string.  The string
+   * is not cleared, so that callers can reuse buffers or prepend data.
+   */
+  explicit JsonWriter (std::string& o)
+    : out(o)
+  {}
+
+  JsonWriter () = delete;
+  JsonWriter (const JsonWriter&) = delete;
+  void operator= (const JsonWriter&) = delete;
+
+  void BeginObject ();
+  void EndObject ();
+  void BeginArray ();
+  void EndArray ();
+
+  /**
+   * Writes an object key.  The key must be a plain string that
+   * does not need escaping.
+   */
+  void Key (const char* key);
+
+  void Int (int64_t val);
+  void UInt (uint64_t val);
+  void Bool (bool val);
+
+  /**
+   * Writes a string value, escaping it as needed.
+   */
+  void String (const std::string& val);
+
+  /**
+   * Writes a string value that is the base64 encoding of the given raw data.
+   * The encoding is done directly into the output buffer.
+   */
+  void Base64 (const std::string& data);
+
+  /**
+   * Writes an already serialised JSON value.
+   */
+  void Raw (const std::string& json);
+
+  /**
+   * Returns the number of bytes a base64 string for the given data
+   * takes up in the output (including the quotes).
+   */
+  static size_t
+  Base64Size (const size_t dataSize)
+  {
+    return 4 * ((dataSize + 2) / 3) + 2;
+  }
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_JSONWRITER_HPP
@@ -0,0 +1,221 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_LOOPBACKTRANSPORT_HPP
+#define XMPPBROADCAST_LOOPBACKTRANSPORT_HPP
+
+#include "muctransport.hpp"
+
+#include <gloox/jid.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+class LoopbackTransport;
+
+/**
+ * An in-process simulation of an XMPP server with MUC rooms, which
+ * LoopbackTransport instances can connect to.  Rooms are created
+ * implicitly when joined, and messages sent to a room are delivered to
+ * all its occupants (including the sender, as on a real MUC service).
+ *
+ * All events (join confirmations and message deliveries) are processed
+ * in order by a single delivery thread, optionally after a configurable
+ * latency.  This mirrors the receiving thread of a real XMPP connection.
+ */
+class LoopbackNetwork
+{
+
+private:
+
+  class LoopbackRoom;
+
+  /** An occupant of a room.  */
+  struct Occupant
+  {
+
+    /** The transport through which the occupant joined.  */
+    const LoopbackTransport* transport;
+
+    /** The occupant's full JID in the room (with nick).  */
+    gloox::JID nickJid;
+
+    /** The handler to notify about events.  */
+    MucTransport::RoomHandler* handler;
+
+  };
+
+  /** A scheduled event.  */
+  struct Event
+  {
+
+    /** When the event should be processed.  */
+    std::chrono::steady_clock::time_point due;
+
+    /** Counter to keep events with the same due time in order.  */
+    uint64_t order;
+
+    /** The function to run.  */
+    std::function<void ()> fn;
+
+    friend bool
+    operator< (const Event& a, const Event& b)
+    {
+      /* std::priority_queue returns the largest element first, so we
+         reverse the order to get the earliest one.  */
+      if (a.due != b.due)
+        return a.due > b.due;
+      return a.order > b.order;
+    }
+
+  };
+
+  /** Latency added to all events.  */
+  const std::chrono::microseconds latency;
+
+  /**
+   * Mutex for the room and event data.  It is not held while calling
+   * into room handlers.
+   */
+  std::mutex mut;
+
+  /** Occupants of all rooms by bare room JID and occupant ID.  */
+  std::map<gloox::JID, std::map<uint64_t, Occupant>> rooms;
+
+  /** Next ID to use for an occupant.  */
+  uint64_t nextOccupantId = 1;
+
+  /** The queue of scheduled events.  */
+  std::priority_queue<Event> events;
+
+  /** Counter for the order of scheduled events.  */
+  uint64_t nextEventOrder = 0;
+
+  /** Set when the delivery thread should stop.  */
+  bool stopping = false;
+
+  /** Signalled when new events are scheduled or we should stop.  */
+  std::condition_variable cv;
+
+  /**
+   * Mutex held while events are processed.  Removing an occupant locks it,
+   * so that its handler is guaranteed not to be in use afterwards.  It is
+   * recursive, so that handlers can leave rooms themselves.
+   */
+  std::recursive_mutex mutDelivery;
+
+  /** The delivery thread.  */
+  std::thread worker;
+
+  /**
+   * Runs the event loop of the delivery thread.
+   */
+  void Run ();
+
+  /**
+   * Schedules an event to be processed after the configured latency.
+   * Must be called with mut held.
+   */
+  void Schedule (std::function<void ()> fn);
+
+  /**
+   * Returns the handler of the given occupant if it is still in the room,
+   * and null otherwise.
+   */
+  MucTransport::RoomHandler* GetHandler (const gloox::JID& room, uint64_t id);
+
+  /**
+   * Removes an occupant from a room.
+   */
+  void RemoveOccupant (const gloox::JID& room, uint64_t id);
+
+  friend class LoopbackTransport;
+
+public:
+
+  /**
+   * Starts a network with the given latency for all events.
+   */
+  explicit LoopbackNetwork (
+      std::chrono::microseconds l = std::chrono::microseconds::zero ());
+
+  ~LoopbackNetwork ();
+
+  LoopbackNetwork (const LoopbackNetwork&) = delete;
+  void operator= (const LoopbackNetwork&) = delete;
+
+};
+
+/**
+ * MucTransport that connects to a LoopbackNetwork in the same process.
+ */
+class LoopbackTransport : public MucTransport
+{
+
+private:
+
+  /** The network we are connected to.  */
+  LoopbackNetwork& network;
+
+  /** Whether we are connected.  */
+  std::atomic<bool> connected;
+
+public:
+
+  explicit LoopbackTransport (LoopbackNetwork& n)
+    : network(n), connected(false)
+  {}
+
+  bool Connect () override;
+  void Disconnect () override;
+
+  bool
+  IsConnected () const override
+  {
+    return connected;
+  }
+
+  /**
+   * Simulates that the connection is lost (rather than being closed
+   * explicitly with Disconnect).
+   */
+  void SimulateConnectionLoss ();
+
+  std::unique_ptr<Room> JoinRoom (const gloox::JID& roomWithNick,
+                                  RoomHandler& handler) override;
+  void Send (const gloox::JID& room,
+             std::vector<std::unique_ptr<MessageStanza>> msgs) override;
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_LOOPBACKTRANSPORT_HPP
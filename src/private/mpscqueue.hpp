@@ -0,0 +1,204 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_MPSCQUEUE_HPP
+#define XMPPBROADCAST_MPSCQUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+/**
+ * A lock-free queue with many producers and a single consumer.  Producers
+ * push values onto an intrusive stack with a single compare-and-swap,
+ * and the consumer takes all of them at once (with an atomic exchange)
+ * and restores their order.  This means that producers never block each
+ * other or the consumer, and since values are only ever removed in bulk,
+ * there is no ABA problem.
+ *
+ * The queue itself does not support waiting; that can be done with an
+ * EventCount.  All operations are sequentially consistent, which is needed
+ * for the pattern described there.
+ */
+template <typename T>
+  class MpscQueue
+{
+
+private:
+
+  /** A node in the stack of pushed values.  */
+  struct Node
+  {
+
+    /** The value.  */
+    T value;
+
+    /** The next node, i.e. the value pushed before this one.  */
+    Node* next;
+
+  };
+
+  /** The most recently pushed node.  */
+  std::atomic<Node*> head;
+
+  /**
+   * Links a chain of new nodes (from first to last, i.e. newest to oldest)
+   * onto the stack.  Returns true if the queue was empty before.
+   */
+  bool Link (Node* first, Node* last);
+
+  /**
+   * Deletes a chain of nodes.
+   */
+  static void DeleteChain (Node* n);
+
+public:
+
+  MpscQueue ()
+    : head(nullptr)
+  {}
+
+  /**
+   * Destroys all values still in the queue.
+   */
+  ~MpscQueue ()
+  {
+    DeleteChain (head.load ());
+  }
+
+  MpscQueue (const MpscQueue&) = delete;
+  void operator= (const MpscQueue&) = delete;
+
+  /**
+   * Adds a value to the queue.  Returns true if the queue was empty before,
+   * in which case the consumer may need to be woken up.
+   */
+  bool Push (T value);
+
+  /**
+   * Adds multiple values to the queue at once (in order).  They are never
+   * interleaved with values pushed by other producers.  Returns true
+   * if the queue was empty before.
+   */
+  bool Push (std::vector<T> values);
+
+  /**
+   * Removes and returns all values in the queue, in the order
+   * they were pushed.  This must only be called by the consumer.
+   */
+  std::vector<T> PopAll ();
+
+  /**
+   * Returns true if the queue is empty at the moment.
+   */
+  bool
+  Empty () const
+  {
+    return head.load () == nullptr;
+  }
+
+};
+
+/**
+ * An "eventcount", which allows a consumer to wait for a condition (like
+ * a lock-free queue becoming non-empty) without producers having to take
+ * a lock unless someone is actually waiting.  The consumer does:
+ *
+ *   const auto key = ec.PrepareWait ();
+ *   if (condition)
+ *     ec.CancelWait ();
+ *   else
+ *     ec.Wait (key);
+ *
+ * and producers call Notify after making the condition true.  If the
+ * producer does not see the waiter, then the consumer's check is
+ * guaranteed to see the producer's change.
+ */
+class EventCount
+{
+
+public:
+
+  /** Key returned from PrepareWait.  */
+  using Key = uint64_t;
+
+private:
+
+  /** Incremented for each notification that has waiters.  */
+  std::atomic<uint64_t> epoch;
+
+  /** Number of threads between PrepareWait and Wait / CancelWait.  */
+  std::atomic<unsigned> waiters;
+
+  /** Lock for the condition variable.  */
+  std::mutex mut;
+
+  /** Condition variable that waiters block on.  */
+  std::condition_variable cv;
+
+public:
+
+  EventCount ()
+    : epoch(0), waiters(0)
+  {}
+
+  EventCount (const EventCount&) = delete;
+  void operator= (const EventCount&) = delete;
+
+  /**
+   * Announces that the calling thread is going to wait.  It must check
+   * the condition afterwards, and then call either Wait or CancelWait.
+   */
+  Key PrepareWait ();
+
+  /**
+   * Cancels a wait after PrepareWait, e.g. because the condition
+   * was already true.
+   */
+  void CancelWait ();
+
+  /**
+   * Blocks until Notify is called after the matching PrepareWait.
+   */
+  void Wait (Key key);
+
+  /**
+   * Blocks like Wait, but at most until the given time.  Returns false
+   * if the timeout was reached.
+   */
+  bool WaitUntil (Key key, std::chrono::steady_clock::time_point timeout);
+
+  /**
+   * Wakes up all threads currently waiting (or preparing to).  This is
+   * cheap if there are none.
+   */
+  void Notify ();
+
+};
+
+} // namespace xmppbroadcast
+
+#include "mpscqueue.tpp"
+
+#endif // XMPPBROADCAST_MPSCQUEUE_HPP
@@ -0,0 +1,94 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Template implementation for mpscqueue.hpp.  */
+
+#include <algorithm>
+#include <utility>
+
+namespace xmppbroadcast
+{
+
+template <typename T>
+  bool
+  MpscQueue<T>::Link (Node* first, Node* last)
+{
+  Node* old = head.load ();
+  do
+    last->next = old;
+  while (!head.compare_exchange_weak (old, first));
+
+  return old == nullptr;
+}
+
+template <typename T>
+  void
+  MpscQueue<T>::DeleteChain (Node* n)
+{
+  while (n != nullptr)
+    {
+      Node* next = n->next;
+      delete n;
+      n = next;
+    }
+}
+
+template <typename T>
+  bool
+  MpscQueue<T>::Push (T value)
+{
+  auto* n = new Node {std::move (value), nullptr};
+  return Link (n, n);
+}
+
+template <typename T>
+  bool
+  MpscQueue<T>::Push (std::vector<T> values)
+{
+  if (values.empty ())
+    return false;
+
+  /* Build the chain newest-first, as it will be on the stack.  */
+  Node* first = nullptr;
+  Node* last = nullptr;
+  for (auto& v : values)
+    {
+      first = new Node {std::move (v), first};
+      if (last == nullptr)
+        last = first;
+    }
+
+  return Link (first, last);
+}
+
+template <typename T>
+  std::vector<T>
+  MpscQueue<T>::PopAll ()
+{
+  Node* n = head.exchange (nullptr);
+
+  std::vector<T> res;
+  for (Node* cur = n; cur != nullptr; cur = cur->next)
+    res.push_back (std::move (cur->value));
+  DeleteChain (n);
+
+  std::reverse (res.begin (), res.end ());
+  return res;
+}
+
+} // namespace xmppbroadcast
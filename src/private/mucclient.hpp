@@ -19,22 +19,34 @@
 #ifndef XMPPBROADCAST_MUCCLIENT_HPP
 #define XMPPBROADCAST_MUCCLIENT_HPP
 
-#include <charon/xmppclient.hpp>
+#include "connectionwriter.hpp"
+#include "dedup.hpp"
+#include "dispatchpool.hpp"
+#include "flushwindow.hpp"
+#include "fragments.hpp"
+#include "metrics.hpp"
+#include "mpscqueue.hpp"
+#include "muctransport.hpp"
+#include "pacer.hpp"
+#include "reactor.hpp"
+
 #include <xayautil/uint256.hpp>
 
 #include <gloox/jid.h>
-#include <gloox/message.h>
-#include <gloox/mucroom.h>
-#include <gloox/mucroomhandler.h>
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
 #include <mutex>
-#include <queue>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace xmppbroadcast
 {
@@ -45,8 +57,11 @@ namespace xmppbroadcast
  * The XMPP MUC client that we use for sending and receiving messages for
  * one or more channels.  This class is the underlying implementation for
  * both the XmppBroadcast class and our broadcast RPC server.
+ *
+ * The actual connection is done through a MucTransport, which is normally
+ * an XmppTransport to a real server.
  */
-class MucClient : private charon::XmppClient
+class MucClient
 {
 
 public:
@@ -62,24 +77,117 @@ private:
   /** The XMPP server on which rooms will be.  */
   const std::string server;
 
+  /**
+   * Deleter for channels, which makes sure that no more received messages
+   * are dispatched to them before destructing (while the subclass is still
+   * intact).  Channels must not be destroyed while holding mut, as this
+   * may wait for a dispatched message being processed.
+   */
+  struct ChannelDeleter
+  {
+
+    ChannelDeleter () = default;
+
+    ChannelDeleter (const std::default_delete<Channel>&)
+    {}
+
+    void operator() (Channel* c) const;
+
+  };
+
+  using ChannelPtr = std::unique_ptr<Channel, ChannelDeleter>;
+
+  /**
+   * The transport we use.  It is declared before the channels, so that
+   * it outlives them.
+   */
+  std::unique_ptr<MucTransport> transport;
+
+  /**
+   * If enabled, the pool of threads processing received messages.  Otherwise
+   * they are processed directly on the transport's receiving thread.
+   */
+  std::unique_ptr<DispatchPool> dispatch;
+
+  /**
+   * If enabled, the event loop on which channels send their messages and
+   * refreshers run, instead of using dedicated threads.  It is declared
+   * before the channels, so that it outlives them.
+   */
+  std::unique_ptr<Reactor> reactor;
+
+  /**
+   * If rate limits are configured, the pacer for sent messages.  It is
+   * declared before the writer, which uses it.
+   */
+  std::unique_ptr<SendPacer> pacer;
+
+  /**
+   * If enabled, the writer stage through which channels send their
+   * messages.  Otherwise they send directly through the transport.
+   */
+  std::unique_ptr<ConnectionWriter> writer;
+
   /** Mutex for the channels map (but not the channels themselves).  */
   std::mutex mut;
 
-  /** All channels that we have subscribed to or are currently joining.  */
-  std::map<gloox::JID, std::unique_ptr<Channel>> channels;
-
   /**
-   * Returns the JID of a room corresponding to the given channel ID.
+   * All channels that we have subscribed to or are currently joining,
+   * by their channel ID.  Keying them by ID rather than room JID means
+   * that lookups do not need to construct the JID.
    */
-  gloox::JID GetRoomJid (const xaya::uint256& channelId) const;
+  std::map<xaya::uint256, ChannelPtr> channels;
 
   /**
    * When we get disconnected by the server, clean up the channels.
    */
-  void HandleDisconnect () override;
+  void HandleDisconnect ();
+
+  /** A chunk of messages that is paced as a whole.  */
+  struct PacedChunk
+  {
+
+    /** The messages by room.  */
+    std::vector<MucTransport::Outgoing> out;
+
+    /** The number of stanzas in the chunk.  */
+    size_t numStanzas = 0;
+
+    /** The total payload bytes of the chunk.  */
+    size_t numBytes = 0;
+
+  };
+
+  /**
+   * Splits the given messages into chunks that each fit into a burst
+   * of the pacer (but with at least one message each).  This way, a large
+   * batch is spread out instead of being delayed as a whole and then
+   * sent all at once.
+   */
+  std::vector<PacedChunk> SplitForPacer (
+      std::vector<MucTransport::Outgoing> out) const;
+
+  /**
+   * Sends the given messages through the transport.  If rate limits
+   * are configured, they are split with SplitForPacer, and every chunk
+   * is paced (blocking the calling thread) before it is sent.
+   */
+  void SendPaced (std::vector<MucTransport::Outgoing> out);
 
 protected:
 
+  /**
+   * Returns the JID of a room corresponding to the given channel ID.
+   */
+  gloox::JID GetRoomJid (const xaya::uint256& channelId) const;
+
+  /**
+   * Returns the channel for the given ID, creating it if it doesn't exist.
+   * Returns null if we are not connected or the channel is inactive.
+   * This is the untyped implementation of GetChannel.
+   */
+  Channel* LookupChannel (const xaya::uint256& id);
+
   /**
    * Subclasses can implement this method to instantiate a new Channel
    * for this client and with the given JID.  They can use this to return
@@ -87,6 +195,15 @@ protected:
    */
   virtual std::unique_ptr<Channel> CreateChannel (const gloox::JID& j);
 
+  /**
+   * Removes the channel with the given ID like RemoveChannel, but only
+   * if the predicate returns true.  It is evaluated while holding the lock
+   * for the channels map, so that subclasses can atomically check their
+   * own state against channels being created concurrently.
+   */
+  void RemoveChannelIf (const xaya::uint256& id,
+                        const std::function<bool ()>& pred);
+
 public:
 
   /**
@@ -97,6 +214,13 @@ public:
                       const gloox::JID& j, const std::string& password,
                       const std::string& s);
 
+  /**
+   * Sets up the client to use the given transport instead of connecting
+   * to a real XMPP server.
+   */
+  explicit MucClient (const std::string& g, std::unique_ptr<MucTransport> t,
+                      const std::string& s);
+
   virtual ~MucClient ();
 
   /**
@@ -111,6 +235,21 @@ public:
   template <typename C>
     C* GetChannel (const xaya::uint256& id);
 
+  /**
+   * Leaves the room of the channel with the given ID and removes the
+   * channel, if it exists.  Unlike GetChannel, this never creates it.
+   */
+  void RemoveChannel (const xaya::uint256& id);
+
+  /**
+   * Sets the weight of the channel with the given ID for scheduling
+   * sent messages, i.e. its share of the connection's bandwidth relative
+   * to other channels (with the default weight of one).  The weight must
+   * be positive.  It only has an effect with -xmppbroadcast_shared_writer,
+   * and this returns false if that is not enabled.
+   */
+  bool SetChannelWeight (const xaya::uint256& id, unsigned weight);
+
   /**
    * Tries to connect to the XMPP server.  Returns true on success
    * and false on failure.
@@ -133,8 +272,63 @@ public:
    */
   virtual void Refresh ();
 
-  using XmppClient::IsConnected;
-  using XmppClient::SetRootCA;
+  bool
+  IsConnected () const
+  {
+    return transport->IsConnected ();
+  }
+
+  /**
+   * Returns true if this client runs its background work on a reactor
+   * (with -xmppbroadcast_reactor_threads) rather than dedicated threads.
+   */
+  bool
+  UsesReactor () const
+  {
+    return reactor != nullptr;
+  }
+
+  /**
+   * Sets the trusted root CA for the TLS connection to the server.
+   */
+  void
+  SetRootCA (const std::string& path)
+  {
+    transport->SetRootCA (path);
+  }
+
+};
+
+/* ************************************************************************** */
+
+/**
+ * A MucClient whose channels are all of type C (which must be a subclass
+ * of MucClient::Channel).  Subclasses construct them in CreateTypedChannel,
+ * and GetChannel returns them statically typed, without the dynamic_cast
+ * and check done by MucClient::GetChannel.
+ */
+template <typename C>
+  class TypedMucClient : public MucClient
+{
+
+protected:
+
+  /**
+   * Subclasses must implement this to construct their channels.
+   */
+  virtual std::unique_ptr<C> CreateTypedChannel (const gloox::JID& j) = 0;
+
+  std::unique_ptr<Channel> CreateChannel (const gloox::JID& j) final;
+
+public:
+
+  using MucClient::MucClient;
+
+  /**
+   * Retrieves the channel for the given ID like MucClient::GetChannel,
+   * but without the runtime type check.
+   */
+  C* GetChannel (const xaya::uint256& id);
 
 };
 
@@ -164,14 +358,34 @@ private:
   /** Condition variable that gets notified when we should stop.  */
   std::condition_variable cv;
 
-  /** The thread running the refresh calls.  */
-  std::thread runner;
+  /**
+   * The thread running the refresh calls.  If the client uses a reactor,
+   * they are scheduled as timers on it instead.
+   */
+  std::unique_ptr<std::thread> runner;
+
+  /**
+   * With a reactor, the refresh call in progress.  Refreshing may block
+   * while reconnecting, so it is not run on the reactor itself.
+   */
+  std::future<void> refreshing;
+
+  /**
+   * Starts the refresh cycle, either on a thread or the reactor.
+   */
+  void Start ();
 
   /**
    * Runs the refresh cycle, i.e. what the thread executes.
    */
   void Run ();
 
+  /**
+   * Starts a refresh off the reactor (unless the previous one is still
+   * in progress) and schedules the next one on the reactor.
+   */
+  void RunOnReactor ();
+
 public:
 
   /**
@@ -186,7 +400,7 @@ public:
     explicit Refresher (MucClient& c, std::chrono::duration<Rep, Period> i);
 
   /**
-   * The destructor stops the refresher thread.
+   * The destructor stops the refresher thread (or cancels the timer).
    */
   ~Refresher ();
 
@@ -197,7 +411,7 @@ public:
 /**
  * A channel that we are subscribed to in the XMPP client.
  */
-class MucClient::Channel : private gloox::MUCRoomHandler
+class MucClient::Channel : private MucTransport::RoomHandler
 {
 
 private:
@@ -208,8 +422,15 @@ private:
   /** The associated room's full JID.  */
   const gloox::JID roomJid;
 
-  /** The gloox room handle.  */
-  std::unique_ptr<gloox::MUCRoom> room;
+  /** The room's JID with our own nick as resource.  */
+  const gloox::JID ownJid;
+
+  /**
+   * The handle of the joined room in the transport.  It is reset early in
+   * the destructor, so that no callbacks arrive while members are being
+   * destroyed.
+   */
+  std::unique_ptr<MucTransport::Room> room;
 
   /**
    * Set to false when we received some error on the room or got disconnected
@@ -218,27 +439,52 @@ private:
   std::atomic<bool> left;
 
   /**
-   * Mutex for the local state.  This is used e.g. for the send queue
-   * and condition variable, or the sender thread itself.
+   * Mutex for the local state.  This is used e.g. for starting and
+   * stopping the sender thread (but not the send queue itself).
    */
   std::mutex mut;
 
+  /** A message in the send queue.  */
+  struct QueuedMessage
+  {
+
+    /** The payload to send.  */
+    std::string data;
+
+    /**
+     * Time when the message was queued (in microseconds since the epoch)
+     * if messages are timestamped, and zero otherwise.
+     */
+    uint64_t queued;
+
+    /** If the message was sent with acknowledgement, the promise for it.  */
+    std::unique_ptr<std::promise<bool>> ack;
+
+  };
+
   /**
    * Queue of messages to be sent.  When a message is sent throught the
    * public interface, it will just be added here.  We have a separate thread
    * that processes the queue and sends the messages, once we have gotten
-   * a confirmation that the channel join succeeded.
+   * a confirmation that the channel join succeeded.  The queue is lock-free,
+   * so that senders do not contend with each other or the sender thread.
    */
-  std::queue<std::string> sendQueue;
+  MpscQueue<QueuedMessage> sendQueue;
 
   /**
    * Flag to indicate that the sender thread should stop, when the channel
    * instance is being destroyed.
    */
-  bool stopSender;
+  std::atomic<bool> stopSender;
+
+  /** Notified when the send queue becomes non-empty or we should stop.  */
+  EventCount sendEvents;
 
-  /** Condition variable signalled when we have a new message to send.  */
-  std::condition_variable cvSendQueue;
+  /**
+   * Policy for holding back queued messages to form larger batches.
+   * This is only accessed by the sender thread.
+   */
+  FlushWindow flushWindow;
 
   /**
    * The thread that processes the send queue.  It is created when
@@ -246,40 +492,203 @@ private:
    */
   std::unique_ptr<std::thread> sender;
 
+  /** Set once we have joined the room and can send messages.  */
+  std::atomic<bool> joined;
+
+  /**
+   * With a reactor, whether the send task is holding back queued messages
+   * for the flush window.  This is only accessed on the reactor.
+   */
+  bool holding = false;
+
+  /**
+   * With a reactor and rate limits, chunks of messages that are waiting
+   * for the pacer.  Instead of blocking the reactor, a timer sends them
+   * when it is their turn.  No newer messages are sent in the mean time.
+   * This is only accessed on the reactor.
+   */
+  std::deque<PacedChunk> pacedChunks;
+
+  /**
+   * Whether tokens of the pacer have already been reserved for the first
+   * of the paced chunks.  This is only accessed on the reactor.
+   */
+  bool pacedReserved = false;
+
+  /**
+   * With a reactor, the time of the pending timer for expiring
+   * acknowledgements (or the epoch if none).  This is only accessed
+   * on the reactor.
+   */
+  std::chrono::steady_clock::time_point ackTimer;
+
+  /**
+   * Next sequence number for timestamped messages we send.  This is only
+   * accessed by the sender thread.
+   */
+  uint64_t nextSenderSeq = 0;
+
+  /**
+   * ID for the next message we send split into fragments.  This is only
+   * accessed by the sender thread.
+   */
+  uint64_t nextFragmentId = 0;
+
+  /**
+   * For timestamped messages received, the last sequence number seen
+   * for each sender (by their full JID in the room).  This is used to
+   * detect gaps, and only accessed from the gloox receiving thread.
+   */
+  std::map<std::string, uint64_t> lastSenderSeq;
+
+  /**
+   * Buffer for reassembling fragmented messages received.  This is only
+   * accessed from the gloox receiving thread.
+   */
+  FragmentBuffer fragments;
+
+  /**
+   * Filter for duplicate payloads received, if enabled.  This is only
+   * accessed from the thread processing received messages.
+   */
+  std::unique_ptr<DuplicateFilter> dedup;
+
+  /** Key of this channel for the client's dispatch pool.  */
+  const size_t dispatchKey;
+
+  /**
+   * Set when no more messages should be dispatched to us.  It is checked
+   * by the dispatch pool when posting, so that we need not hold a lock
+   * while a post may block.
+   */
+  std::atomic<bool> dispatchStopped;
+
+  /** A sent message waiting to be reflected back by the room.  */
+  struct PendingAck
+  {
+
+    /** The promise to fulfil.  */
+    std::promise<bool> promise;
+
+    /** Time when the message was sent.  */
+    std::chrono::steady_clock::time_point sent;
+
+    /** Time after which we give up waiting.  */
+    std::chrono::steady_clock::time_point deadline;
+
+  };
+
+  /**
+   * Messages sent with acknowledgement that have not been reflected yet,
+   * by their sender sequence number.  Since sequence numbers are assigned
+   * in order, this is also (roughly) ordered by deadline.
+   */
+  std::map<uint64_t, PendingAck> pendingAcks;
+
+  /**
+   * Mutex for pendingAcks.  If both this and mut are locked, mut must
+   * be locked first.
+   */
+  std::mutex mutAcks;
+
+  /** Time when we started to join the room.  */
+  const std::chrono::steady_clock::time_point joinStart;
+
+  /**
+   * Handle for the room's label in the metrics registry, which keeps the
+   * metrics below alive while we exist and removes them afterwards.
+   */
+  MetricsRegistry::LabelHandle roomMetrics;
+
+  /* Metrics for this room.  They are looked up once when the channel is
+     created, so that updating them on each message is cheap.  */
+  Counter& messagesSent;
+  Counter& bytesSent;
+  Counter& messagesReceived;
+  Counter& bytesReceived;
+  Gauge& sendQueueDepth;
+  Counter& messageGaps;
+  Counter& duplicates;
+  Counter& flushesHeld;
+  Counter& fragmentsDropped;
+
   /**
    * Runs a loop trying to send any messages queued up.  This is what the
    * sender thread executes.
    */
   void RunSendLoop ();
 
-  void handleMUCError (gloox::MUCRoom* r, gloox::StanzaError) override;
-  bool handleMUCRoomCreation (gloox::MUCRoom* r) override;
-  void handleMUCMessage (gloox::MUCRoom* r, const gloox::Message& msg,
-                         bool priv) override;
-  void handleMUCParticipantPresence (
-      gloox::MUCRoom* r, gloox::MUCRoomParticipant participant,
-      const gloox::Presence& presence) override;
+  /**
+   * Sends one batch with all messages queued at the moment.
+   */
+  void SendQueued ();
 
-  void
-  handleMUCSubject (gloox::MUCRoom* r, const std::string& nick,
-                    const std::string& subject) override
-  {}
+  /**
+   * Wakes up the sender thread or posts a send task on the reactor,
+   * after messages have been queued.
+   */
+  void NotifySender ();
 
-  void
-  handleMUCInviteDecline (gloox::MUCRoom* r, const gloox::JID& invitee,
-                          const std::string& reason) override
-  {}
+  /**
+   * Sends queued messages (if any) as a task on the reactor.
+   */
+  void RunSendTask ();
 
-  void
-  handleMUCInfo (gloox::MUCRoom* r, const int features,
-                 const std::string& name,
-                 const gloox::DataForm* infoForm) override
-  {}
+  /**
+   * Sends the paced chunks that are due on the reactor, and schedules
+   * a timer for the rest.  When the timer has sent all of them, it goes
+   * on with messages queued in the mean time.
+   */
+  void SendPacedChunks ();
 
-  void
-  handleMUCItems (gloox::MUCRoom* r,
-                  const gloox::Disco::ItemList& items) override
-  {}
+  /**
+   * Expires acknowledgements that timed out, and makes sure that a reactor
+   * timer is pending for the next deadline.
+   */
+  void ScheduleAckExpiry ();
+
+  /**
+   * Records latency metrics and checks for gaps when a timestamped
+   * message is received.
+   */
+  void RecordTiming (const gloox::JID& from, const MessageStanza& msg);
+
+  /**
+   * Fails all pending acknowledgements whose deadline has passed.
+   * Returns true and sets the next deadline if there are still pending
+   * ones left.
+   */
+  bool ExpireAcks (std::chrono::steady_clock::time_point& next);
+
+  /**
+   * Fails all pending acknowledgements, e.g. when we leave the room.
+   */
+  void FailAcks ();
+
+  /**
+   * Resolves the pending acknowledgement (if any) for a message of ours
+   * that has been reflected back by the room.
+   */
+  void ResolveAck (const MessageStanza& msg);
+
+  /**
+   * Processes the payload of a received message, i.e. filters duplicates
+   * and passes it on to MessageReceived.  This is done either directly
+   * or on the dispatch pool.
+   */
+  void Deliver (const std::string& data);
+
+  /**
+   * Stops dispatching of received messages to this channel, waiting
+   * for a message being processed at the moment.
+   */
+  void StopDispatch ();
+
+  friend struct MucClient::ChannelDeleter;
+
+  void RoomJoined () override;
+  void RoomLeft (const std::string& reason) override;
+  void RoomMessage (const gloox::JID& from, const MessageStanza& msg) override;
 
 protected:
 
@@ -291,6 +700,20 @@ protected:
   MessageReceived (const std::string& msg)
   {}
 
+  /**
+   * Called instead of MessageReceived for messages sent by ourselves
+   * and reflected back by the room, if echo suppression is enabled
+   * (with -xmppbroadcast_suppress_echo).  This signals that the message
+   * has been delivered to the room, and can be used as acknowledgement.
+   * The payload is decoded lazily, so this is cheap if it is not accessed.
+   * For messages sent in fragments, this is called only once, with the
+   * last fragment (which completes the message).  Its payload is just
+   * that fragment's part, as own messages are not reassembled.
+   */
+  virtual void
+  EchoReceived (const MessageStanza& msg)
+  {}
+
 public:
 
   explicit Channel (MucClient& c, const gloox::JID& j);
@@ -305,6 +728,24 @@ public:
    */
   void Send (const std::string& msg);
 
+  /**
+   * Queues a batch of messages to be sent, in order.  This is equivalent
+   * to calling Send for each of them, but the batch is pushed onto the
+   * send queue as a single chain, and the sender is notified at most once
+   * for the whole batch.
+   */
+  void Send (std::vector<std::string> msgs);
+
+  /**
+   * Queues a message to be sent, and returns a future that is set to true
+   * once the room has reflected the message back to us (i.e. it has
+   * been delivered to the room).  It is set to false if that does not
+   * happen within -xmppbroadcast_ack_timeout_ms after sending, or we
+   * leave the room before.  Such messages always carry a sender
+   * sequence number, which is used to match the reflected copy.
+   */
+  std::future<bool> SendWithAck (const std::string& msg);
+
   /**
    * Requests to leave the room.
    */
@@ -20,6 +20,7 @@
 
 #include <glog/logging.h>
 
+#include <type_traits>
 #include <typeinfo>
 
 namespace xmppbroadcast
@@ -29,40 +30,42 @@ template <typename C>
   C*
   MucClient::GetChannel (const xaya::uint256& id)
 {
-  if (!IsConnected ())
+  auto* channel = LookupChannel (id);
+  if (channel == nullptr)
     return nullptr;
 
-  const auto jid = GetRoomJid (id);
-  std::lock_guard<std::mutex> lock(mut);
-
-  const auto mit = channels.find (jid);
-  if (mit != channels.end ())
-    {
-      if (mit->second->IsActive ())
-        {
-          auto* res = dynamic_cast<C*> (mit->second.get ());
-          CHECK (res != nullptr);
-          return res;
-        }
-
-      channels.erase (mit);
-      return nullptr;
-    }
-
-  auto newChannel = CreateChannel (jid);
-  auto* res = dynamic_cast<C*> (newChannel.get ());
+  auto* res = dynamic_cast<C*> (channel);
   CHECK (res != nullptr)
       << "Not of type " << typeid (C).name ()
-      << ": " << typeid (newChannel.get ()).name ();
-  channels.emplace (jid, std::move (newChannel));
+      << ": " << typeid (*channel).name ();
   return res;
 }
 
+template <typename C>
+  C*
+  TypedMucClient<C>::GetChannel (const xaya::uint256& id)
+{
+  static_assert (std::is_base_of<Channel, C>::value,
+                 "TypedMucClient must be used with a subclass of Channel");
+
+  /* All channels are created through CreateTypedChannel, so they are
+     guaranteed to be of the right type.  */
+  return static_cast<C*> (LookupChannel (id));
+}
+
+template <typename C>
+  std::unique_ptr<MucClient::Channel>
+  TypedMucClient<C>::CreateChannel (const gloox::JID& j)
+{
+  return CreateTypedChannel (j);
+}
+
 template <typename Rep, typename Period>
   MucClient::Refresher::Refresher (MucClient& c,
                                    const std::chrono::duration<Rep, Period> i)
-  : client(c), intv(i),
-    runner([this] () { Run (); })
-{}
+  : client(c), intv(i)
+{
+  Start ();
+}
 
 } // namespace xmppbroadcast
@@ -0,0 +1,196 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_MUCTRANSPORT_HPP
+#define XMPPBROADCAST_MUCTRANSPORT_HPP
+
+#include "stanzas.hpp"
+
+#include <gloox/jid.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+/**
+ * The transport used by a MucClient, i.e. a connection to some server
+ * that allows joining MUC rooms and exchanging messages in them.
+ * The standard implementation (XmppTransport) uses a real XMPP server,
+ * but this can also be simulated in-process (LoopbackTransport) for
+ * testing and benchmarking without the overhead of a real server.
+ */
+class MucTransport
+{
+
+public:
+
+  class Room;
+  class RoomHandler;
+
+  /** Messages to be sent to one room.  */
+  struct Outgoing
+  {
+
+    /** The room's bare JID.  */
+    gloox::JID room;
+
+    /** The messages, in order.  */
+    std::vector<std::unique_ptr<MessageStanza>> msgs;
+
+  };
+
+private:
+
+  /** Closure called when the connection is closed or lost.  */
+  std::function<void ()> disconnectHandler;
+
+  /** Lock for the disconnect handler.  */
+  std::mutex mutHandler;
+
+protected:
+
+  /**
+   * Invokes the disconnect handler (if any).  Implementations must call
+   * this when the connection is closed.  If this is due to an explicit
+   * Disconnect call, IsConnected should still return true at this point,
+   * so that the handler can distinguish the two cases.
+   */
+  void NotifyDisconnect ();
+
+public:
+
+  MucTransport () = default;
+  virtual ~MucTransport () = default;
+
+  MucTransport (const MucTransport&) = delete;
+  void operator= (const MucTransport&) = delete;
+
+  /**
+   * Sets the closure to be called when the connection is closed.
+   */
+  void SetDisconnectHandler (const std::function<void ()>& h);
+
+  /**
+   * Sets the trusted root CA for connections that use TLS.  By default
+   * this does nothing.
+   */
+  virtual void
+  SetRootCA (const std::string& path)
+  {}
+
+  /**
+   * Tries to connect.  Returns true on success.
+   */
+  virtual bool Connect () = 0;
+
+  /**
+   * Closes the connection.
+   */
+  virtual void Disconnect () = 0;
+
+  virtual bool IsConnected () const = 0;
+
+  /**
+   * Starts to join the room with the given JID (including our nick as
+   * resource).  The handler is notified about the result and further
+   * events in the room, until the returned Room instance is destroyed.
+   */
+  virtual std::unique_ptr<Room> JoinRoom (const gloox::JID& roomWithNick,
+                                          RoomHandler& handler) = 0;
+
+  /**
+   * Sends the given messages (in order) to the room with the given
+   * bare JID, which should be joined.
+   */
+  virtual void Send (const gloox::JID& room,
+                     std::vector<std::unique_ptr<MessageStanza>> msgs) = 0;
+
+  /**
+   * Sends messages to multiple rooms at once.  The default implementation
+   * just calls Send for each entry, but implementations can do it
+   * more efficiently, e.g. with a single access to the connection.
+   */
+  virtual void SendAll (std::vector<Outgoing> out);
+
+};
+
+/**
+ * Handle for a room joined through a transport.  Destructing it
+ * leaves the room (if not done yet), and ensures that the room's handler
+ * will not be called anymore.
+ */
+class MucTransport::Room
+{
+
+public:
+
+  Room () = default;
+  virtual ~Room () = default;
+
+  Room (const Room&) = delete;
+  void operator= (const Room&) = delete;
+
+  /**
+   * Requests to leave the room.
+   */
+  virtual void Leave () = 0;
+
+};
+
+/**
+ * Interface for receiving events about a room from a transport.
+ */
+class MucTransport::RoomHandler
+{
+
+public:
+
+  RoomHandler () = default;
+  virtual ~RoomHandler () = default;
+
+  /**
+   * Called when we have joined the room successfully.
+   */
+  virtual void RoomJoined () = 0;
+
+  /**
+   * Called when we are no longer in the room, e.g. due to an error or
+   * because the server removed us.  The reason is a short identifier
+   * like "room_error" (used e.g. for metrics).
+   */
+  virtual void RoomLeft (const std::string& reason) = 0;
+
+  /**
+   * Called for a message received in the room from the given sender
+   * (the room JID with the sender's nick as resource).  The message may
+   * be decoded lazily and be invalid, which handlers must check.  It is
+   * only valid during the call.
+   */
+  virtual void RoomMessage (const gloox::JID& from,
+                            const MessageStanza& msg) = 0;
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_MUCTRANSPORT_HPP
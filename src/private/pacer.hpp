@@ -0,0 +1,180 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_PACER_HPP
+#define XMPPBROADCAST_PACER_HPP
+
+#include "metrics.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace xmppbroadcast
+{
+
+/**
+ * A token bucket, which refills at a constant rate up to a maximum
+ * (the burst size).  Taking tokens is always possible, but may put the
+ * bucket into debt; the caller is then told how long it has to wait
+ * until the tokens would have been available.  This way, also requests
+ * larger than the burst size make progress.  This is not thread-safe.
+ */
+class TokenBucket
+{
+
+public:
+
+  using Clock = std::chrono::steady_clock;
+
+private:
+
+  /** Tokens added per second.  */
+  const double rate;
+
+  /** Maximum number of tokens.  */
+  const double burst;
+
+  /** Tokens at the last update (negative if in debt).  */
+  double tokens;
+
+  /** Time of the last update.  */
+  Clock::time_point last;
+
+  /**
+   * Refills the bucket up to the given time.
+   */
+  void Refill (Clock::time_point now);
+
+public:
+
+  /**
+   * Constructs a full bucket with the given rate (tokens per second)
+   * and burst size.
+   */
+  explicit TokenBucket (double r, double b, Clock::time_point now);
+
+  TokenBucket () = delete;
+  TokenBucket (const TokenBucket&) = delete;
+  void operator= (const TokenBucket&) = delete;
+
+  /**
+   * Takes the given number of tokens at the given time, and returns how
+   * long the caller has to wait before using them (zero if they were
+   * available right away).
+   */
+  Clock::duration Take (double n, Clock::time_point now);
+
+  /**
+   * Returns the number of tokens available at the given time (negative
+   * if the bucket is in debt).
+   */
+  double GetTokens (Clock::time_point now);
+
+  /**
+   * Returns the burst size, i.e. the maximum number of tokens.
+   */
+  double GetBurst () const;
+
+};
+
+/**
+ * Paces messages sent on a connection, so that they stay within
+ * configured limits of payload bytes and stanzas per second (e.g. to
+ * avoid traffic shaping by the XMPP server).  Bursts are smoothed by
+ * blocking the sending thread as needed.  This is thread-safe.
+ */
+class SendPacer
+{
+
+public:
+
+  using Clock = TokenBucket::Clock;
+
+  /** Function returning the current time.  */
+  using NowFcn = std::function<Clock::time_point ()>;
+
+  /** Function that blocks the calling thread for some time.  */
+  using SleepFcn = std::function<void (Clock::duration)>;
+
+private:
+
+  /** The clock used.  */
+  const NowFcn now;
+
+  /** The function used for waiting.  */
+  const SleepFcn sleep;
+
+  /** Bucket for payload bytes, if limited.  */
+  std::unique_ptr<TokenBucket> bytes;
+
+  /** Bucket for stanzas, if limited.  */
+  std::unique_ptr<TokenBucket> stanzas;
+
+  /** Lock for the buckets.  */
+  std::mutex mut;
+
+  /* Metrics for the pacer state.  */
+  Gauge& bytesAvailable;
+  Gauge& stanzasAvailable;
+  Counter& throttled;
+  Histogram& delay;
+
+public:
+
+  /**
+   * Constructs a pacer with the given limits per second (zero for
+   * no limit), allowing bursts of the given duration at full rate.
+   */
+  explicit SendPacer (double bytesPerSecond, double stanzasPerSecond,
+                      Clock::duration burst,
+                      const NowFcn& n = &Clock::now,
+                      const SleepFcn& s = nullptr);
+
+  SendPacer () = delete;
+  SendPacer (const SendPacer&) = delete;
+  void operator= (const SendPacer&) = delete;
+
+  /**
+   * Accounts for sending the given number of stanzas with the given
+   * total payload size, and blocks if that exceeds the limits.
+   */
+  void Pace (size_t numStanzas, size_t numBytes);
+
+  /**
+   * Accounts for sending like Pace, but returns how long the caller has
+   * to wait before sending (zero if it can send right away) instead of
+   * blocking.  This is for callers that must not block, e.g. reactor tasks.
+   */
+  Clock::duration Reserve (size_t numStanzas, size_t numBytes);
+
+  /**
+   * Returns true if sending the given number of stanzas and payload bytes
+   * fits into a single burst of the limits.  Callers can use this to split
+   * large batches into chunks that are paced individually, rather than
+   * delaying the whole batch and then sending it at once.
+   */
+  bool FitsBurst (size_t numStanzas, size_t numBytes) const;
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_PACER_HPP
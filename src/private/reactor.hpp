@@ -0,0 +1,65 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_REACTOR_HPP
+#define XMPPBROADCAST_REACTOR_HPP
+
+#include "shardedexecutor.hpp"
+
+#include <cstddef>
+
+namespace xmppbroadcast
+{
+
+/**
+ * An event loop running tasks and timers on a small, fixed set of threads.
+ * This is used instead of dedicated threads per room and for refreshing,
+ * to reduce context switches on machines with few cores.
+ *
+ * Like in DispatchPool, tasks are sharded by a key with one thread per
+ * shard, so that tasks with the same key are run in order and never
+ * concurrently.  The queues are not bounded.  Tasks should not block
+ * for long, as that delays all other tasks on the same shard.
+ *
+ * See ShardedExecutor for the details of the methods.
+ */
+class Reactor : private ShardedExecutor
+{
+
+public:
+
+  using ShardedExecutor::Task;
+  using ShardedExecutor::Clock;
+
+  /**
+   * Starts a reactor with the given number of shards (threads).
+   */
+  explicit Reactor (const size_t numShards)
+    : ShardedExecutor("reactor", numShards, 0)
+  {}
+
+  using ShardedExecutor::Post;
+  using ShardedExecutor::PostAt;
+  using ShardedExecutor::Cancel;
+  using ShardedExecutor::Flush;
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_REACTOR_HPP
@@ -0,0 +1,133 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_SHARDEDEXECUTOR_HPP
+#define XMPPBROADCAST_SHARDEDEXECUTOR_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+/**
+ * Runs tasks and timers on a fixed set of threads.  Tasks are sharded by
+ * a key, with one thread and queue per shard, so that tasks with the same
+ * key are run in order and never concurrently.  Each task has an owner
+ * (the object it refers to), so that all tasks of an object can be
+ * cancelled before it is destroyed.
+ *
+ * Optionally, the queue of tasks ready to run on each shard is bounded.
+ * When it is full, posting a task blocks until there is space again.
+ *
+ * This is the implementation shared by DispatchPool and Reactor.
+ */
+class ShardedExecutor
+{
+
+public:
+
+  using Task = std::function<void ()>;
+  using Clock = std::chrono::steady_clock;
+
+private:
+
+  class Shard;
+
+  /** The shards of the executor.  */
+  std::vector<std::unique_ptr<Shard>> shards;
+
+  /**
+   * Returns the shard for a given key.
+   */
+  Shard& GetShard (size_t key);
+
+public:
+
+  /**
+   * Starts an executor with the given number of shards (threads).
+   * If capacity is non-zero, each shard's queue of tasks ready to run
+   * holds at most that many (timers that are not yet due do not count).
+   * The name is used for the metrics, e.g. as in
+   * xmppbroadcast_<name>_queue_depth.
+   */
+  explicit ShardedExecutor (const std::string& name, size_t numShards,
+                            size_t capacity);
+
+  /**
+   * Stops all threads.  Tasks and timers that are still pending
+   * are not run.
+   */
+  ~ShardedExecutor ();
+
+  ShardedExecutor () = delete;
+  ShardedExecutor (const ShardedExecutor&) = delete;
+  void operator= (const ShardedExecutor&) = delete;
+
+  /**
+   * Queues a task to be run as soon as possible on the shard for the
+   * given key.  The owner identifies the object the task refers to,
+   * for use with Cancel.
+   *
+   * If the queue is bounded and full, this blocks until there is space
+   * (unless called from a task on the same shard, which would never
+   * make progress).  If cancelled is given, it is checked with the shard
+   * locked before queueing the task and while waiting for space.  When it
+   * returns true, the task is dropped instead.  This allows an owner
+   * to stop posting without holding a lock of its own across Post:
+   * it sets a flag checked by cancelled and then calls Cancel, which wakes
+   * up blocked posts.
+   */
+  void Post (size_t key, const void* owner, Task task,
+             const std::function<bool ()>& cancelled = nullptr);
+
+  /**
+   * Schedules a task to be run at the given time (or as soon as possible
+   * afterwards) on the shard for the given key.
+   */
+  void PostAt (size_t key, const void* owner, Clock::time_point time,
+               Task task);
+
+  /**
+   * Removes all pending tasks and timers of the given owner (posted with
+   * the given key), and waits for a task of it that is currently running
+   * to finish.  Tasks posted for the owner in the mean time (e.g. by the
+   * running task rescheduling itself) are dropped.  Afterwards, no task
+   * of the owner will be run anymore (if none are posted concurrently
+   * from other threads, or their cancelled check returns true by now).
+   * When called from a task on the same shard, this does not wait for
+   * the running task.
+   */
+  void Cancel (size_t key, const void* owner);
+
+  /**
+   * Waits until all tasks queued at the moment for the given key (but not
+   * timers that are not yet due) have been run.  This is mainly useful
+   * for testing.
+   */
+  void Flush (size_t key);
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_SHARDEDEXECUTOR_HPP
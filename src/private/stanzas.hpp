@@ -22,6 +22,8 @@
 #include <gloox/stanzaextension.h>
 #include <gloox/tag.h>
 
+#include <cstdint>
+#include <memory>
 #include <string>
 
 namespace xmppbroadcast
@@ -32,17 +34,86 @@ constexpr const char* XMLNS = "https://xaya.io/xmppbroadcast";
 
 /**
  * A gloox stanza extension that wraps our messages into the <msg> tags.
+ *
+ * Optionally, the tag can carry "ts" and "seq" attributes with the time
+ * at which the sender queued the message (in microseconds since the epoch)
+ * and a per-sender sequence number.  They are used to measure end-to-end
+ * latency and detect lost messages.  Receivers not aware of them just
+ * ignore the attributes.
+ *
+ * Payloads too large for a single stanza can be split into fragments.
+ * Each fragment then carries "frag", "fragidx" and "fragcnt" attributes
+ * with an ID for the full message (unique per sender), its index and the
+ * total number of fragments.  A stanza with invalid fragment attributes
+ * is considered invalid as a whole.
+ *
+ * Instances created by gloox for received stanzas (through newInstance)
+ * decode their payload lazily, only when it is actually accessed.  This
+ * avoids the work for stanzas that are dropped without looking at the
+ * data.  Such instances reference the gloox::Tag they were created from,
+ * and must thus only be used while gloox handles the stanza (i.e. during
+ * the message handler callbacks).  Copy them with clone if needed
+ * for longer.
  */
 class MessageStanza : public gloox::StanzaExtension
 {
 
 private:
 
-  /** The payload data (which is the game-channel message string).  */
-  std::string data;
+  /**
+   * The payload data (which is the game-channel message string).  For lazy
+   * instances, this is filled in when first needed.
+   */
+  mutable std::string data;
 
   /** Set to false if this is invalid, e.g. failed to parse.  */
-  bool valid;
+  mutable bool valid;
+
+  /**
+   * For instances that are decoded lazily, the tag from which to decode
+   * the payload.  This is not owned, and reset to null after decoding.
+   */
+  mutable const gloox::Tag* source = nullptr;
+
+  /** Whether the timing attributes are present.  */
+  bool hasTiming = false;
+
+  /** The sender's timestamp in microseconds since the epoch.  */
+  uint64_t timestamp = 0;
+
+  /** The sender's sequence number.  */
+  uint64_t senderSeq = 0;
+
+  /** Whether this is a fragment of a larger message.  */
+  bool hasFragment = false;
+
+  /** Set if fragment attributes are present but invalid.  */
+  bool badFragment = false;
+
+  /** The sender's ID for the fragmented message.  */
+  uint64_t fragmentId = 0;
+
+  /** Index of this fragment.  */
+  unsigned fragmentIndex = 0;
+
+  /** Total number of fragments of the message.  */
+  unsigned fragmentCount = 0;
+
+  /**
+   * Parses the timing attributes from the given tag.
+   */
+  void ParseTiming (const gloox::Tag& t);
+
+  /**
+   * Parses the fragment attributes from the given tag.
+   */
+  void ParseFragment (const gloox::Tag& t);
+
+  /**
+   * Decodes the payload from the source tag, if this is a lazy
+   * instance that has not yet been decoded.
+   */
+  void Decode () const;
 
 public:
 
@@ -64,22 +135,101 @@ public:
   explicit MessageStanza (const std::string& d);
 
   /**
-   * Constructs an instance from a given tag.
+   * Constructs an instance from a given tag, decoding the payload
+   * right away.
    */
   explicit MessageStanza (const gloox::Tag& t);
 
+  /**
+   * Constructs an instance from the given tag, which decodes the payload
+   * only when it is accessed.  The tag must stay alive until then.
+   */
+  static std::unique_ptr<MessageStanza> Lazy (const gloox::Tag& t);
+
+  /**
+   * Returns true if the payload is valid.  For lazy instances, this
+   * decodes the payload.
+   */
   bool
   IsValid () const
   {
-    return valid;
+    Decode ();
+    return valid && !badFragment;
   }
 
   const std::string&
   GetData () const
   {
+    Decode ();
     return data;
   }
 
+  /**
+   * Sets the timing attributes to be included with the message.
+   */
+  void
+  SetTiming (const uint64_t ts, const uint64_t seq)
+  {
+    hasTiming = true;
+    timestamp = ts;
+    senderSeq = seq;
+  }
+
+  bool
+  HasTiming () const
+  {
+    return hasTiming;
+  }
+
+  uint64_t
+  GetTimestamp () const
+  {
+    return timestamp;
+  }
+
+  uint64_t
+  GetSenderSeq () const
+  {
+    return senderSeq;
+  }
+
+  /**
+   * Marks this as the fragment with the given index out of the given
+   * total number for the message with the given ID.
+   */
+  void
+  SetFragment (const uint64_t id, const unsigned index, const unsigned count)
+  {
+    hasFragment = true;
+    fragmentId = id;
+    fragmentIndex = index;
+    fragmentCount = count;
+  }
+
+  bool
+  IsFragment () const
+  {
+    return hasFragment;
+  }
+
+  uint64_t
+  GetFragmentId () const
+  {
+    return fragmentId;
+  }
+
+  unsigned
+  GetFragmentIndex () const
+  {
+    return fragmentIndex;
+  }
+
+  unsigned
+  GetFragmentCount () const
+  {
+    return fragmentCount;
+  }
+
   const std::string& filterString () const override;
   gloox::StanzaExtension* newInstance (const gloox::Tag* tag) const override;
   gloox::StanzaExtension* clone () const override;
@@ -0,0 +1,181 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_STREAMSERVER_HPP
+#define XMPPBROADCAST_STREAMSERVER_HPP
+
+#include "metrics.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct MHD_Connection;
+struct MHD_Daemon;
+
+namespace xmppbroadcast
+{
+
+/**
+ * HTTP server that allows clients to subscribe to a set of channels and
+ * get new messages pushed to them as they arrive, instead of polling
+ * with "receive" calls.
+ *
+ * Clients issue a request like
+ *
+ *    GET /subscribe?channels=<hex>:<seq>,<hex>
+ *
+ * and receive a chunked response, which contains one JSON object per
+ * line of the form {"channel": hex, "seq": n, "messages": [base64...]}.
+ * The seq value is the new sequence number after the messages (just like
+ * for the "receive" RPC method), so a client can resume a broken stream
+ * from it.  If no seq is given for a channel, only messages that arrive
+ * after the subscription are streamed.  Empty lines are sent periodically
+ * as keep-alive when there are no new messages.
+ *
+ * The server also exposes the library metrics in Prometheus text format
+ * at GET /metrics, so that they can be scraped directly.
+ */
+class StreamServer
+{
+
+public:
+
+  class Source;
+
+private:
+
+  class Subscription;
+
+  /** The source of messages.  */
+  Source& source;
+
+  /** The underlying MHD daemon.  */
+  MHD_Daemon* daemon;
+
+  /**
+   * Mutex for the stop flag, the watchers and the subscriptions' generation
+   * counters and condition variables.
+   */
+  std::mutex mut;
+
+  /** Set to true when the server is shutting down.  */
+  bool stopping = false;
+
+  /**
+   * All active subscriptions by the channels they are for (as lower-case
+   * hex IDs), so that a notification only wakes up those subscriptions
+   * that actually watch the channel.
+   */
+  std::unordered_multimap<std::string, Subscription*> watchers;
+
+  /** Counter for subscriptions woken up by a notification.  */
+  Counter& wakeups;
+
+  /**
+   * Registers a subscription (after its channels have been parsed) to be
+   * woken up for messages on its channels.
+   */
+  void AddWatcher (Subscription& sub);
+
+  /**
+   * Unregisters a subscription, when it is destroyed.
+   */
+  void RemoveWatcher (Subscription& sub);
+
+  /**
+   * Waits until new data is available for the given subscription, and
+   * fills it into the subscription's output buffer.  If no messages arrive
+   * until the keep-alive interval is over, a keep-alive line is
+   * produced instead.  Returns false if the server is shutting down.
+   */
+  bool FillOutput (Subscription& sub);
+
+  /**
+   * Handles a new HTTP request for the given URL.  This queues the response
+   * (either a subscription stream or an error) on the connection.
+   * Returns true on success.
+   */
+  bool HandleRequest (MHD_Connection* conn,
+                      const std::string& url, const std::string& method);
+
+  friend class Subscription;
+  friend struct MhdCallbacks;
+
+public:
+
+  /**
+   * Constructs the server and starts listening on the given port.
+   */
+  explicit StreamServer (Source& s, int port, bool onlyLocal);
+
+  /**
+   * Stops the server.  This closes all active subscriptions and waits
+   * for them to be done.
+   */
+  ~StreamServer ();
+
+  StreamServer () = delete;
+  StreamServer (const StreamServer&) = delete;
+  void operator= (const StreamServer&) = delete;
+
+  /**
+   * Signals that new messages may be available for the given channel
+   * (as hex ID).  This should be called by the source whenever it
+   * receives a message.
+   */
+  void Notify (const std::string& channel);
+
+};
+
+/**
+ * Interface for the source of messages (i.e. the channels) streamed
+ * by a StreamServer.
+ */
+class StreamServer::Source
+{
+
+public:
+
+  Source () = default;
+  virtual ~Source () = default;
+
+  /**
+   * Returns the current sequence number of the given channel (hex ID).
+   * Returns false if the channel ID is invalid or the channel can not
+   * be accessed.
+   */
+  virtual bool GetSequenceNumber (const std::string& channel, size_t& seq) = 0;
+
+  /**
+   * Retrieves all messages of the given channel from the sequence number
+   * onwards, without waiting for new ones.  The seq argument is updated
+   * to the new sequence number.  Returns false if the channel ID is
+   * invalid or the channel can not be accessed.
+   */
+  virtual bool Fetch (const std::string& channel, size_t& seq,
+                      std::vector<std::string>& messages) = 0;
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_STREAMSERVER_HPP
@@ -0,0 +1,99 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef XMPPBROADCAST_XMPPTRANSPORT_HPP
+#define XMPPBROADCAST_XMPPTRANSPORT_HPP
+
+#include "muctransport.hpp"
+
+#include <charon/xmppclient.hpp>
+
+#include <gloox/jid.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+/**
+ * The standard MucTransport, which connects to a real XMPP server
+ * through Charon's XmppClient.
+ */
+class XmppTransport : public MucTransport, private charon::XmppClient
+{
+
+private:
+
+  class XmppRoom;
+
+  void
+  HandleDisconnect () override
+  {
+    NotifyDisconnect ();
+  }
+
+public:
+
+  /**
+   * Sets up the transport for the given JID and password, but does not
+   * yet connect.
+   */
+  explicit XmppTransport (const gloox::JID& j, const std::string& password);
+
+  void
+  SetRootCA (const std::string& path) override
+  {
+    XmppClient::SetRootCA (path);
+  }
+
+  bool
+  Connect () override
+  {
+    return XmppClient::Connect (-1);
+  }
+
+  void
+  Disconnect () override
+  {
+    XmppClient::Disconnect ();
+  }
+
+  bool
+  IsConnected () const override
+  {
+    return XmppClient::IsConnected ();
+  }
+
+  std::unique_ptr<Room> JoinRoom (const gloox::JID& roomWithNick,
+                                  RoomHandler& handler) override;
+  void Send (const gloox::JID& room,
+             std::vector<std::unique_ptr<MessageStanza>> msgs) override;
+
+  /**
+   * Sends all messages with a single acquisition of the XMPP client,
+   * so that they are written out back-to-back.
+   */
+  void SendAll (std::vector<Outgoing> out) override;
+
+};
+
+} // namespace xmppbroadcast
+
+#endif // XMPPBROADCAST_XMPPTRANSPORT_HPP
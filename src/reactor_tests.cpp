@@ -0,0 +1,184 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/reactor.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+using std::chrono::milliseconds;
+
+using ReactorTests = testing::Test;
+
+TEST_F (ReactorTests, OrderPerKey)
+{
+  constexpr size_t keys = 10;
+  constexpr int perKey = 1'000;
+
+  std::mutex mut;
+  std::vector<std::vector<int>> received(keys);
+
+  Reactor reactor(3);
+  for (int i = 0; i < perKey; ++i)
+    for (size_t k = 0; k < keys; ++k)
+      reactor.Post (k, &received[k], [&, k, i] ()
+        {
+          std::lock_guard<std::mutex> lock(mut);
+          received[k].push_back (i);
+        });
+
+  for (size_t k = 0; k < keys; ++k)
+    reactor.Flush (k);
+
+  for (size_t k = 0; k < keys; ++k)
+    {
+      ASSERT_EQ (received[k].size (), perKey);
+      for (int i = 0; i < perKey; ++i)
+        EXPECT_EQ (received[k][i], i);
+    }
+}
+
+TEST_F (ReactorTests, Timers)
+{
+  Reactor reactor(1);
+
+  std::mutex mut;
+  std::vector<int> order;
+  std::vector<Reactor::Clock::duration> delays;
+  int owner;
+
+  const auto start = Reactor::Clock::now ();
+  for (const int ms : {50, 10, 30})
+    reactor.PostAt (0, &owner, start + milliseconds (ms), [&, ms] ()
+      {
+        std::lock_guard<std::mutex> lock(mut);
+        order.push_back (ms);
+        delays.push_back (Reactor::Clock::now () - start);
+      });
+
+  /* Tasks posted directly run before timers that are not yet due.  */
+  reactor.Post (0, &owner, [&] ()
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      order.push_back (0);
+      delays.push_back (Reactor::Clock::now () - start);
+    });
+
+  std::this_thread::sleep_for (milliseconds (100));
+  reactor.Flush (0);
+
+  std::lock_guard<std::mutex> lock(mut);
+  EXPECT_EQ (order, std::vector<int> ({0, 10, 30, 50}));
+  ASSERT_EQ (delays.size (), 4);
+  for (size_t i = 1; i < order.size (); ++i)
+    EXPECT_GE (delays[i], milliseconds (order[i]));
+}
+
+TEST_F (ReactorTests, Cancel)
+{
+  Reactor reactor(1);
+
+  std::atomic<bool> started(false);
+  std::atomic<bool> release(false);
+  std::atomic<int> runA(0);
+  std::atomic<int> runB(0);
+  int a, b;
+
+  /* The running task of a reschedules itself, which has to be
+     cancelled as well.  */
+  reactor.Post (0, &a, [&] ()
+    {
+      started = true;
+      while (!release)
+        std::this_thread::sleep_for (milliseconds (1));
+      ++runA;
+      reactor.Post (0, &a, [&] () { ++runA; });
+    });
+  for (int i = 0; i < 10; ++i)
+    {
+      reactor.Post (0, &a, [&] () { ++runA; });
+      reactor.Post (0, &b, [&] () { ++runB; });
+    }
+  reactor.PostAt (0, &a, Reactor::Clock::now () + milliseconds (20),
+                  [&] () { ++runA; });
+
+  while (!started)
+    std::this_thread::sleep_for (milliseconds (1));
+
+  std::thread releaser([&] ()
+    {
+      std::this_thread::sleep_for (milliseconds (10));
+      release = true;
+    });
+  reactor.Cancel (0, &a);
+  EXPECT_EQ (runA, 1);
+  releaser.join ();
+
+  std::this_thread::sleep_for (milliseconds (50));
+  reactor.Flush (0);
+  EXPECT_EQ (runA, 1);
+  EXPECT_EQ (runB, 10);
+}
+
+TEST_F (ReactorTests, CancelFromTask)
+{
+  Reactor reactor(1);
+
+  std::atomic<int> runs(0);
+  int owner;
+
+  reactor.Post (0, &owner, [&] ()
+    {
+      ++runs;
+      reactor.Post (0, &owner, [&] () { ++runs; });
+      reactor.Cancel (0, &owner);
+    });
+
+  reactor.Flush (0);
+  reactor.Flush (0);
+  EXPECT_EQ (runs, 1);
+}
+
+TEST_F (ReactorTests, PendingOnDestruction)
+{
+  std::atomic<int> runs(0);
+  int owner;
+
+  {
+    Reactor reactor(2);
+    for (size_t k = 0; k < 2; ++k)
+      reactor.PostAt (k, &owner,
+                      Reactor::Clock::now () + std::chrono::hours (1),
+                      [&] () { ++runs; });
+  }
+
+  EXPECT_EQ (runs, 0);
+}
+
+} // anonymous namespace
+} // namespace xmppbroadcast
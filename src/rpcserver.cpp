@@ -18,21 +18,31 @@
 
 #include "rpcserver.hpp"
 
+#include "metrics.hpp"
+#include "private/jsonwriter.hpp"
 #include "private/mucclient.hpp"
+#include "private/streamserver.hpp"
 #include "rpc-stubs/broadcastrpcserverstub.h"
 
 #include <xayautil/base64.hpp>
 
+#include <json/json.h>
 #include <jsonrpccpp/common/errors.h>
 #include <jsonrpccpp/common/exception.h>
 #include <jsonrpccpp/server/connectors/httpserver.h>
+#include <jsonrpccpp/server/iclientconnectionhandler.h>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -43,6 +53,12 @@ namespace xmppbroadcast
 DEFINE_int32 (xmppbroadcast_receive_timeout_ms, 3'000,
               "server-side timeout for receive calls in milliseconds");
 
+DEFINE_int32 (xmppbroadcast_rpc_threads, 50,
+              "number of worker threads for the HTTP JSON-RPC server");
+DEFINE_int32 (xmppbroadcast_rpc_max_requests, 0,
+              "if positive, maximum number of RPC method calls processed"
+              " concurrently; further calls fail immediately");
+
 /* ************************************************************************** */
 
 namespace
@@ -55,6 +71,29 @@ namespace
 class MsgChannel : public MucClient::Channel
 {
 
+public:
+
+  /**
+   * Limits for a single receive call.
+   */
+  struct Limits
+  {
+
+    /** How long to wait for messages if there are none yet.  */
+    std::chrono::milliseconds timeout;
+
+    /** Maximum number of messages to return, or zero for no limit.  */
+    size_t maxMessages = 0;
+
+    /**
+     * Maximum total size of the returned messages in bytes (after base64
+     * encoding), or zero for no limit.  At least one message is always
+     * returned if there are any, even if it is larger.
+     */
+    size_t maxBytes = 0;
+
+  };
+
 private:
 
   /** All received messages.  */
@@ -66,14 +105,27 @@ private:
   /** Condition variable signalled when new messages are received.  */
   std::condition_variable cv;
 
+  /** Callback invoked (without holding the lock) for each new message.  */
+  std::function<void ()> notify;
+
+  /**
+   * Copies messages from the given sequence number onwards into the
+   * result vector (respecting the given limits), and updates seq.
+   * Returns true if more messages are available than were copied.
+   * Must be called with the lock held.
+   */
+  bool CopyMessages (size_t& seq, const Limits& limits,
+                     std::vector<std::string>& res) const;
+
 protected:
 
   void MessageReceived (const std::string& msg) override;
 
 public:
 
-  explicit MsgChannel (MucClient& c, const gloox::JID& j)
-    : Channel(c, j)
+  explicit MsgChannel (MucClient& c, const gloox::JID& j,
+                       const std::function<void ()>& n)
+    : Channel(c, j), notify(n)
   {}
 
   /* Users of this class should make sure that there are no threads waiting
@@ -87,20 +139,33 @@ public:
 
   /**
    * Receives messages from the given sequence number onwards.  Waits for
-   * a certain amount of time if there are none.  The seq argument is
-   * changed to the new sequence number after the returned messages
-   * are accounted for.
+   * the timeout given in the limits if there are none.  The seq argument
+   * is changed to the new sequence number after the returned messages
+   * are accounted for.  more is set to true if there are more messages
+   * available that were not returned due to the limits.
    */
-  std::vector<std::string> Receive (size_t& seq);
+  std::vector<std::string> Receive (size_t& seq, const Limits& limits,
+                                    bool& more);
+
+  /**
+   * Returns all messages from the given sequence number onwards like
+   * Receive, but does not wait if there are none.
+   */
+  std::vector<std::string> Fetch (size_t& seq) const;
 
 };
 
 void
 MsgChannel::MessageReceived (const std::string& msg)
 {
-  std::lock_guard<std::mutex> lock(mut);
-  messages.push_back (msg);
-  cv.notify_all ();
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    messages.push_back (msg);
+    cv.notify_all ();
+  }
+
+  if (notify)
+    notify ();
 }
 
 size_t
@@ -110,46 +175,146 @@ MsgChannel::GetSequenceNumber () const
   return messages.size ();
 }
 
-std::vector<std::string>
-MsgChannel::Receive (size_t& seq)
+bool
+MsgChannel::CopyMessages (size_t& seq, const Limits& limits,
+                          std::vector<std::string>& res) const
 {
-  std::unique_lock<std::mutex> lock(mut);
-  if (messages.size () <= seq)
+  seq = std::min (seq, messages.size ());
+
+  size_t bytes = 0;
+  for (; seq < messages.size (); ++seq)
     {
-      const auto timeout = std::chrono::milliseconds (
-          FLAGS_xmppbroadcast_receive_timeout_ms);
-      cv.wait_for (lock, timeout);
+      if (limits.maxMessages > 0 && res.size () >= limits.maxMessages)
+        break;
+
+      const size_t encodedSize = 4 * ((messages[seq].size () + 2) / 3);
+      if (limits.maxBytes > 0 && !res.empty ()
+            && bytes + encodedSize > limits.maxBytes)
+        break;
+
+      bytes += encodedSize;
+      res.push_back (messages[seq]);
     }
 
+  return seq < messages.size ();
+}
+
+std::vector<std::string>
+MsgChannel::Receive (size_t& seq, const Limits& limits, bool& more)
+{
+  std::unique_lock<std::mutex> lock(mut);
+  if (messages.size () <= seq && limits.timeout.count () > 0)
+    cv.wait_for (lock, limits.timeout);
+
   std::vector<std::string> res;
-  for (unsigned i = seq; i < messages.size (); ++i)
-    res.push_back (messages[i]);
+  more = CopyMessages (seq, limits, res);
+  return res;
+}
 
-  seq = messages.size ();
+std::vector<std::string>
+MsgChannel::Fetch (size_t& seq) const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  std::vector<std::string> res;
+  CopyMessages (seq, Limits (), res);
   return res;
 }
 
 /**
  * The MUC client for our broadcast RPC server, using the MsgChannel
- * instances for channels.
+ * instances for channels.  It also acts as source for the stream server
+ * (if one is enabled), and notifies it of received messages.
  */
-class RpcMucClient : public MucClient
+class RpcMucClient : public TypedMucClient<MsgChannel>,
+                     public StreamServer::Source
 {
 
+private:
+
+  /** The stream server to notify about messages, if any.  */
+  StreamServer* stream = nullptr;
+
+  /** Lock for the stream server pointer.  */
+  std::mutex mutStream;
+
+  /**
+   * Looks up the MsgChannel for a given hex ID.  Returns null if the
+   * ID is invalid or the channel cannot be accessed.
+   */
+  MsgChannel* LookupChannel (const std::string& hexId);
+
 protected:
 
-  std::unique_ptr<Channel>
-  CreateChannel (const gloox::JID& j) override
+  std::unique_ptr<MsgChannel>
+  CreateTypedChannel (const gloox::JID& j) override
   {
-    return std::make_unique<MsgChannel> (*this, j);
+    /* The room's name is the game ID and the channel's hex ID joined
+       with an underscore (see GetRoomJid).  */
+    const std::string& room = j.username ();
+    const std::string hexId = room.substr (room.rfind ('_') + 1);
+
+    return std::make_unique<MsgChannel> (*this, j, [this, hexId] ()
+      {
+        std::lock_guard<std::mutex> lock(mutStream);
+        if (stream != nullptr)
+          stream->Notify (hexId);
+      });
   }
 
 public:
 
-  using MucClient::MucClient;
+  using TypedMucClient::TypedMucClient;
+
+  /**
+   * Sets (or clears with null) the stream server that should be notified
+   * about newly received messages.
+   */
+  void
+  SetStreamServer (StreamServer* s)
+  {
+    std::lock_guard<std::mutex> lock(mutStream);
+    stream = s;
+  }
+
+  bool GetSequenceNumber (const std::string& channel, size_t& seq) override;
+  bool Fetch (const std::string& channel, size_t& seq,
+              std::vector<std::string>& messages) override;
 
 };
 
+MsgChannel*
+RpcMucClient::LookupChannel (const std::string& hexId)
+{
+  xaya::uint256 id;
+  if (!id.FromHex (hexId))
+    return nullptr;
+
+  return GetChannel (id);
+}
+
+bool
+RpcMucClient::GetSequenceNumber (const std::string& channel, size_t& seq)
+{
+  auto* c = LookupChannel (channel);
+  if (c == nullptr)
+    return false;
+
+  seq = c->GetSequenceNumber ();
+  return true;
+}
+
+bool
+RpcMucClient::Fetch (const std::string& channel, size_t& seq,
+                     std::vector<std::string>& messages)
+{
+  auto* c = LookupChannel (channel);
+  if (c == nullptr)
+    return false;
+
+  messages = c->Fetch (seq);
+  return true;
+}
+
 /* ************************************************************************** */
 
 /**
@@ -160,12 +325,41 @@ class RealServer : public BroadcastRpcServerStub
 
 private:
 
+  /**
+   * JSON-RPC error code returned when a call is rejected because too
+   * many are being processed already.
+   */
+  static constexpr int ERROR_SERVER_BUSY = -32'000;
+
   /** The MUC client we use to access channels.  */
-  MucClient& client;
+  RpcMucClient& client;
 
   /** Closure called when a stop is requested.  */
   std::function<void ()> requestStop;
 
+  /** Number of method calls currently being processed.  */
+  std::atomic<int> activeRequests;
+
+  /** Total number of method calls received.  */
+  std::atomic<uint64_t> totalRequests;
+
+  /** Number of method calls rejected by admission control.  */
+  std::atomic<uint64_t> rejectedRequests;
+
+  /**
+   * Latency histograms for all RPC methods by name.  This is filled in
+   * the constructor and not modified afterwards, so it can be read
+   * without locking.
+   */
+  std::map<std::string, Histogram*> latencies;
+
+  /**
+   * Records the latency of a call to the given method that started
+   * at the given time.
+   */
+  void RecordLatency (const std::string& method,
+                      std::chrono::steady_clock::time_point start) const;
+
   /**
    * Returns the MsgChannel for a given channel ID.  This convenience
    * method handles the conversion to uint256, error checking, and verification
@@ -173,21 +367,168 @@ private:
    */
   MsgChannel& GetChannel (const std::string& hexId);
 
+  /**
+   * Returns the MsgChannel for an already parsed channel ID, throwing
+   * a JSON-RPC error if it can not be accessed.
+   */
+  MsgChannel& GetChannel (const xaya::uint256& id);
+
 public:
 
-  explicit RealServer (MucClient& c, jsonrpc::AbstractServerConnector& conn,
-                       const std::function<void ()>& s)
-    : BroadcastRpcServerStub(conn), client(c), requestStop(s)
-  {}
+  class ActiveCall;
+
+  explicit RealServer (RpcMucClient& c,
+                       jsonrpc::AbstractServerConnector& conn,
+                       const std::function<void ()>& s);
+
+  /**
+   * Processes a method call.  We override this to apply admission control,
+   * i.e. fail right away if too many calls are being processed already
+   * (e.g. waiting in receive).  Notifications are not limited, as they
+   * can not report an error anyway and do not block.
+   */
+  void HandleMethodCall (jsonrpc::Procedure& proc, const Json::Value& input,
+                         Json::Value& output) override;
+
+  /**
+   * Processes a notification.  We override this to record its latency.
+   */
+  void HandleNotificationCall (jsonrpc::Procedure& proc,
+                               const Json::Value& input) override;
 
   void send (const std::string& channel, const std::string& message) override;
+  Json::Value sendbatch (const Json::Value& messages) override;
+  bool sendack (const std::string& channel,
+                const std::string& message) override;
+  bool setweight (const std::string& channel, int weight) override;
   Json::Value getseq (const std::string& channel) override;
   Json::Value receive (const std::string& channel, int fromseq) override;
+  Json::Value receivepaged (const std::string& channel, int fromseq,
+                            int maxbytes, int maxmessages,
+                            int timeoutms) override;
 
+  Json::Value getstats () override;
+  std::string getmetrics () override;
   void stop () override;
 
+  /**
+   * Returns the current sequence number of a channel.  This is the
+   * underlying implementation of getseq.
+   */
+  size_t GetSequenceNumber (const std::string& channel);
+
+  /**
+   * Receives messages for a receive call with the given limits.  This is the
+   * underlying implementation of receive and receivepaged, and sets seq
+   * and more to the values to return for them.
+   */
+  std::vector<std::string> ReceiveMessages (const std::string& channel,
+                                            int fromseq,
+                                            const MsgChannel::Limits& limits,
+                                            size_t& seq, bool& more);
+
+};
+
+/**
+ * RAII helper that marks a method call as active while it is being processed,
+ * and applies admission control to it.  The constructor throws a JSON-RPC
+ * error if the call is rejected.
+ */
+class RealServer::ActiveCall
+{
+
+private:
+
+  /** The server this is for.  */
+  RealServer& srv;
+
+  /** The method being called.  */
+  const std::string method;
+
+  /** When the call started.  */
+  const std::chrono::steady_clock::time_point start;
+
+public:
+
+  explicit ActiveCall (RealServer& s, const std::string& m);
+
+  ~ActiveCall ()
+  {
+    --srv.activeRequests;
+    srv.RecordLatency (method, start);
+  }
+
+  ActiveCall () = delete;
+  ActiveCall (const ActiveCall&) = delete;
+  void operator= (const ActiveCall&) = delete;
+
 };
 
+constexpr int RealServer::ERROR_SERVER_BUSY;
+
+RealServer::RealServer (RpcMucClient& c,
+                        jsonrpc::AbstractServerConnector& conn,
+                        const std::function<void ()>& s)
+  : BroadcastRpcServerStub(conn), client(c), requestStop(s),
+    activeRequests(0), totalRequests(0), rejectedRequests(0)
+{
+  for (const std::string m : {"send", "sendbatch", "sendack", "setweight",
+                              "getseq", "receive", "receivepaged",
+                              "getstats", "getmetrics", "stop"})
+    latencies[m] = &MetricsRegistry::Default ().GetHistogram (
+        "xmppbroadcast_rpc_duration_seconds",
+        "Time spent processing RPC calls",
+        Histogram::LatencyBounds (), {{"method", m}});
+}
+
+void
+RealServer::RecordLatency (const std::string& method,
+                           const std::chrono::steady_clock::time_point start)
+    const
+{
+  const auto mit = latencies.find (method);
+  if (mit != latencies.end ())
+    mit->second->ObserveDuration (std::chrono::steady_clock::now () - start);
+}
+
+RealServer::ActiveCall::ActiveCall (RealServer& s, const std::string& m)
+  : srv(s), method(m), start(std::chrono::steady_clock::now ())
+{
+  ++srv.totalRequests;
+
+  const int active = ++srv.activeRequests;
+  if (FLAGS_xmppbroadcast_rpc_max_requests > 0
+        && active > FLAGS_xmppbroadcast_rpc_max_requests)
+    {
+      /* The destructor will not run if we throw here.  */
+      --srv.activeRequests;
+      ++srv.rejectedRequests;
+
+      VLOG (1)
+          << "Rejecting " << method
+          << " call, " << active << " calls are active";
+      throw jsonrpc::JsonRpcException (ERROR_SERVER_BUSY,
+                                       "too many concurrent requests");
+    }
+}
+
+void
+RealServer::HandleMethodCall (jsonrpc::Procedure& proc,
+                              const Json::Value& input, Json::Value& output)
+{
+  ActiveCall call(*this, proc.GetProcedureName ());
+  BroadcastRpcServerStub::HandleMethodCall (proc, input, output);
+}
+
+void
+RealServer::HandleNotificationCall (jsonrpc::Procedure& proc,
+                                    const Json::Value& input)
+{
+  const auto start = std::chrono::steady_clock::now ();
+  BroadcastRpcServerStub::HandleNotificationCall (proc, input);
+  RecordLatency (proc.GetProcedureName (), start);
+}
+
 MsgChannel&
 RealServer::GetChannel (const std::string& hexId)
 {
@@ -196,7 +537,13 @@ RealServer::GetChannel (const std::string& hexId)
     throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
                                      "invalid uint256: " + hexId);
 
-  auto* channel = client.GetChannel<MsgChannel> (id);
+  return GetChannel (id);
+}
+
+MsgChannel&
+RealServer::GetChannel (const xaya::uint256& id)
+{
+  auto* channel = client.GetChannel (id);
   if (channel == nullptr)
     throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
                                      "failed to access channel, disconnected?");
@@ -217,10 +564,124 @@ RealServer::send (const std::string& channel, const std::string& message)
   GetChannel (channel).Send (decoded);
 }
 
+/**
+ * Constructs the per-item result for a sendbatch entry that failed
+ * with the given error message.
+ */
+Json::Value
+BatchError (const std::string& msg)
+{
+  Json::Value res(Json::objectValue);
+  res["success"] = false;
+  res["error"] = msg;
+  return res;
+}
+
+Json::Value
+RealServer::sendbatch (const Json::Value& messages)
+{
+  Json::Value success(Json::objectValue);
+  success["success"] = true;
+  Json::Value res(Json::arrayValue);
+
+  /* We first parse all channel IDs, decode all payloads and group them
+     by channel.  That way each channel is looked up only once, and all its
+     messages are queued in one go (in the order they have in the batch).
+     Grouping by the parsed ID makes sure that different spellings of
+     the same channel (e.g. upper and lower case) end up together.  */
+  std::vector<std::string> decoded(messages.size ());
+  std::map<xaya::uint256, std::vector<Json::ArrayIndex>> byChannel;
+  for (Json::ArrayIndex i = 0; i < messages.size (); ++i)
+    {
+      const auto& item = messages[i];
+      if (!item.isObject () || !item["channel"].isString ()
+            || !item["message"].isString ())
+        {
+          res.append (BatchError ("invalid batch item"));
+          continue;
+        }
+
+      xaya::uint256 id;
+      if (!id.FromHex (item["channel"].asString ()))
+        {
+          res.append (BatchError ("invalid uint256"));
+          continue;
+        }
+
+      if (!xaya::DecodeBase64 (item["message"].asString (), decoded[i]))
+        {
+          res.append (BatchError ("invalid base64"));
+          continue;
+        }
+
+      res.append (success);
+      byChannel[id].push_back (i);
+    }
+
+  for (const auto& entry : byChannel)
+    {
+      MsgChannel* channel;
+      try
+        {
+          channel = &GetChannel (entry.first);
+        }
+      catch (const jsonrpc::JsonRpcException& exc)
+        {
+          LOG (WARNING)
+              << "Failed to send batch messages to " << entry.first.ToHex ()
+              << ": " << exc.what ();
+          for (const auto i : entry.second)
+            res[i] = BatchError (exc.what ());
+          continue;
+        }
+
+      std::vector<std::string> payloads;
+      payloads.reserve (entry.second.size ());
+      for (const auto i : entry.second)
+        payloads.push_back (std::move (decoded[i]));
+      channel->Send (std::move (payloads));
+    }
+
+  return res;
+}
+
+bool
+RealServer::sendack (const std::string& channel, const std::string& message)
+{
+  std::string decoded;
+  if (!xaya::DecodeBase64 (message, decoded))
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "invalid base64");
+
+  /* This blocks the RPC thread until the message is acknowledged or
+     times out, which is bounded by -xmppbroadcast_ack_timeout_ms.  */
+  return GetChannel (channel).SendWithAck (decoded).get ();
+}
+
+bool
+RealServer::setweight (const std::string& channel, const int weight)
+{
+  xaya::uint256 id;
+  if (!id.FromHex (channel))
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "invalid uint256: " + channel);
+  if (weight < 1)
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "weight must be positive");
+
+  return client.SetChannelWeight (id, weight);
+}
+
+size_t
+RealServer::GetSequenceNumber (const std::string& channel)
+{
+  return GetChannel (channel).GetSequenceNumber ();
+}
+
 Json::Value
 RealServer::getseq (const std::string& channel)
 {
-  const size_t num = GetChannel (channel).GetSequenceNumber ();
+  const size_t num = GetSequenceNumber (channel);
 
   Json::Value res(Json::objectValue);
   res["seq"] = static_cast<Json::Int64> (num);
@@ -228,11 +689,54 @@ RealServer::getseq (const std::string& channel)
   return res;
 }
 
+/**
+ * Returns the default limits for receive calls.
+ */
+MsgChannel::Limits
+DefaultReceiveLimits ()
+{
+  MsgChannel::Limits res;
+  res.timeout
+      = std::chrono::milliseconds (FLAGS_xmppbroadcast_receive_timeout_ms);
+  return res;
+}
+
+/**
+ * Returns the limits for a receivepaged call with the given arguments.
+ * A timeoutms of zero returns immediately without waiting for messages,
+ * and a negative one selects the server's default timeout.  For maxbytes
+ * and maxmessages, zero or negative values mean no limit.
+ */
+MsgChannel::Limits
+PagedReceiveLimits (const int maxbytes, const int maxmessages,
+                    const int timeoutms)
+{
+  auto res = DefaultReceiveLimits ();
+  if (timeoutms >= 0)
+    res.timeout = std::chrono::milliseconds (timeoutms);
+  if (maxmessages > 0)
+    res.maxMessages = maxmessages;
+  if (maxbytes > 0)
+    res.maxBytes = maxbytes;
+  return res;
+}
+
+std::vector<std::string>
+RealServer::ReceiveMessages (const std::string& channel, const int fromseq,
+                             const MsgChannel::Limits& limits,
+                             size_t& seq, bool& more)
+{
+  seq = fromseq;
+  return GetChannel (channel).Receive (seq, limits, more);
+}
+
 Json::Value
 RealServer::receive (const std::string& channel, const int fromseq)
 {
-  size_t seq = fromseq;
-  const auto msg = GetChannel (channel).Receive (seq);
+  size_t seq;
+  bool more;
+  const auto msg
+      = ReceiveMessages (channel, fromseq, DefaultReceiveLimits (), seq, more);
 
   Json::Value msgArr(Json::arrayValue);
   for (const auto& m : msg)
@@ -245,6 +749,50 @@ RealServer::receive (const std::string& channel, const int fromseq)
   return res;
 }
 
+Json::Value
+RealServer::receivepaged (const std::string& channel, const int fromseq,
+                          const int maxbytes, const int maxmessages,
+                          const int timeoutms)
+{
+  size_t seq;
+  bool more;
+  const auto msg = ReceiveMessages (
+      channel, fromseq,
+      PagedReceiveLimits (maxbytes, maxmessages, timeoutms),
+      seq, more);
+
+  Json::Value msgArr(Json::arrayValue);
+  for (const auto& m : msg)
+    msgArr.append (xaya::EncodeBase64 (m));
+
+  Json::Value res(Json::objectValue);
+  res["messages"] = msgArr;
+  res["seq"] = static_cast<Json::Int64> (seq);
+  res["more"] = more;
+
+  return res;
+}
+
+Json::Value
+RealServer::getstats ()
+{
+  Json::Value requests(Json::objectValue);
+  requests["active"] = activeRequests.load ();
+  requests["total"] = static_cast<Json::UInt64> (totalRequests.load ());
+  requests["rejected"] = static_cast<Json::UInt64> (rejectedRequests.load ());
+
+  Json::Value res(Json::objectValue);
+  res["requests"] = requests;
+
+  return res;
+}
+
+std::string
+RealServer::getmetrics ()
+{
+  return MetricsRegistry::Default ().ToPrometheusText ();
+}
+
 void
 RealServer::stop ()
 {
@@ -254,6 +802,234 @@ RealServer::stop ()
 
 /* ************************************************************************** */
 
+/**
+ * Connection handler that answers the hot read-only calls (receive,
+ * receivepaged and getseq) directly.  The responses are written with
+ * JsonWriter straight into the response string, instead of building
+ * a Json::Value tree first and serialising it with jsoncpp.  All other
+ * requests (and unusual ones, like batch requests) are passed on to the
+ * standard jsonrpccpp handler.
+ */
+class FastResponseHandler : public jsonrpc::IClientConnectionHandler
+{
+
+private:
+
+  /** The RPC server providing the actual data.  */
+  RealServer& rpc;
+
+  /** The standard handler used for all other requests.  */
+  jsonrpc::IClientConnectionHandler& fallback;
+
+  /** Builder for the JSON parsers.  */
+  Json::CharReaderBuilder readerBuilder;
+
+  /**
+   * Tries to handle the request on the fast path.  Returns false if it
+   * should be passed on to the fallback handler instead.
+   */
+  bool HandleFast (const std::string& request, std::string& response);
+
+public:
+
+  explicit FastResponseHandler (RealServer& r,
+                                jsonrpc::IClientConnectionHandler& f)
+    : rpc(r), fallback(f)
+  {}
+
+  void HandleRequest (const std::string& request,
+                      std::string& response) override;
+
+};
+
+/**
+ * Writes the "id" and "jsonrpc" fields of a JSON-RPC response.
+ */
+void
+WriteResponseHeader (JsonWriter& w, const Json::Value& id)
+{
+  w.Key ("id");
+  if (id.isString ())
+    w.String (id.asString ());
+  else if (id.isInt64 ())
+    w.Int (id.asInt64 ());
+  else
+    w.UInt (id.asUInt64 ());
+
+  w.Key ("jsonrpc");
+  w.String ("2.0");
+}
+
+bool
+FastResponseHandler::HandleFast (const std::string& request,
+                                 std::string& response)
+{
+  /* Do a quick check on the raw request first, so that we do not
+     parse every other request (e.g. send) twice.  */
+  if (request.find ("\"receive") == std::string::npos
+        && request.find ("\"getseq\"") == std::string::npos)
+    return false;
+
+  Json::Value req;
+  std::unique_ptr<Json::CharReader> reader(readerBuilder.newCharReader ());
+  if (!reader->parse (request.data (), request.data () + request.size (),
+                      &req, nullptr))
+    return false;
+
+  if (!req.isObject () || req["jsonrpc"] != "2.0"
+        || !req["method"].isString () || !req["params"].isObject ())
+    return false;
+
+  /* Only accept values that the conversions below can represent.  Other
+     integral values (e.g. above INT_MAX) would make jsoncpp throw.  */
+  const auto& id = req["id"];
+  if (!id.isString () && !id.isInt64 () && !id.isUInt64 ())
+    return false;
+
+  const std::string method = req["method"].asString ();
+  const auto& params = req["params"];
+  if (!params["channel"].isString ())
+    return false;
+  const std::string channel = params["channel"].asString ();
+
+  try
+    {
+      if (method == "getseq")
+        {
+          RealServer::ActiveCall call(rpc, method);
+          const size_t seq = rpc.GetSequenceNumber (channel);
+
+          response.clear ();
+          JsonWriter w(response);
+          w.BeginObject ();
+          WriteResponseHeader (w, id);
+          w.Key ("result");
+          w.BeginObject ();
+          w.Key ("seq");
+          w.UInt (seq);
+          w.EndObject ();
+          w.EndObject ();
+
+          return true;
+        }
+
+      bool paged;
+      if (method == "receive")
+        paged = false;
+      else if (method == "receivepaged")
+        paged = true;
+      else
+        return false;
+
+      if (!params["fromseq"].isInt ())
+        return false;
+
+      auto limits = DefaultReceiveLimits ();
+      if (paged)
+        {
+          for (const char* key : {"maxbytes", "maxmessages", "timeoutms"})
+            if (!params[key].isInt ())
+              return false;
+          limits = PagedReceiveLimits (params["maxbytes"].asInt (),
+                                       params["maxmessages"].asInt (),
+                                       params["timeoutms"].asInt ());
+        }
+
+      RealServer::ActiveCall call(rpc, method);
+      size_t seq;
+      bool more;
+      const auto msg = rpc.ReceiveMessages (channel,
+                                            params["fromseq"].asInt (),
+                                            limits, seq, more);
+
+      /* Reserve enough space for the entire response, so that it gets
+         written without any reallocations.  */
+      size_t size = 128;
+      for (const auto& m : msg)
+        size += JsonWriter::Base64Size (m.size ()) + 1;
+
+      response.clear ();
+      response.reserve (size);
+      JsonWriter w(response);
+      w.BeginObject ();
+      WriteResponseHeader (w, id);
+      w.Key ("result");
+      w.BeginObject ();
+      w.Key ("messages");
+      w.BeginArray ();
+      for (const auto& m : msg)
+        w.Base64 (m);
+      w.EndArray ();
+      if (paged)
+        {
+          w.Key ("more");
+          w.Bool (more);
+        }
+      w.Key ("seq");
+      w.UInt (seq);
+      w.EndObject ();
+      w.EndObject ();
+
+      return true;
+    }
+  catch (const jsonrpc::JsonRpcException& exc)
+    {
+      response.clear ();
+      JsonWriter w(response);
+      w.BeginObject ();
+      w.Key ("error");
+      w.BeginObject ();
+      w.Key ("code");
+      w.Int (exc.GetCode ());
+      w.Key ("message");
+      w.String (exc.GetMessage ());
+      w.EndObject ();
+      WriteResponseHeader (w, id);
+      w.EndObject ();
+
+      return true;
+    }
+}
+
+void
+FastResponseHandler::HandleRequest (const std::string& request,
+                                    std::string& response)
+{
+  if (HandleFast (request, response))
+    return;
+
+  /* The generated stubs convert parameters with e.g. asInt after only
+     checking that they are integral, which throws for values out of range.
+     Turn that into an error response rather than letting the exception
+     escape into the HTTP server.  */
+  try
+    {
+      fallback.HandleRequest (request, response);
+    }
+  catch (const Json::Exception& exc)
+    {
+      LOG (WARNING) << "Invalid RPC request: " << exc.what ();
+
+      response.clear ();
+      JsonWriter w(response);
+      w.BeginObject ();
+      w.Key ("error");
+      w.BeginObject ();
+      w.Key ("code");
+      w.Int (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS);
+      w.Key ("message");
+      w.String (exc.what ());
+      w.EndObject ();
+      w.Key ("id");
+      w.Raw ("null");
+      w.Key ("jsonrpc");
+      w.String ("2.0");
+      w.EndObject ();
+    }
+}
+
+/* ************************************************************************** */
+
 /**
  * The JSON-RPC server together with its HTTP server connector.
  */
@@ -268,12 +1044,22 @@ private:
   /** The actual RPC server.  */
   RealServer rpc;
 
+  /** The fast-path handler installed in front of the RPC server.  */
+  std::unique_ptr<FastResponseHandler> fast;
+
 public:
 
   FullServer (const int port, const bool onlyLocal,
-              MucClient& client, const std::function<void ()>& requestStop)
-    : http(port), rpc(client, http, requestStop)
+              RpcMucClient& client,
+              const std::function<void ()>& requestStop)
+    : http(port, "", "", FLAGS_xmppbroadcast_rpc_threads),
+      rpc(client, http, requestStop)
   {
+    /* The RPC server has registered its own handler with the connector.
+       Put our fast path in front of it.  */
+    fast = std::make_unique<FastResponseHandler> (rpc, *http.GetHandler ());
+    http.SetHandler (fast.get ());
+
     if (onlyLocal)
       http.BindLocalhost ();
     http.StartListening ();
@@ -313,13 +1099,23 @@ private:
    */
   std::unique_ptr<FullServer> server;
 
+  /** The port for the stream server, or zero if it is disabled.  */
+  int streamPort = 0;
+
+  /** The stream server, if it is enabled and the server is running.  */
+  std::unique_ptr<StreamServer> stream;
+
   /**
    * If the server is started, we also set up a thread that just waits in
    * a loop until the server requests to be shut down, and then handles
-   * the shutdown.
+   * the shutdown.  When the client uses a reactor, there is no such thread;
+   * instead, Wait handles the shutdown on the calling thread.
    */
   std::unique_ptr<std::thread> shutDownWaiter;
 
+  /** Lock held by Wait while waiting for and handling the shutdown.  */
+  std::mutex mutWait;
+
   /** Set to true if a server shutdown is requested.  */
   bool shouldStop;
 
@@ -335,6 +1131,16 @@ private:
    */
   void RequestStop ();
 
+  /**
+   * Blocks until a shutdown has been requested.
+   */
+  void WaitForStopRequest ();
+
+  /**
+   * Shuts down the running server.
+   */
+  void ShutDown ();
+
   friend class RpcServer;
 
 public:
@@ -351,6 +1157,7 @@ public:
        be stopped properly.  The destructor of RpcServer takes care of that.  */
     CHECK (refresher == nullptr);
     CHECK (server == nullptr);
+    CHECK (stream == nullptr);
     CHECK (shutDownWaiter == nullptr);
   }
 
@@ -378,6 +1185,24 @@ RpcServer::Impl::RequestStop ()
   cvStop.notify_all ();
 }
 
+void
+RpcServer::Impl::WaitForStopRequest ()
+{
+  std::unique_lock<std::mutex> lock(mutStop);
+  while (!shouldStop)
+    cvStop.wait (lock);
+}
+
+void
+RpcServer::Impl::ShutDown ()
+{
+  server.reset ();
+  client.SetStreamServer (nullptr);
+  stream.reset ();
+  refresher.reset ();
+  client.Disconnect ();
+}
+
 void
 RpcServer::SetRootCA (const std::string& path)
 {
@@ -385,6 +1210,13 @@ RpcServer::SetRootCA (const std::string& path)
   impl->client.SetRootCA (path);
 }
 
+void
+RpcServer::EnableStreaming (const int port)
+{
+  CHECK (impl->server == nullptr) << "Server is already started";
+  impl->streamPort = port;
+}
+
 void
 RpcServer::Start (const int port, const bool onlyLocal)
 {
@@ -402,14 +1234,23 @@ RpcServer::Start (const int port, const bool onlyLocal)
         {
           impl->RequestStop ();
         });
+  if (impl->streamPort != 0)
+    {
+      impl->stream = std::make_unique<StreamServer> (
+          impl->client, impl->streamPort, onlyLocal);
+      impl->client.SetStreamServer (impl->stream.get ());
+    }
+
+  /* With a reactor, we avoid the extra thread.  Shutting down can't be
+     done on the reactor itself, as it blocks until all RPC calls are done,
+     which may in turn wait for the reactor (e.g. to time out a sendack).  */
+  if (impl->client.UsesReactor ())
+    return;
+
   impl->shutDownWaiter = std::make_unique<std::thread> ([this] ()
     {
-      std::unique_lock<std::mutex> lock(impl->mutStop);
-      while (!impl->shouldStop)
-        impl->cvStop.wait (lock);
-      impl->server.reset ();
-      impl->refresher.reset ();
-      impl->client.Disconnect ();
+      impl->WaitForStopRequest ();
+      impl->ShutDown ();
     });
 }
 
@@ -427,7 +1268,14 @@ RpcServer::Wait ()
     {
       impl->shutDownWaiter->join ();
       impl->shutDownWaiter.reset ();
+      return;
     }
+
+  std::lock_guard<std::mutex> lock(impl->mutWait);
+  if (impl->server == nullptr)
+    return;
+  impl->WaitForStopRequest ();
+  impl->ShutDown ();
 }
 
 /* ************************************************************************** */
@@ -63,6 +63,14 @@ public:
    */
   void SetRootCA (const std::string& path);
 
+  /**
+   * Enables the streaming subscription endpoint (GET /subscribe), which
+   * pushes newly received messages to subscribed HTTP clients instead of
+   * them having to poll with "receive".  It will listen on the given port
+   * once the server is started.  This must be called before Start.
+   */
+  void EnableStreaming (int port);
+
   /**
    * Starts the server.  This connects the XMPP client and makes the
    * server listen for connections on the given port.
@@ -78,6 +86,8 @@ public:
   /**
    * Lets the server run (it should have been started already) and waits
    * for it to shut down by itself, e.g. after a "stop" RPC notification.
+   * With -xmppbroadcast_reactor_threads, there is no background thread
+   * waiting for the shutdown; it is then done by this method (or Stop).
    */
   void Wait ();
 
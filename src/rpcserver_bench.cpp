@@ -0,0 +1,256 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* End-to-end benchmarks for the RPC server, with clients sending and
+   receiving messages through its JSON-RPC interface.  */
+
+#include "rpcserver.hpp"
+
+#include "benchutils.hpp"
+#include "rpc-stubs/broadcastrpcclient.h"
+#include "testutils.hpp"
+
+#include <xayautil/base64.hpp>
+
+#include <json/json.h>
+#include <jsonrpccpp/client/connectors/httpclient.h>
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+/** The port used for the benchmark server.  */
+constexpr int PORT = 29'185;
+
+/** Number of messages sent per iteration in the throughput benchmark.  */
+constexpr unsigned BATCH = 100;
+
+/** Timeout for receiving all messages or joining rooms.  */
+constexpr auto TIMEOUT = std::chrono::seconds (60);
+
+/**
+ * RPC client connected to the benchmark server.
+ */
+class BenchRpcClient
+{
+
+private:
+
+  /** The HTTP client connector.  */
+  jsonrpc::HttpClient http;
+
+  /** The actual RPC client.  */
+  BroadcastRpcClient rpc;
+
+  /**
+   * Returns the endpoint of the benchmark server.
+   */
+  static std::string
+  GetEndpoint ()
+  {
+    std::ostringstream res;
+    res << "http://localhost:" << PORT;
+    return res.str ();
+  }
+
+public:
+
+  BenchRpcClient ()
+    : http(GetEndpoint ()), rpc(http)
+  {}
+
+  BroadcastRpcClient*
+  operator-> ()
+  {
+    return &rpc;
+  }
+
+};
+
+/**
+ * RpcServer running for the benchmark.
+ */
+class BenchServer : public RpcServer
+{
+
+public:
+
+  BenchServer ()
+    : RpcServer("bench", GetTestJid (0).full (), GetPassword (0),
+                GetServerConfig ().muc)
+  {
+    SetRootCA (GetTestCA ());
+    Start (PORT);
+  }
+
+};
+
+/**
+ * Polls the given channels with non-blocking receivepaged calls and
+ * passes all messages on to the recorder, until stop is set.
+ */
+void
+PollChannels (const std::vector<std::string>& channels,
+              LatencyRecorder& rec, const std::atomic<bool>& stop)
+{
+  BenchRpcClient client;
+
+  std::vector<int> seq(channels.size (), 0);
+  while (!stop)
+    for (size_t i = 0; i < channels.size (); ++i)
+      {
+        /* Use a short server-side timeout when there is only one channel,
+           so that we long-poll on it instead of spinning.  */
+        const int timeout = (channels.size () == 1 ? 100 : 0);
+        const auto res = client->receivepaged (channels[i], seq[i],
+                                               0, 0, timeout);
+
+        for (const auto& m : res["messages"])
+          {
+            std::string decoded;
+            if (xaya::DecodeBase64 (m.asString (), decoded))
+              rec.Received (decoded);
+          }
+        seq[i] = res["seq"].asInt ();
+      }
+}
+
+/**
+ * Sends messages through the RPC server and receives them back with
+ * receivepaged, with the payload size as argument.
+ */
+void
+RpcServerThroughput (benchmark::State& state)
+{
+  const size_t size = state.range (0);
+  const std::string channel = NewChannelId ().ToHex ();
+  LatencyRecorder rec;
+
+  const uint64_t joins = GetRoomJoins ();
+  BenchServer srv;
+  BenchRpcClient client;
+  client->getseq (channel);
+  if (!WaitForRoomJoins (joins + 1, TIMEOUT))
+    {
+      state.SkipWithError ("failed to join room");
+      return;
+    }
+
+  std::atomic<bool> stop(false);
+  std::thread reader([&] ()
+    {
+      PollChannels ({channel}, rec, stop);
+    });
+
+  for (auto _ : state)
+    {
+      for (unsigned i = 0; i < BATCH; ++i)
+        client->send (channel, xaya::EncodeBase64 (rec.Prepare (size)));
+      if (!rec.WaitForAll (TIMEOUT))
+        {
+          state.SkipWithError ("timeout waiting for messages");
+          break;
+        }
+    }
+
+  stop = true;
+  reader.join ();
+  rec.Report (state, size);
+}
+BENCHMARK (RpcServerThroughput)
+    ->Arg (32)->Arg (1'024)->Arg (16'384)
+    ->UseRealTime ()->Unit (benchmark::kMillisecond);
+
+/**
+ * Sends one message on each of many channels per iteration (with a single
+ * sendbatch call), with the number of channels as argument.  This also
+ * reports the memory used per channel in the server.
+ */
+void
+RpcServerChannels (benchmark::State& state)
+{
+  constexpr size_t size = 128;
+  const size_t num = state.range (0);
+  LatencyRecorder rec;
+
+  std::vector<std::string> channels;
+  for (size_t i = 0; i < num; ++i)
+    channels.push_back (NewChannelId ().ToHex ());
+
+  const uint64_t joins = GetRoomJoins ();
+  BenchServer srv;
+  BenchRpcClient client;
+
+  const size_t memBefore = GetResidentMemory ();
+  for (const auto& c : channels)
+    client->getseq (c);
+  if (!WaitForRoomJoins (joins + num, TIMEOUT))
+    {
+      state.SkipWithError ("failed to join rooms");
+      return;
+    }
+  const size_t memAfter = GetResidentMemory ();
+
+  std::atomic<bool> stop(false);
+  std::thread reader([&] ()
+    {
+      PollChannels (channels, rec, stop);
+    });
+
+  for (auto _ : state)
+    {
+      Json::Value batch(Json::arrayValue);
+      for (const auto& c : channels)
+        {
+          Json::Value item(Json::objectValue);
+          item["channel"] = c;
+          item["message"] = xaya::EncodeBase64 (rec.Prepare (size));
+          batch.append (item);
+        }
+      client->sendbatch (batch);
+
+      if (!rec.WaitForAll (TIMEOUT))
+        {
+          state.SkipWithError ("timeout waiting for messages");
+          break;
+        }
+    }
+
+  stop = true;
+  reader.join ();
+  rec.Report (state, size);
+  if (memAfter > memBefore)
+    state.counters["mem_per_channel"]
+        = static_cast<double> (memAfter - memBefore) / num;
+}
+BENCHMARK (RpcServerChannels)
+    ->RangeMultiplier (10)->Range (1, 10'000)
+    ->Iterations (10)->UseRealTime ()->Unit (benchmark::kMillisecond);
+
+} // anonymous namespace
+} // namespace xmppbroadcast
@@ -18,6 +18,8 @@
 
 #include "rpcserver.hpp"
 
+#include "metrics.hpp"
+
 #include "rpc-stubs/broadcastrpcclient.h"
 #include "testutils.hpp"
 #include "xmppbroadcast_tests.hpp"
@@ -25,6 +27,7 @@
 #include <gamechannel/rpcbroadcast.hpp>
 #include <xayautil/hash.hpp>
 
+#include <curl/curl.h>
 #include <json/json.h>
 #include <jsonrpccpp/client/connectors/httpclient.h>
 #include <jsonrpccpp/common/exception.h>
@@ -33,14 +36,20 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
 #include <sstream>
 #include <thread>
 
 namespace xmppbroadcast
 {
 
+DECLARE_int32 (xmppbroadcast_reactor_threads);
 DECLARE_int32 (xmppbroadcast_receive_timeout_ms);
+DECLARE_int32 (xmppbroadcast_rpc_max_requests);
 
 namespace
 {
@@ -48,6 +57,9 @@ namespace
 /** The port we use for the test server.  */
 constexpr int PORT = 29'183;
 
+/** The port we use for the test server's streaming endpoint.  */
+constexpr int STREAM_PORT = 29'184;
+
 /**
  * Returns the full endpoint of the local server.
  */
@@ -71,6 +83,81 @@ ParseJson (const std::string& str)
   return res;
 }
 
+/**
+ * Helper for reading lines from a subscription stream with curl.
+ */
+class StreamReader
+{
+
+private:
+
+  /** Data received but not yet split into lines.  */
+  std::string buffer;
+
+  /** The number of lines we want to receive.  */
+  const unsigned wanted;
+
+  /** The non-empty lines received so far, parsed as JSON.  */
+  std::vector<Json::Value> lines;
+
+  /**
+   * The curl write callback, which splits the data into lines.  It aborts
+   * the transfer once we have enough.
+   */
+  static size_t
+  Write (char* ptr, const size_t size, const size_t nmemb, void* user)
+  {
+    auto* self = static_cast<StreamReader*> (user);
+    self->buffer.append (ptr, size * nmemb);
+
+    while (true)
+      {
+        const auto pos = self->buffer.find ('\n');
+        if (pos == std::string::npos)
+          break;
+
+        const std::string line = self->buffer.substr (0, pos);
+        self->buffer.erase (0, pos + 1);
+        if (!line.empty ())
+          self->lines.push_back (ParseJson (line));
+      }
+
+    if (self->lines.size () >= self->wanted)
+      return 0;
+    return size * nmemb;
+  }
+
+public:
+
+  explicit StreamReader (const unsigned n)
+    : wanted(n)
+  {}
+
+  /**
+   * Subscribes to the stream with the given channels parameter, and reads
+   * until the wanted number of lines has been received.
+   */
+  std::vector<Json::Value>
+  Read (const std::string& channels)
+  {
+    std::ostringstream url;
+    url << "http://localhost:" << STREAM_PORT
+        << "/subscribe?channels=" << channels;
+
+    CURL* curl = curl_easy_init ();
+    CHECK (curl != nullptr);
+    curl_easy_setopt (curl, CURLOPT_URL, url.str ().c_str ());
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, &StreamReader::Write);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, this);
+    curl_easy_setopt (curl, CURLOPT_TIMEOUT_MS, 10'000L);
+    curl_easy_perform (curl);
+    curl_easy_cleanup (curl);
+
+    return lines;
+  }
+
+};
+
 /**
  * RpcBroadcast (from game channels) subclass that connects to our server
  * and stores received messages into a queue.
@@ -134,6 +221,7 @@ public:
                 GetServerConfig ().muc)
   {
     SetRootCA (GetTestCA ());
+    EnableStreaming (STREAM_PORT);
   }
 
   void
@@ -147,6 +235,14 @@ public:
 class RpcServerTests : public testing::Test
 {
 
+private:
+
+  /**
+   * Restores flags changed by a test.  This is declared first, so that
+   * it is destroyed last, after the server.
+   */
+  gflags::FlagSaver flags;
+
 protected:
 
   static const std::string id1;
@@ -227,6 +323,68 @@ TEST_F (RpcServerTests, Errors)
   })"));
 }
 
+TEST_F (RpcServerTests, OutOfRangeValues)
+{
+  srv.Start ();
+  client->send (id1, "Zm9v");
+  SleepSome ();
+
+  /* Sends a raw request and returns the parsed response.  */
+  jsonrpc::HttpClient http(GetEndpoint ());
+  const auto call = [&http] (const std::string& request)
+    {
+      std::string response;
+      http.SendRPCMessage (request, response);
+      return ParseJson (response);
+    };
+
+  /* Unsigned IDs above INT64_MAX are echoed back correctly.  */
+  auto res = call (R"({
+    "jsonrpc": "2.0",
+    "id": 18446744073709551615,
+    "method": "getseq",
+    "params": {"channel": ")" + id1 + R"("}
+  })");
+  EXPECT_EQ (res["id"].asUInt64 (), 18'446'744'073'709'551'615u);
+  EXPECT_EQ (res["result"], ParseJson (R"({"seq": 1})"));
+
+  /* IDs that do not fit into any integer type are not handled by the fast
+     path, but the server should still answer.  */
+  res = call (R"({
+    "jsonrpc": "2.0",
+    "id": 1e30,
+    "method": "getseq",
+    "params": {"channel": ")" + id1 + R"("}
+  })");
+  EXPECT_TRUE (res.isObject ());
+
+  /* Parameters above INT_MAX yield errors.  */
+  for (const std::string params :
+          {R"("fromseq": 3000000000)",
+           R"("fromseq": 0, "maxbytes": 3000000000,
+              "maxmessages": 0, "timeoutms": 0)",
+           R"("fromseq": 0, "maxbytes": 0,
+              "maxmessages": 0, "timeoutms": 18446744073709551615)"})
+    {
+      const std::string method
+          = (params.find ("maxbytes") == std::string::npos
+                ? "receive" : "receivepaged");
+      res = call (R"({
+        "jsonrpc": "2.0",
+        "id": 1,
+        "method": ")" + method + R"(",
+        "params": {"channel": ")" + id1 + R"(", )" + params + R"(}
+      })");
+      EXPECT_TRUE (res.isMember ("error")) << params;
+    }
+
+  /* Make sure the server is fine.  */
+  EXPECT_EQ (client->receive (id1, 0), ParseJson (R"({
+    "seq": 1,
+    "messages": ["Zm9v"]
+  })"));
+}
+
 TEST_F (RpcServerTests, BasicReceiving)
 {
   srv.Start ();
@@ -266,6 +424,49 @@ TEST_F (RpcServerTests, ReceiveWaits)
   sender.join ();
 }
 
+TEST_F (RpcServerTests, ReceivePaged)
+{
+  srv.Start ();
+
+  client->send (id1, "Zm9v");
+  client->send (id1, "YmFy");
+  client->send (id1, "YmF6");
+  SleepSome ();
+
+  EXPECT_EQ (client->receivepaged (id1, 0, 0, 2, -1), ParseJson (R"({
+    "seq": 2,
+    "messages": ["Zm9v", "YmFy"],
+    "more": true
+  })"));
+  EXPECT_EQ (client->receivepaged (id1, 1, 6, 0, -1), ParseJson (R"({
+    "seq": 2,
+    "messages": ["YmFy"],
+    "more": true
+  })"));
+  EXPECT_EQ (client->receivepaged (id1, 1, 0, 0, -1), ParseJson (R"({
+    "seq": 3,
+    "messages": ["YmFy", "YmF6"],
+    "more": false
+  })"));
+
+  /* A single message is returned even if it exceeds the byte limit.  */
+  EXPECT_EQ (client->receivepaged (id1, 2, 1, 0, -1), ParseJson (R"({
+    "seq": 3,
+    "messages": ["YmF6"],
+    "more": false
+  })"));
+
+  /* With a zero timeout, the call returns immediately.  */
+  const auto before = std::chrono::steady_clock::now ();
+  EXPECT_EQ (client->receivepaged (id1, 3, 0, 0, 0), ParseJson (R"({
+    "seq": 3,
+    "messages": [],
+    "more": false
+  })"));
+  EXPECT_LT (std::chrono::steady_clock::now () - before,
+             std::chrono::milliseconds (500));
+}
+
 TEST_F (RpcServerTests, MultipleChannels)
 {
   srv.Start ();
@@ -285,6 +486,264 @@ TEST_F (RpcServerTests, MultipleChannels)
   })"));
 }
 
+TEST_F (RpcServerTests, AdmissionControl)
+{
+  FLAGS_xmppbroadcast_receive_timeout_ms = 500;
+  FLAGS_xmppbroadcast_rpc_max_requests = 1;
+
+  srv.Start ();
+  EXPECT_EQ (client->getseq (id1), ParseJson (R"({"seq": 0})"));
+
+  /* This call blocks until the receive timeout, so that further calls
+     in the mean time get rejected.  */
+  std::thread blocker([] ()
+    {
+      TestRpcClient client2;
+      client2->receive (id1, 0);
+    });
+  std::this_thread::sleep_for (std::chrono::milliseconds (100));
+
+  EXPECT_THROW (client->getseq (id1), jsonrpc::JsonRpcException);
+  blocker.join ();
+
+  const auto stats = client->getstats ();
+  EXPECT_EQ (stats["requests"]["rejected"].asInt (), 1);
+  EXPECT_EQ (stats["requests"]["total"].asInt (), 4);
+  EXPECT_EQ (stats["requests"]["active"].asInt (), 1);
+}
+
+TEST_F (RpcServerTests, Metrics)
+{
+  srv.Start ();
+
+  client->send (id1, "Zm9v");
+  SleepSome ();
+  client->getseq (id1);
+
+  /* The metrics registry is global and thus also contains data from
+     other tests.  We just check that the expected metrics are there.  */
+  const std::string text = client->getmetrics ();
+  for (const std::string expected :
+          {"# TYPE xmppbroadcast_messages_sent_total counter",
+           "# TYPE xmppbroadcast_bytes_received_total counter",
+           "# TYPE xmppbroadcast_send_queue_depth gauge",
+           "# TYPE xmppbroadcast_room_join_seconds histogram",
+           "xmppbroadcast_rpc_duration_seconds_count{method=\"getseq\"}",
+           "xmppbroadcast_rpc_duration_seconds_count{method=\"send\"}"})
+    EXPECT_NE (text.find (expected), std::string::npos) << expected;
+}
+
+TEST_F (RpcServerTests, SendBatch)
+{
+  srv.Start ();
+
+  const auto results = client->sendbatch (ParseJson (R"([
+    {"channel": ")" + id1 + R"(", "message": "Zm9v"},
+    {"channel": ")" + id2 + R"(", "message": "YmFy"},
+    {"channel": ")" + id1 + R"(", "message": "invalid base64"},
+    {"channel": "x", "message": "Zm9v"},
+    {"channel": ")" + id1 + R"(", "message": "YmF6"},
+    42
+  ])"));
+  SleepSome ();
+
+  ASSERT_EQ (results.size (), 6);
+  EXPECT_TRUE (results[0]["success"].asBool ());
+  EXPECT_TRUE (results[1]["success"].asBool ());
+  EXPECT_FALSE (results[2]["success"].asBool ());
+  EXPECT_FALSE (results[3]["success"].asBool ());
+  EXPECT_TRUE (results[4]["success"].asBool ());
+  EXPECT_FALSE (results[5]["success"].asBool ());
+  EXPECT_TRUE (results[3]["error"].isString ());
+
+  EXPECT_EQ (client->receive (id1, 0), ParseJson (R"({
+    "seq": 2,
+    "messages": ["Zm9v", "YmF6"]
+  })"));
+  EXPECT_EQ (client->receive (id2, 0), ParseJson (R"({
+    "seq": 1,
+    "messages": ["YmFy"]
+  })"));
+}
+
+TEST_F (RpcServerTests, SendBatchMixedCase)
+{
+  srv.Start ();
+
+  /* Different spellings of the same channel are one group, so that
+     the order of its messages is kept.  */
+  std::string upper = id1;
+  std::transform (upper.begin (), upper.end (), upper.begin (),
+                  [] (const unsigned char c) { return std::toupper (c); });
+
+  const auto results = client->sendbatch (ParseJson (R"([
+    {"channel": ")" + upper + R"(", "message": "Zm9v"},
+    {"channel": ")" + id1 + R"(", "message": "YmFy"},
+    {"channel": ")" + upper + R"(", "message": "YmF6"}
+  ])"));
+  SleepSome ();
+
+  ASSERT_EQ (results.size (), 3);
+  for (const auto& r : results)
+    EXPECT_TRUE (r["success"].asBool ());
+
+  EXPECT_EQ (client->receive (id1, 0), ParseJson (R"({
+    "seq": 3,
+    "messages": ["Zm9v", "YmFy", "YmF6"]
+  })"));
+}
+
+TEST_F (RpcServerTests, SendAck)
+{
+  srv.Start ();
+
+  EXPECT_TRUE (client->sendack (id1, "Zm9v"));
+  EXPECT_THROW (client->sendack (id1, "invalid base64"),
+                jsonrpc::JsonRpcException);
+  EXPECT_THROW (client->sendack ("x", "Zm9v"), jsonrpc::JsonRpcException);
+
+  EXPECT_EQ (client->receive (id1, 0), ParseJson (R"({
+    "seq": 1,
+    "messages": ["Zm9v"]
+  })"));
+}
+
+TEST_F (RpcServerTests, SetWeight)
+{
+  srv.Start ();
+
+  /* Without the shared writer, weights have no effect.  */
+  EXPECT_FALSE (client->setweight (id1, 5));
+  EXPECT_THROW (client->setweight (id1, 0), jsonrpc::JsonRpcException);
+  EXPECT_THROW (client->setweight ("x", 1), jsonrpc::JsonRpcException);
+}
+
+TEST_F (RpcServerTests, ReactorMode)
+{
+  FLAGS_xmppbroadcast_reactor_threads = 1;
+  TestServer reactorSrv;
+  FLAGS_xmppbroadcast_reactor_threads = 0;
+  reactorSrv.Start ();
+
+  EXPECT_TRUE (client->sendack (id1, "Zm9v"));
+  client->send (id2, "YmFy");
+  EXPECT_EQ (client->receive (id2, 0), ParseJson (R"({
+    "seq": 1,
+    "messages": ["YmFy"]
+  })"));
+
+  /* Without a separate thread, the shutdown is done by Wait.  */
+  std::atomic<bool> started(false);
+  std::thread t([&] ()
+    {
+      started = true;
+      reactorSrv.Wait ();
+    });
+  while (!started)
+    SleepSome ();
+
+  try
+    {
+      client->stop ();
+    }
+  catch (const jsonrpc::JsonRpcException& exc)
+    {
+      LOG (WARNING) << "Ignoring RPC error on stop: " << exc.what ();
+    }
+
+  t.join ();
+}
+
+TEST_F (RpcServerTests, StreamSubscription)
+{
+  srv.Start ();
+
+  std::thread sender([] ()
+    {
+      TestRpcClient client2;
+      SleepSome ();
+      client2->send (id1, "Zm9v");
+      SleepSome ();
+      client2->send (id2, "YmFy");
+      SleepSome ();
+      client2->send (id1, "YmF6");
+    });
+
+  const auto lines = StreamReader (3).Read (id1 + ":0," + id2 + ":0");
+  sender.join ();
+
+  ASSERT_EQ (lines.size (), 3);
+  EXPECT_EQ (lines[0], ParseJson (R"({
+    "channel": ")" + id1 + R"(",
+    "seq": 1,
+    "messages": ["Zm9v"]
+  })"));
+  EXPECT_EQ (lines[1], ParseJson (R"({
+    "channel": ")" + id2 + R"(",
+    "seq": 1,
+    "messages": ["YmFy"]
+  })"));
+  EXPECT_EQ (lines[2], ParseJson (R"({
+    "channel": ")" + id1 + R"(",
+    "seq": 2,
+    "messages": ["YmF6"]
+  })"));
+}
+
+TEST_F (RpcServerTests, StreamResumption)
+{
+  srv.Start ();
+
+  client->send (id1, "Zm9v");
+  client->send (id1, "YmFy");
+  SleepSome ();
+
+  const auto lines = StreamReader (1).Read (id1 + ":1");
+  ASSERT_EQ (lines.size (), 1);
+  EXPECT_EQ (lines[0], ParseJson (R"({
+    "channel": ")" + id1 + R"(",
+    "seq": 2,
+    "messages": ["YmFy"]
+  })"));
+}
+
+TEST_F (RpcServerTests, StreamOnlyWakesWatchers)
+{
+  srv.Start ();
+
+  const Counter& wakeups = MetricsRegistry::Default ().GetCounter (
+      "xmppbroadcast_stream_wakeups_total",
+      "Number of times subscription streams were woken up by a"
+      " notification");
+
+  /* The subscription is only for id1, so the message on id2 must neither
+     produce a line for it nor wake it up at all.  */
+  uint64_t before, afterId2;
+  std::thread sender([&] ()
+    {
+      TestRpcClient client2;
+      SleepSome ();
+      before = wakeups.Get ();
+      client2->send (id2, "YmFy");
+      SleepSome ();
+      afterId2 = wakeups.Get ();
+      client2->send (id1, "Zm9v");
+    });
+
+  const auto lines = StreamReader (1).Read (id1);
+  sender.join ();
+
+  EXPECT_EQ (afterId2, before);
+  EXPECT_GT (wakeups.Get (), afterId2);
+
+  ASSERT_EQ (lines.size (), 1);
+  EXPECT_EQ (lines[0], ParseJson (R"({
+    "channel": ")" + id1 + R"(",
+    "seq": 1,
+    "messages": ["Zm9v"]
+  })"));
+}
+
 TEST_F (RpcServerTests, CompatibilityToXmppBroadcast)
 {
   /* This test connects a direct XmppBroadcast and a game-channel
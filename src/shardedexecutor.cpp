@@ -0,0 +1,390 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/shardedexecutor.hpp"
+
+#include "metrics.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace xmppbroadcast
+{
+
+/**
+ * A single shard of the executor, with its task queue, timers and thread.
+ */
+class ShardedExecutor::Shard
+{
+
+private:
+
+  /** A pending task together with its owner.  */
+  struct Entry
+  {
+
+    /** The owner, for cancellation.  */
+    const void* owner;
+
+    /** The time at which the task should have been run.  */
+    Clock::time_point due;
+
+    /** The task itself.  */
+    Task task;
+
+  };
+
+  /** Maximum number of tasks ready to run (zero for no limit).  */
+  const size_t capacity;
+
+  /** Lock for the state of this shard.  */
+  std::mutex mut;
+
+  /** Signalled when tasks or timers are added or we should stop.  */
+  std::condition_variable cvWork;
+
+  /**
+   * Signalled when tasks are taken from the queue or finish running,
+   * for threads waiting to post, cancel or flush.
+   */
+  std::condition_variable cvDone;
+
+  /** Tasks that are ready to run, in order.  */
+  std::deque<Entry> queue;
+
+  /** Timers that are not yet due, by their time.  */
+  std::multimap<Clock::time_point, Entry> timers;
+
+  /** Whether a task is being run at the moment.  */
+  bool busy = false;
+
+  /** Owner of the task being run at the moment (if busy).  */
+  const void* running = nullptr;
+
+  /**
+   * Incremented each time a task has finished running, so that Flush can
+   * wait for a particular task to be done.
+   */
+  uint64_t finished = 0;
+
+  /** Set to true when the thread should stop.  */
+  bool stop = false;
+
+  /**
+   * Owners for which Cancel is in progress.  Tasks posted for them
+   * (e.g. by their running task rescheduling itself) are dropped.
+   */
+  std::multiset<const void*> cancelling;
+
+  /** Metrics gauge for the number of tasks ready to run.  */
+  Gauge& depth;
+
+  /** Metrics gauge for the number of pending timers.  */
+  Gauge& pendingTimers;
+
+  /** Histogram of how late tasks are run compared to when they were due.  */
+  Histogram& lag;
+
+  /**
+   * Counter for posts that had to wait for space in the queue.  This is
+   * only registered if the queue is bounded.
+   */
+  Counter* blocked = nullptr;
+
+  /** The worker thread.  */
+  std::thread worker;
+
+  /**
+   * Runs the event loop.
+   */
+  void Run ();
+
+  /**
+   * Removes all pending tasks and timers of the given owner.  The lock
+   * must be held.
+   */
+  void RemoveOwner (const void* owner);
+
+public:
+
+  explicit Shard (const std::string& name, size_t index, size_t cap);
+  ~Shard ();
+
+  void PostAt (const void* owner, Clock::time_point time, Task task,
+               const std::function<bool ()>& cancelled);
+  void Cancel (const void* owner);
+  void Flush ();
+
+};
+
+ShardedExecutor::Shard::Shard (const std::string& name, const size_t index,
+                               const size_t cap)
+  : capacity(cap),
+    depth(MetricsRegistry::Default ().GetGauge (
+        "xmppbroadcast_" + name + "_queue_depth",
+        "Number of " + name + " tasks ready to run",
+        {{"shard", std::to_string (index)}})),
+    pendingTimers(MetricsRegistry::Default ().GetGauge (
+        "xmppbroadcast_" + name + "_timers",
+        "Number of " + name + " timers that are not yet due",
+        {{"shard", std::to_string (index)}})),
+    lag(MetricsRegistry::Default ().GetHistogram (
+        "xmppbroadcast_" + name + "_lag_seconds",
+        "Time " + name + " tasks were run later than they were due",
+        Histogram::LatencyBounds ()))
+{
+  if (capacity > 0)
+    blocked = &MetricsRegistry::Default ().GetCounter (
+        "xmppbroadcast_" + name + "_blocked_total",
+        "Number of times posting had to wait for a full " + name + " queue",
+        {{"shard", std::to_string (index)}});
+
+  /* Start the thread only once all members are initialised.  */
+  worker = std::thread ([this] () { Run (); });
+}
+
+ShardedExecutor::Shard::~Shard ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stop = true;
+    depth.Add (-static_cast<int64_t> (queue.size ()));
+    pendingTimers.Add (-static_cast<int64_t> (timers.size ()));
+    queue.clear ();
+    timers.clear ();
+    cvWork.notify_all ();
+    cvDone.notify_all ();
+  }
+  worker.join ();
+}
+
+void
+ShardedExecutor::Shard::Run ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (!stop)
+    {
+      /* Due timers are moved to the queue, so that they are run in order
+         with tasks posted directly.  They are not subject to the queue's
+         capacity, as nobody would wait for them.  */
+      const auto now = Clock::now ();
+      while (!timers.empty () && timers.begin ()->first <= now)
+        {
+          queue.push_back (std::move (timers.begin ()->second));
+          timers.erase (timers.begin ());
+          pendingTimers.Add (-1);
+          depth.Add (1);
+        }
+
+      if (queue.empty ())
+        {
+          /* The timer may be removed while we wait, so copy its time
+             instead of referencing it.  */
+          if (timers.empty ())
+            cvWork.wait (lock);
+          else
+            {
+              const Clock::time_point next = timers.begin ()->first;
+              cvWork.wait_until (lock, next);
+            }
+          continue;
+        }
+
+      Entry e = std::move (queue.front ());
+      queue.pop_front ();
+      depth.Add (-1);
+      busy = true;
+      running = e.owner;
+      cvDone.notify_all ();
+
+      lock.unlock ();
+      lag.ObserveDuration (Clock::now () - e.due);
+      e.task ();
+      /* Destruct the closure before signalling that it is done, since
+         it may hold references to the owner.  */
+      e.task = nullptr;
+      lock.lock ();
+
+      busy = false;
+      running = nullptr;
+      ++finished;
+      cvDone.notify_all ();
+    }
+}
+
+void
+ShardedExecutor::Shard::PostAt (const void* owner,
+                                const Clock::time_point time, Task task,
+                                const std::function<bool ()>& cancelled)
+{
+  const auto isCancelled = [this, owner, &cancelled] ()
+    {
+      return cancelling.count (owner) > 0
+                || (cancelled != nullptr && cancelled ());
+    };
+
+  std::unique_lock<std::mutex> lock(mut);
+  const bool ready = (time <= Clock::now ());
+
+  /* A task on this shard waiting for space would never get it, since
+     only it could make the queue shorter.  */
+  if (ready && capacity > 0 && queue.size () >= capacity
+        && std::this_thread::get_id () != worker.get_id ()
+        && !isCancelled ())
+    {
+      blocked->Increment ();
+      cvDone.wait (lock, [this, &isCancelled] ()
+        {
+          return stop || queue.size () < capacity || isCancelled ();
+        });
+    }
+  if (stop || isCancelled ())
+    return;
+
+  if (ready)
+    {
+      queue.push_back ({owner, time, std::move (task)});
+      depth.Add (1);
+    }
+  else
+    {
+      timers.emplace (time, Entry {owner, time, std::move (task)});
+      pendingTimers.Add (1);
+    }
+
+  cvWork.notify_one ();
+}
+
+void
+ShardedExecutor::Shard::RemoveOwner (const void* owner)
+{
+  const auto oldSize = queue.size ();
+  queue.erase (std::remove_if (queue.begin (), queue.end (),
+                               [owner] (const Entry& e)
+                                 {
+                                   return e.owner == owner;
+                                 }),
+               queue.end ());
+  depth.Add (-static_cast<int64_t> (oldSize - queue.size ()));
+
+  for (auto it = timers.begin (); it != timers.end (); )
+    if (it->second.owner == owner)
+      {
+        it = timers.erase (it);
+        pendingTimers.Add (-1);
+      }
+    else
+      ++it;
+}
+
+void
+ShardedExecutor::Shard::Cancel (const void* owner)
+{
+  std::unique_lock<std::mutex> lock(mut);
+  RemoveOwner (owner);
+
+  if (std::this_thread::get_id () == worker.get_id ())
+    {
+      cvDone.notify_all ();
+      return;
+    }
+
+  /* While we wait for a running task of the owner, it may try to post
+     more tasks for it (e.g. reschedule itself).  They are dropped, and
+     so are posts of it blocked on a full queue, which are woken up
+     here so that they see it.  */
+  const auto it = cancelling.insert (owner);
+  cvDone.notify_all ();
+  cvDone.wait (lock, [this, owner] ()
+    {
+      return !busy || running != owner;
+    });
+  cancelling.erase (it);
+}
+
+void
+ShardedExecutor::Shard::Flush ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  CHECK (std::this_thread::get_id () != worker.get_id ())
+      << "Flush called from a task on the same shard";
+
+  /* All currently queued tasks (and the running one) are done once
+     this many tasks have finished.  */
+  const uint64_t target
+      = finished + queue.size () + (busy ? 1 : 0);
+  cvDone.wait (lock, [this, target] ()
+    {
+      return stop || finished >= target;
+    });
+}
+
+/* ************************************************************************** */
+
+ShardedExecutor::ShardedExecutor (const std::string& name,
+                                  const size_t numShards,
+                                  const size_t capacity)
+{
+  CHECK_GT (numShards, 0);
+  for (size_t i = 0; i < numShards; ++i)
+    shards.push_back (std::make_unique<Shard> (name, i, capacity));
+}
+
+ShardedExecutor::~ShardedExecutor () = default;
+
+ShardedExecutor::Shard&
+ShardedExecutor::GetShard (const size_t key)
+{
+  return *shards[key % shards.size ()];
+}
+
+void
+ShardedExecutor::Post (const size_t key, const void* owner, Task task,
+                       const std::function<bool ()>& cancelled)
+{
+  GetShard (key).PostAt (owner, Clock::now (), std::move (task), cancelled);
+}
+
+void
+ShardedExecutor::PostAt (const size_t key, const void* owner,
+                         const Clock::time_point time, Task task)
+{
+  GetShard (key).PostAt (owner, time, std::move (task), nullptr);
+}
+
+void
+ShardedExecutor::Cancel (const size_t key, const void* owner)
+{
+  GetShard (key).Cancel (owner);
+}
+
+void
+ShardedExecutor::Flush (const size_t key)
+{
+  GetShard (key).Flush ();
+}
+
+} // namespace xmppbroadcast
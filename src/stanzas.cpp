@@ -20,13 +20,84 @@
 
 #include <charon/xmldata.hpp>
 
+#include <xayautil/base64.hpp>
+
 #include <glog/logging.h>
 
-#include <memory>
+#include <cstdlib>
+#include <limits>
 
 namespace xmppbroadcast
 {
 
+namespace
+{
+
+/** Attribute name for the sender timestamp.  */
+constexpr const char* ATTR_TIMESTAMP = "ts";
+
+/** Attribute name for the sender sequence number.  */
+constexpr const char* ATTR_SEQ = "seq";
+
+/** Attribute name for the fragmented message's ID.  */
+constexpr const char* ATTR_FRAGMENT_ID = "frag";
+
+/** Attribute name for the fragment index.  */
+constexpr const char* ATTR_FRAGMENT_INDEX = "fragidx";
+
+/** Attribute name for the number of fragments.  */
+constexpr const char* ATTR_FRAGMENT_COUNT = "fragcnt";
+
+/**
+ * Parses an unsigned integer attribute from the tag.  Returns false if
+ * it is missing or invalid.
+ */
+bool
+ParseUIntAttribute (const gloox::Tag& t, const std::string& name,
+                    uint64_t& val)
+{
+  if (!t.hasAttribute (name))
+    return false;
+
+  const std::string& str = t.findAttribute (name);
+  if (str.empty () || str[0] < '0' || str[0] > '9')
+    return false;
+
+  char* end;
+  val = std::strtoull (str.c_str (), &end, 10);
+  return *end == '\0';
+}
+
+/**
+ * Decodes the payload from a tag produced by charon::EncodeXmlPayload.
+ * The common forms, with a single <raw> or <base64> child, are handled
+ * directly here; everything else (e.g. compressed data) is passed on
+ * to charon's generic decoder.
+ */
+bool
+DecodePayload (const gloox::Tag& t, std::string& data)
+{
+  const auto& children = t.children ();
+  if (children.size () == 1)
+    {
+      const gloox::Tag& child = *children.front ();
+      if (child.children ().empty () && child.attributes ().empty ())
+        {
+          if (child.name () == "raw")
+            {
+              data = child.cdata ();
+              return true;
+            }
+          if (child.name () == "base64")
+            return xaya::DecodeBase64 (child.cdata (), data);
+        }
+    }
+
+  return charon::DecodeXmlPayload (t, data);
+}
+
+} // anonymous namespace
+
 constexpr const char* MessageStanza::TAG;
 
 MessageStanza::MessageStanza ()
@@ -40,7 +111,77 @@ MessageStanza::MessageStanza (const std::string& d)
 MessageStanza::MessageStanza (const gloox::Tag& t)
   : StanzaExtension(EXT_TYPE)
 {
-  valid = charon::DecodeXmlPayload (t, data);
+  valid = DecodePayload (t, data);
+  ParseTiming (t);
+  ParseFragment (t);
+}
+
+std::unique_ptr<MessageStanza>
+MessageStanza::Lazy (const gloox::Tag& t)
+{
+  auto res = std::make_unique<MessageStanza> ();
+  res->source = &t;
+  res->ParseTiming (t);
+  res->ParseFragment (t);
+  return res;
+}
+
+void
+MessageStanza::ParseTiming (const gloox::Tag& t)
+{
+  /* Invalid timing data does not invalidate the message itself, we just
+     ignore it in that case.  */
+  if (ParseUIntAttribute (t, ATTR_TIMESTAMP, timestamp)
+        && ParseUIntAttribute (t, ATTR_SEQ, senderSeq))
+    hasTiming = true;
+  else
+    {
+      hasTiming = false;
+      timestamp = 0;
+      senderSeq = 0;
+    }
+}
+
+void
+MessageStanza::ParseFragment (const gloox::Tag& t)
+{
+  hasFragment = false;
+  badFragment = false;
+  fragmentId = 0;
+  fragmentIndex = 0;
+  fragmentCount = 0;
+
+  if (!t.hasAttribute (ATTR_FRAGMENT_ID)
+        && !t.hasAttribute (ATTR_FRAGMENT_INDEX)
+        && !t.hasAttribute (ATTR_FRAGMENT_COUNT))
+    return;
+
+  /* Unlike the timing data, we can't just ignore broken fragment
+     attributes, as the payload is not a full message in that case.  */
+  uint64_t index, count;
+  if (!ParseUIntAttribute (t, ATTR_FRAGMENT_ID, fragmentId)
+        || !ParseUIntAttribute (t, ATTR_FRAGMENT_INDEX, index)
+        || !ParseUIntAttribute (t, ATTR_FRAGMENT_COUNT, count)
+        || count == 0 || index >= count
+        || count > std::numeric_limits<unsigned>::max ())
+    {
+      badFragment = true;
+      return;
+    }
+
+  hasFragment = true;
+  fragmentIndex = index;
+  fragmentCount = count;
+}
+
+void
+MessageStanza::Decode () const
+{
+  if (source == nullptr)
+    return;
+
+  valid = DecodePayload (*source, data);
+  source = nullptr;
 }
 
 const std::string&
@@ -54,15 +195,26 @@ MessageStanza::filterString () const
 gloox::StanzaExtension*
 MessageStanza::newInstance (const gloox::Tag* t) const
 {
-  return new MessageStanza (*t);
+  return Lazy (*t).release ();
 }
 
 gloox::StanzaExtension*
 MessageStanza::clone () const
 {
+  /* The clone may outlive our source tag, so decode now if not yet done.  */
+  Decode ();
+
   auto res = std::make_unique<MessageStanza> ();
   res->data = data;
   res->valid = valid;
+  res->hasTiming = hasTiming;
+  res->timestamp = timestamp;
+  res->senderSeq = senderSeq;
+  res->hasFragment = hasFragment;
+  res->badFragment = badFragment;
+  res->fragmentId = fragmentId;
+  res->fragmentIndex = fragmentIndex;
+  res->fragmentCount = fragmentCount;
   return res.release ();
 }
 
@@ -73,6 +225,17 @@ MessageStanza::tag () const
 
   auto res = charon::EncodeXmlPayload (TAG, data);
   res->setXmlns (XMLNS);
+  if (hasTiming)
+    {
+      res->addAttribute (ATTR_TIMESTAMP, std::to_string (timestamp));
+      res->addAttribute (ATTR_SEQ, std::to_string (senderSeq));
+    }
+  if (hasFragment)
+    {
+      res->addAttribute (ATTR_FRAGMENT_ID, std::to_string (fragmentId));
+      res->addAttribute (ATTR_FRAGMENT_INDEX, std::to_string (fragmentIndex));
+      res->addAttribute (ATTR_FRAGMENT_COUNT, std::to_string (fragmentCount));
+    }
 
   return res.release ();
 }
@@ -0,0 +1,254 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Microbenchmarks for encoding and decoding of MessageStanza, which
+   happens once per message sent and received.  The benchmarks cover
+   both the conversion to / from gloox::Tag alone and including the
+   serialisation to XML text and parsing it back.  */
+
+#include "private/stanzas.hpp"
+
+#include "benchutils.hpp"
+
+#include <charon/xmldata.hpp>
+
+#include <gloox/parser.h>
+#include <gloox/tag.h>
+#include <gloox/taghandler.h>
+
+#include <glog/logging.h>
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <string>
+
+namespace xmppbroadcast
+{
+namespace
+{
+
+/**
+ * Constructs a payload of the given size.  If binary is set, it contains
+ * arbitrary bytes; otherwise only printable ASCII characters that can be
+ * put into XML text directly.
+ */
+std::string
+GetPayload (const size_t size, const bool binary)
+{
+  std::string res(size, '\0');
+  for (size_t i = 0; i < size; ++i)
+    res[i] = static_cast<char> (binary ? i * 7 : 'a' + i % 26);
+  return res;
+}
+
+/**
+ * Sets the arguments for the stanza benchmarks, which are the payload size
+ * and whether or not the payload is binary.
+ */
+void
+StanzaArgs (benchmark::internal::Benchmark* b)
+{
+  b->ArgNames ({"size", "binary"});
+  for (const int binary : {0, 1})
+    for (const int size : {32, 1'024, 16'384, 262'144})
+      b->Args ({size, binary});
+}
+
+/**
+ * Constructs the stanza for a benchmark based on its arguments.
+ */
+MessageStanza
+GetStanza (const benchmark::State& state)
+{
+  return MessageStanza (GetPayload (state.range (0), state.range (1)));
+}
+
+/**
+ * Parser for XML text into a gloox::Tag.
+ */
+class TagParser : private gloox::TagHandler
+{
+
+private:
+
+  /** The parsed tag.  */
+  std::unique_ptr<gloox::Tag> result;
+
+  void
+  handleTag (gloox::Tag* t) override
+  {
+    result.reset (t);
+  }
+
+public:
+
+  /**
+   * Parses the given XML text.  Returns null if parsing failed.
+   */
+  std::unique_ptr<gloox::Tag>
+  Parse (std::string xml)
+  {
+    /* We take ownership of the tag in handleTag, so the parser must not
+       delete it.  */
+    gloox::Parser parser(this, false);
+    if (parser.feed (xml) >= 0)
+      return nullptr;
+    return std::move (result);
+  }
+
+};
+
+/**
+ * Finishes a stanza benchmark, reporting the bytes processed (the payload
+ * size) and allocations per iteration.
+ */
+void
+Report (benchmark::State& state, const AllocationCounter& allocs)
+{
+  state.SetBytesProcessed (state.iterations () * state.range (0));
+  allocs.Report (state);
+}
+
+void
+StanzaToTag (benchmark::State& state)
+{
+  const auto stanza = GetStanza (state);
+
+  AllocationCounter allocs;
+  for (auto _ : state)
+    {
+      std::unique_ptr<gloox::Tag> t(stanza.tag ());
+      benchmark::DoNotOptimize (t.get ());
+    }
+
+  Report (state, allocs);
+}
+BENCHMARK (StanzaToTag)->Apply (StanzaArgs);
+
+void
+StanzaToXml (benchmark::State& state)
+{
+  const auto stanza = GetStanza (state);
+
+  AllocationCounter allocs;
+  for (auto _ : state)
+    {
+      std::unique_ptr<gloox::Tag> t(stanza.tag ());
+      const std::string xml = t->xml ();
+      benchmark::DoNotOptimize (xml.data ());
+    }
+
+  Report (state, allocs);
+}
+BENCHMARK (StanzaToXml)->Apply (StanzaArgs);
+
+void
+StanzaFromTag (benchmark::State& state)
+{
+  const auto original = GetStanza (state);
+  std::unique_ptr<gloox::Tag> t(original.tag ());
+
+  AllocationCounter allocs;
+  for (auto _ : state)
+    {
+      MessageStanza stanza(*t);
+      CHECK (stanza.IsValid ());
+      benchmark::DoNotOptimize (stanza.GetData ().data ());
+    }
+
+  Report (state, allocs);
+}
+BENCHMARK (StanzaFromTag)->Apply (StanzaArgs);
+
+/**
+ * Decodes the payload with charon's generic decoder, as a baseline for
+ * the specialised decoding done in MessageStanza.
+ */
+void
+CharonDecode (benchmark::State& state)
+{
+  const auto original = GetStanza (state);
+  std::unique_ptr<gloox::Tag> t(original.tag ());
+
+  AllocationCounter allocs;
+  for (auto _ : state)
+    {
+      std::string data;
+      CHECK (charon::DecodeXmlPayload (*t, data));
+      benchmark::DoNotOptimize (data.data ());
+    }
+
+  Report (state, allocs);
+}
+BENCHMARK (CharonDecode)->Apply (StanzaArgs);
+
+/**
+ * Constructs stanzas as gloox does for received messages and accesses
+ * the payload (if the third argument is set) or drops them without it.
+ */
+void
+StanzaReceived (benchmark::State& state)
+{
+  const auto original = GetStanza (state);
+  std::unique_ptr<gloox::Tag> t(original.tag ());
+  const bool access = state.range (2);
+
+  AllocationCounter allocs;
+  for (auto _ : state)
+    {
+      std::unique_ptr<gloox::StanzaExtension> ext(
+          original.newInstance (t.get ()));
+      if (access)
+        {
+          const auto& msg = dynamic_cast<const MessageStanza&> (*ext);
+          CHECK (msg.IsValid ());
+          benchmark::DoNotOptimize (msg.GetData ().data ());
+        }
+    }
+
+  Report (state, allocs);
+}
+BENCHMARK (StanzaReceived)
+    ->ArgNames ({"size", "binary", "access"})
+    ->ArgsProduct ({{32, 16'384}, {0, 1}, {0, 1}});
+
+void
+StanzaFromXml (benchmark::State& state)
+{
+  const auto original = GetStanza (state);
+  std::unique_ptr<gloox::Tag> t(original.tag ());
+  const std::string xml = t->xml ();
+
+  TagParser parser;
+  AllocationCounter allocs;
+  for (auto _ : state)
+    {
+      const auto parsed = parser.Parse (xml);
+      CHECK (parsed != nullptr);
+      MessageStanza stanza(*parsed);
+      CHECK (stanza.IsValid ());
+      benchmark::DoNotOptimize (stanza.GetData ().data ());
+    }
+
+  Report (state, allocs);
+}
+BENCHMARK (StanzaFromXml)->Apply (StanzaArgs);
+
+} // anonymous namespace
+} // namespace xmppbroadcast
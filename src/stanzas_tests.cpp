@@ -18,8 +18,14 @@
 
 #include "private/stanzas.hpp"
 
+#include <charon/xmldata.hpp>
+
 #include <gtest/gtest.h>
 
+#include <memory>
+#include <string>
+#include <vector>
+
 namespace xmppbroadcast
 {
 namespace
@@ -37,6 +43,131 @@ TEST_F (StanzasTests, InvalidMessage)
   EXPECT_FALSE (s.IsValid ());
 }
 
+TEST_F (StanzasTests, LazyInvalidMessage)
+{
+  gloox::Tag t(MessageStanza::TAG);
+  t.setXmlns (XMLNS);
+  t.addChild (new gloox::Tag ("invalid", "foo"));
+
+  std::unique_ptr<gloox::StanzaExtension> parsed(
+      MessageStanza ().newInstance (&t));
+  const auto* msg = dynamic_cast<const MessageStanza*> (parsed.get ());
+  ASSERT_NE (msg, nullptr);
+  EXPECT_FALSE (msg->IsValid ());
+}
+
+TEST_F (StanzasTests, LazyDecoding)
+{
+  auto tag = std::make_unique<gloox::Tag> (MessageStanza::TAG);
+  tag->setXmlns (XMLNS);
+  auto* raw = new gloox::Tag (tag.get (), "raw", "old");
+  const auto msg = MessageStanza::Lazy (*tag);
+
+  /* The payload is only decoded when accessed, so changing the tag before
+     is reflected in the data.  */
+  raw->setCData ("new");
+  ASSERT_TRUE (msg->IsValid ());
+  EXPECT_EQ (msg->GetData (), "new");
+
+  /* After decoding, the tag is no longer needed.  */
+  tag.reset ();
+  EXPECT_EQ (msg->GetData (), "new");
+}
+
+TEST_F (StanzasTests, DecodingMatchesCharon)
+{
+  std::string binary;
+  for (int i = 0; i < 1'000; ++i)
+    binary.push_back (static_cast<char> (i * 7));
+
+  const std::vector<std::string> payloads =
+    {
+      "",
+      "foo bar",
+      "<tag> & \"quotes\"",
+      std::string ("a\0b", 3),
+      binary,
+      std::string (100'000, 'x'),
+    };
+
+  for (const auto& p : payloads)
+    {
+      const auto tag = charon::EncodeXmlPayload (MessageStanza::TAG, p);
+
+      std::string expected;
+      ASSERT_TRUE (charon::DecodeXmlPayload (*tag, expected));
+      ASSERT_EQ (expected, p);
+
+      const MessageStanza msg(*tag);
+      ASSERT_TRUE (msg.IsValid ());
+      EXPECT_EQ (msg.GetData (), p);
+    }
+}
+
+TEST_F (StanzasTests, MalformedDecodingMatchesCharon)
+{
+  /* Stanzas that are not produced by the encoder, including ones that
+     are close to the forms handled by our fast path but differ in some
+     detail.  For all of them, the result must match charon's decoder.  */
+  const auto withChild = [] (const std::string& name, const std::string& data)
+    {
+      auto res = std::make_unique<gloox::Tag> (MessageStanza::TAG);
+      res->setXmlns (XMLNS);
+      new gloox::Tag (res.get (), name, data);
+      return res;
+    };
+
+  std::vector<std::unique_ptr<gloox::Tag>> tags;
+
+  tags.push_back (withChild ("raw", "foo"));
+  tags.back ()->addAttribute ("extra", "attr");
+  tags.push_back (withChild ("raw", "foo"));
+  tags.back ()->setCData ("parent text");
+  tags.push_back (withChild ("raw", "foo"));
+  tags.back ()->children ().front ()->addAttribute ("extra", "attr");
+  tags.push_back (withChild ("base64", "Zm9v"));
+  tags.back ()->children ().front ()->addAttribute ("extra", "attr");
+  tags.push_back (withChild ("raw", "foo"));
+  new gloox::Tag (tags.back ()->children ().front (), "nested", "bar");
+  tags.push_back (withChild ("raw", "foo"));
+  new gloox::Tag (tags.back ().get (), "raw", "bar");
+  tags.push_back (withChild ("raw", "foo"));
+  new gloox::Tag (tags.back ().get (), "base64", "YmFy");
+  tags.push_back (withChild ("base64", "Zm9v"));
+  new gloox::Tag (tags.back ().get (), "raw", "bar");
+  tags.push_back (withChild ("base64", "!!!!"));
+  tags.push_back (withChild ("base64", "Zm9"));
+  tags.push_back (withChild ("base64", "Zm9v YmFy"));
+  tags.push_back (withChild ("base64", "Zm9v\nYmFy"));
+  tags.push_back (withChild ("base64", ""));
+  tags.push_back (withChild ("raw", ""));
+  tags.push_back (withChild ("zlib", "garbage"));
+  tags.push_back (withChild ("RAW", "foo"));
+
+  tags.push_back (std::make_unique<gloox::Tag> (MessageStanza::TAG));
+  tags.back ()->setXmlns (XMLNS);
+
+  for (const auto& t : tags)
+    {
+      std::string expected;
+      const bool ok = charon::DecodeXmlPayload (*t, expected);
+
+      const MessageStanza msg(*t);
+      ASSERT_EQ (msg.IsValid (), ok) << t->xml ();
+      if (ok)
+        {
+          EXPECT_EQ (msg.GetData (), expected) << t->xml ();
+        }
+
+      const auto lazy = MessageStanza::Lazy (*t);
+      ASSERT_EQ (lazy->IsValid (), ok) << t->xml ();
+      if (ok)
+        {
+          EXPECT_EQ (lazy->GetData (), expected) << t->xml ();
+        }
+    }
+}
+
 TEST_F (StanzasTests, MessageRoundtrip)
 {
   const MessageStanza original("payload");
@@ -54,6 +185,96 @@ TEST_F (StanzasTests, MessageRoundtrip)
   ASSERT_NE (cloned, nullptr);
   ASSERT_TRUE (cloned->IsValid ());
   ASSERT_EQ (cloned->GetData (), original.GetData ());
+  EXPECT_FALSE (cloned->HasTiming ());
+}
+
+TEST_F (StanzasTests, TimingRoundtrip)
+{
+  MessageStanza original("payload");
+  original.SetTiming (1'600'000'000'123'456, 42);
+
+  std::unique_ptr<gloox::Tag> tag(original.tag ());
+  EXPECT_EQ (tag->findAttribute ("ts"), "1600000000123456");
+  EXPECT_EQ (tag->findAttribute ("seq"), "42");
+
+  std::unique_ptr<gloox::StanzaExtension> parsed(
+      original.newInstance (tag.get ()));
+  std::unique_ptr<MessageStanza> cloned(
+      dynamic_cast<MessageStanza*> (parsed->clone ()));
+
+  ASSERT_NE (cloned, nullptr);
+  ASSERT_TRUE (cloned->IsValid ());
+  EXPECT_EQ (cloned->GetData (), "payload");
+  ASSERT_TRUE (cloned->HasTiming ());
+  EXPECT_EQ (cloned->GetTimestamp (), 1'600'000'000'123'456);
+  EXPECT_EQ (cloned->GetSenderSeq (), 42);
+}
+
+TEST_F (StanzasTests, InvalidTiming)
+{
+  const MessageStanza original("payload");
+  std::unique_ptr<gloox::Tag> tag(original.tag ());
+  tag->addAttribute ("ts", "-5");
+  tag->addAttribute ("seq", "10");
+
+  const MessageStanza parsed(*tag);
+  ASSERT_TRUE (parsed.IsValid ());
+  EXPECT_EQ (parsed.GetData (), "payload");
+  EXPECT_FALSE (parsed.HasTiming ());
+}
+
+TEST_F (StanzasTests, FragmentRoundtrip)
+{
+  MessageStanza original("part");
+  original.SetFragment (7, 2, 5);
+
+  std::unique_ptr<gloox::Tag> tag(original.tag ());
+  EXPECT_EQ (tag->findAttribute ("frag"), "7");
+  EXPECT_EQ (tag->findAttribute ("fragidx"), "2");
+  EXPECT_EQ (tag->findAttribute ("fragcnt"), "5");
+
+  std::unique_ptr<gloox::StanzaExtension> parsed(
+      original.newInstance (tag.get ()));
+  std::unique_ptr<MessageStanza> cloned(
+      dynamic_cast<MessageStanza*> (parsed->clone ()));
+
+  ASSERT_NE (cloned, nullptr);
+  ASSERT_TRUE (cloned->IsValid ());
+  EXPECT_EQ (cloned->GetData (), "part");
+  ASSERT_TRUE (cloned->IsFragment ());
+  EXPECT_EQ (cloned->GetFragmentId (), 7);
+  EXPECT_EQ (cloned->GetFragmentIndex (), 2);
+  EXPECT_EQ (cloned->GetFragmentCount (), 5);
+
+  const MessageStanza plain("payload");
+  tag.reset (plain.tag ());
+  EXPECT_FALSE (MessageStanza (*tag).IsFragment ());
+}
+
+TEST_F (StanzasTests, InvalidFragment)
+{
+  const MessageStanza original("payload");
+
+  for (const auto& attrs : std::vector<std::vector<std::string>> ({
+          {"1", "0", ""},
+          {"1", "", "2"},
+          {"x", "0", "2"},
+          {"1", "2", "2"},
+          {"1", "0", "0"},
+          {"1", "0", "99999999999"},
+       }))
+    {
+      std::unique_ptr<gloox::Tag> tag(original.tag ());
+      if (!attrs[0].empty ())
+        tag->addAttribute ("frag", attrs[0]);
+      if (!attrs[1].empty ())
+        tag->addAttribute ("fragidx", attrs[1]);
+      if (!attrs[2].empty ())
+        tag->addAttribute ("fragcnt", attrs[2]);
+
+      EXPECT_FALSE (MessageStanza (*tag).IsValid ());
+      EXPECT_FALSE (MessageStanza::Lazy (*tag)->IsValid ());
+    }
 }
 
 } // anonymous namespace
@@ -0,0 +1,504 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/streamserver.hpp"
+
+#include "metrics.hpp"
+#include "private/jsonwriter.hpp"
+
+#include <microhttpd.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace xmppbroadcast
+{
+
+DEFINE_int32 (xmppbroadcast_stream_keepalive_ms, 15'000,
+              "interval in milliseconds for keep-alive lines sent on idle"
+              " subscription streams");
+DEFINE_int32 (xmppbroadcast_stream_max_connections, 64,
+              "maximum number of concurrent connections to the stream"
+              " server (each holds a thread while open)");
+DEFINE_int32 (xmppbroadcast_stream_max_connections_per_ip, 16,
+              "maximum number of concurrent connections to the stream"
+              " server from a single IP address (0 for no limit)");
+
+/* ************************************************************************** */
+
+namespace
+{
+
+/**
+ * MHD changed the return type of its callbacks from int to an enum
+ * with version 0.9.71.
+ */
+#if MHD_VERSION >= 0x00097002
+using MhdResult = MHD_Result;
+#else
+using MhdResult = int;
+#endif
+
+/** Block size for the chunked stream responses.  */
+constexpr size_t BLOCK_SIZE = 4'096;
+
+/**
+ * Returns the key for a channel ID in the watchers map, which is the
+ * hex ID in lower case.
+ */
+std::string
+WatcherKey (std::string channel)
+{
+  for (auto& c : channel)
+    c = std::tolower (static_cast<unsigned char> (c));
+  return channel;
+}
+
+/**
+ * Queues a plain-text error response on the given connection.
+ */
+bool
+QueueError (MHD_Connection* conn, const unsigned status,
+            const std::string& msg)
+{
+  auto* resp = MHD_create_response_from_buffer (
+      msg.size (), const_cast<char*> (msg.data ()), MHD_RESPMEM_MUST_COPY);
+  if (resp == nullptr)
+    return false;
+
+  const auto res = MHD_queue_response (conn, status, resp);
+  MHD_destroy_response (resp);
+
+  return res == MHD_YES;
+}
+
+/**
+ * Queues a response with the current metrics in Prometheus text format.
+ */
+bool
+QueueMetrics (MHD_Connection* conn)
+{
+  const std::string text = MetricsRegistry::Default ().ToPrometheusText ();
+  auto* resp = MHD_create_response_from_buffer (
+      text.size (), const_cast<char*> (text.data ()), MHD_RESPMEM_MUST_COPY);
+  if (resp == nullptr)
+    return false;
+
+  MHD_add_response_header (resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+                           "text/plain; version=0.0.4");
+  const auto res = MHD_queue_response (conn, MHD_HTTP_OK, resp);
+  MHD_destroy_response (resp);
+
+  return res == MHD_YES;
+}
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+/**
+ * The state of one subscribed stream, i.e. the channels it is for and
+ * the output that is pending to be written to the client.
+ */
+class StreamServer::Subscription
+{
+
+private:
+
+  /** One channel that we are subscribed to.  */
+  struct Entry
+  {
+
+    /** The channel ID as hex string.  */
+    std::string channel;
+
+    /** The sequence number up to which messages have been streamed.  */
+    size_t seq;
+
+  };
+
+  /** The server this belongs to.  */
+  StreamServer& server;
+
+  /** The channels in this subscription.  */
+  std::vector<Entry> channels;
+
+  /** Output data that has not yet been passed on to MHD.  */
+  std::string output;
+
+  /** The part of output that has already been passed on.  */
+  size_t offset = 0;
+
+  /**
+   * Counter that is incremented (with the server's lock held) every time
+   * new messages may be available on one of our channels.  It is used
+   * to detect changes while we were not waiting.
+   */
+  uint64_t generation = 0;
+
+  /** Condition variable signalled when generation or stopping change.  */
+  std::condition_variable cv;
+
+  friend class StreamServer;
+
+public:
+
+  explicit Subscription (StreamServer& s)
+    : server(s)
+  {}
+
+  ~Subscription ()
+  {
+    server.RemoveWatcher (*this);
+  }
+
+  Subscription () = delete;
+  Subscription (const Subscription&) = delete;
+  void operator= (const Subscription&) = delete;
+
+  /**
+   * Parses the channels parameter of a subscription request and fills in
+   * the entries.  Returns false (and sets an error message) if it is
+   * invalid or a channel cannot be accessed.
+   */
+  bool ParseChannels (const std::string& param, std::string& error);
+
+  /**
+   * Fetches new messages for all channels and appends them to the output
+   * buffer.  Returns true if there were any.
+   */
+  bool Poll ();
+
+  /**
+   * Reads up to max bytes of output into buf, waiting for new messages
+   * if needed.  This is the MHD content reader callback.
+   */
+  ssize_t Read (char* buf, size_t max);
+
+};
+
+bool
+StreamServer::Subscription::ParseChannels (const std::string& param,
+                                           std::string& error)
+{
+  std::istringstream in(param);
+  std::string item;
+  while (std::getline (in, item, ','))
+    {
+      Entry e;
+
+      const auto colon = item.find (':');
+      e.channel = item.substr (0, colon);
+      if (!server.source.GetSequenceNumber (e.channel, e.seq))
+        {
+          error = "invalid channel: " + e.channel;
+          return false;
+        }
+
+      if (colon != std::string::npos)
+        {
+          const std::string seqStr = item.substr (colon + 1);
+          char* end;
+          e.seq = std::strtoull (seqStr.c_str (), &end, 10);
+          if (seqStr.empty () || *end != '\0')
+            {
+              error = "invalid sequence number: " + seqStr;
+              return false;
+            }
+        }
+
+      channels.push_back (std::move (e));
+    }
+
+  if (channels.empty ())
+    {
+      error = "no channels given";
+      return false;
+    }
+
+  return true;
+}
+
+bool
+StreamServer::Subscription::Poll ()
+{
+  bool found = false;
+  for (auto& e : channels)
+    {
+      std::vector<std::string> messages;
+      if (!server.source.Fetch (e.channel, e.seq, messages)
+            || messages.empty ())
+        continue;
+
+      JsonWriter w(output);
+      w.BeginObject ();
+      w.Key ("channel");
+      w.String (e.channel);
+      w.Key ("messages");
+      w.BeginArray ();
+      for (const auto& m : messages)
+        w.Base64 (m);
+      w.EndArray ();
+      w.Key ("seq");
+      w.UInt (e.seq);
+      w.EndObject ();
+      output += '\n';
+      found = true;
+    }
+
+  return found;
+}
+
+ssize_t
+StreamServer::Subscription::Read (char* buf, const size_t max)
+{
+  if (offset == output.size ())
+    {
+      output.clear ();
+      offset = 0;
+      if (!server.FillOutput (*this))
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+
+  const size_t n = std::min (max, output.size () - offset);
+  std::memcpy (buf, output.data () + offset, n);
+  offset += n;
+
+  return n;
+}
+
+/* ************************************************************************** */
+
+/**
+ * The static callback functions we pass to MHD.  They just forward to
+ * the actual StreamServer / Subscription instances.
+ */
+struct MhdCallbacks
+{
+
+  static MhdResult
+  AccessHandler (void* cls, MHD_Connection* conn,
+                 const char* url, const char* method, const char* version,
+                 const char* uploadData, size_t* uploadDataSize, void** con)
+  {
+    auto* srv = static_cast<StreamServer*> (cls);
+    return srv->HandleRequest (conn, url, method) ? MHD_YES : MHD_NO;
+  }
+
+  static ssize_t
+  ContentReader (void* cls, const uint64_t pos, char* buf, const size_t max)
+  {
+    return static_cast<StreamServer::Subscription*> (cls)->Read (buf, max);
+  }
+
+  static void
+  FreeSubscription (void* cls)
+  {
+    delete static_cast<StreamServer::Subscription*> (cls);
+  }
+
+};
+
+StreamServer::StreamServer (Source& s, const int port, const bool onlyLocal)
+  : source(s),
+    wakeups(MetricsRegistry::Default ().GetCounter (
+        "xmppbroadcast_stream_wakeups_total",
+        "Number of times subscription streams were woken up by a"
+        " notification"))
+{
+  /* Each subscription blocks its connection thread while waiting for
+     new messages, so we need one thread per connection.  Thus the number
+     of connections is limited, so that clients cannot exhaust threads.  */
+  const unsigned flags
+      = MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD;
+
+  const int maxConnections = FLAGS_xmppbroadcast_stream_max_connections;
+  const int maxPerIp
+      = std::max (FLAGS_xmppbroadcast_stream_max_connections_per_ip, 0);
+  CHECK_GT (maxConnections, 0);
+
+  std::vector<MHD_OptionItem> options;
+  options.push_back ({MHD_OPTION_CONNECTION_LIMIT, maxConnections, nullptr});
+  options.push_back ({MHD_OPTION_PER_IP_CONNECTION_LIMIT, maxPerIp, nullptr});
+
+  struct sockaddr_in addr;
+  if (onlyLocal)
+    {
+      std::memset (&addr, 0, sizeof (addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons (port);
+      addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      options.push_back ({MHD_OPTION_SOCK_ADDR, 0, &addr});
+    }
+  options.push_back ({MHD_OPTION_END, 0, nullptr});
+
+  daemon = MHD_start_daemon (flags, port, nullptr, nullptr,
+                             &MhdCallbacks::AccessHandler, this,
+                             MHD_OPTION_ARRAY, options.data (),
+                             MHD_OPTION_END);
+
+  if (daemon == nullptr)
+    throw std::runtime_error ("failed to start the stream server");
+
+  LOG (INFO) << "Started stream server on port " << port;
+}
+
+StreamServer::~StreamServer ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stopping = true;
+    for (auto& entry : watchers)
+      entry.second->cv.notify_all ();
+  }
+
+  /* This waits for all connection threads to finish.  Since we set the
+     stopping flag, all waiting subscriptions will end their streams.  */
+  MHD_stop_daemon (daemon);
+}
+
+void
+StreamServer::AddWatcher (Subscription& sub)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  for (const auto& e : sub.channels)
+    watchers.emplace (WatcherKey (e.channel), &sub);
+}
+
+void
+StreamServer::RemoveWatcher (Subscription& sub)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  for (const auto& e : sub.channels)
+    {
+      const auto range = watchers.equal_range (WatcherKey (e.channel));
+      for (auto it = range.first; it != range.second; )
+        if (it->second == &sub)
+          it = watchers.erase (it);
+        else
+          ++it;
+    }
+}
+
+void
+StreamServer::Notify (const std::string& channel)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  const auto range = watchers.equal_range (WatcherKey (channel));
+  for (auto it = range.first; it != range.second; ++it)
+    {
+      ++it->second->generation;
+      it->second->cv.notify_all ();
+    }
+}
+
+bool
+StreamServer::FillOutput (Subscription& sub)
+{
+  const auto keepAlive
+      = std::chrono::milliseconds (FLAGS_xmppbroadcast_stream_keepalive_ms);
+  const auto deadline = std::chrono::steady_clock::now () + keepAlive;
+
+  std::unique_lock<std::mutex> lock(mut);
+  while (!stopping)
+    {
+      /* We fetch messages without holding the lock, and use the generation
+         counter to detect if new messages arrived in the mean time.  */
+      const uint64_t gen = sub.generation;
+      lock.unlock ();
+      const bool found = sub.Poll ();
+      lock.lock ();
+
+      if (found)
+        return true;
+
+      const bool signalled = sub.cv.wait_until (lock, deadline, [&] ()
+        {
+          return stopping || sub.generation != gen;
+        });
+      if (!signalled)
+        {
+          sub.output = "\n";
+          return true;
+        }
+      if (!stopping)
+        wakeups.Increment ();
+    }
+
+  return false;
+}
+
+bool
+StreamServer::HandleRequest (MHD_Connection* conn,
+                             const std::string& url, const std::string& method)
+{
+  if (method != MHD_HTTP_METHOD_GET)
+    return QueueError (conn, MHD_HTTP_METHOD_NOT_ALLOWED,
+                       "only GET is supported");
+  if (url == "/metrics")
+    return QueueMetrics (conn);
+  if (url != "/subscribe")
+    return QueueError (conn, MHD_HTTP_NOT_FOUND, "unknown endpoint");
+
+  const char* channels
+      = MHD_lookup_connection_value (conn, MHD_GET_ARGUMENT_KIND, "channels");
+  if (channels == nullptr)
+    return QueueError (conn, MHD_HTTP_BAD_REQUEST, "no channels given");
+
+  auto sub = std::make_unique<Subscription> (*this);
+  std::string error;
+  if (!sub->ParseChannels (channels, error))
+    return QueueError (conn, MHD_HTTP_BAD_REQUEST, error);
+
+  VLOG (1)
+      << "New subscription for " << sub->channels.size () << " channels";
+  AddWatcher (*sub);
+
+  auto* resp = MHD_create_response_from_callback (
+      MHD_SIZE_UNKNOWN, BLOCK_SIZE,
+      &MhdCallbacks::ContentReader, sub.get (),
+      &MhdCallbacks::FreeSubscription);
+  if (resp == nullptr)
+    return false;
+  /* The response owns the subscription now, and frees it through
+     the callback when done.  */
+  sub.release ();
+
+  MHD_add_response_header (resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+                           "application/x-ndjson");
+  const auto res = MHD_queue_response (conn, MHD_HTTP_OK, resp);
+  MHD_destroy_response (resp);
+
+  return res == MHD_YES;
+}
+
+/* ************************************************************************** */
+
+} // namespace xmppbroadcast
@@ -18,11 +18,22 @@
 
 #include "xmppbroadcast.hpp"
 
+#include "metrics.hpp"
 #include "private/mucclient.hpp"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 /* Windows systems define a GetMessage macro, which makes this file fail to
    compile because of SendMessage in OffChainBroadcast.  */
@@ -31,42 +42,478 @@
 namespace xmppbroadcast
 {
 
+DEFINE_int32 (xmppbroadcast_coalesce_ms, 0,
+              "If positive, received messages are collected for this many"
+              " milliseconds and then processed in one batch");
+DEFINE_bool (xmppbroadcast_coalesce_newest_only, false,
+             "With coalescing, only process the last message of each"
+             " batch and drop the older ones");
+DEFINE_bool (xmppbroadcast_share_connections, false,
+             "If true, XmppBroadcast instances with the same account,"
+             " server and game ID share a single XMPP connection");
+
 namespace
 {
 
 /**
- * Custom channel implementation that just forwards received messages
- * to a callback closure.
+ * Helper that collects received messages and delivers them in batches
+ * on its own thread.  When the first message arrives, it waits for the
+ * coalescing window so that more can be collected.  Messages that arrive
+ * while a batch is being processed are delivered together afterwards.
+ */
+class Coalescer
+{
+
+public:
+
+  using Callback = std::function<void (const std::vector<std::string>&)>;
+
+private:
+
+  /** The callback for delivering batches.  */
+  const Callback deliver;
+
+  /** The time to wait for more messages after the first one.  */
+  const std::chrono::milliseconds window;
+
+  /** Lock for the state here.  */
+  std::mutex mut;
+
+  /** Signalled when messages are added or we should stop.  */
+  std::condition_variable cv;
+
+  /** Messages waiting to be delivered.  */
+  std::vector<std::string> pending;
+
+  /** Set to true when the thread should stop.  */
+  bool stop = false;
+
+  /** Counter of batches delivered.  */
+  Counter& batches;
+
+  /** Counter of messages dropped in newest-only mode.  */
+  Counter& dropped;
+
+  /** The thread delivering batches.  */
+  std::thread worker;
+
+  /**
+   * Runs the loop delivering batches.
+   */
+  void Run ();
+
+  /**
+   * Reduces a batch before delivery by applying the newest-only mode.
+   * Without it, the batch is returned unchanged.
+   */
+  std::vector<std::string> Reduce (std::vector<std::string> batch);
+
+public:
+
+  explicit Coalescer (const Callback& cb, std::chrono::milliseconds w);
+
+  /**
+   * Stops the thread.  Messages not yet delivered are dropped.
+   */
+  ~Coalescer ();
+
+  Coalescer () = delete;
+  Coalescer (const Coalescer&) = delete;
+  void operator= (const Coalescer&) = delete;
+
+  /**
+   * Adds a received message.
+   */
+  void Add (const std::string& msg);
+
+};
+
+Coalescer::Coalescer (const Callback& cb, const std::chrono::milliseconds w)
+  : deliver(cb), window(w),
+    batches(MetricsRegistry::Default ().GetCounter (
+        "xmppbroadcast_coalesced_batches_total",
+        "Number of batches of received messages delivered")),
+    dropped(MetricsRegistry::Default ().GetCounter (
+        "xmppbroadcast_coalesced_dropped_total",
+        "Number of received messages dropped when coalescing")),
+    worker([this] () { Run (); })
+{}
+
+Coalescer::~Coalescer ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stop = true;
+    cv.notify_all ();
+  }
+  worker.join ();
+}
+
+void
+Coalescer::Add (const std::string& msg)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  pending.push_back (msg);
+  cv.notify_all ();
+}
+
+std::vector<std::string>
+Coalescer::Reduce (std::vector<std::string> batch)
+{
+  const size_t original = batch.size ();
+
+  if (FLAGS_xmppbroadcast_coalesce_newest_only)
+    batch.erase (batch.begin (), batch.end () - 1);
+
+  dropped.Increment (original - batch.size ());
+  return batch;
+}
+
+void
+Coalescer::Run ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (true)
+    {
+      cv.wait (lock, [this] () { return stop || !pending.empty (); });
+      if (stop)
+        break;
+
+      /* Wait for more messages to arrive within the window.  */
+      cv.wait_for (lock, window, [this] () { return stop; });
+      if (stop)
+        break;
+
+      std::vector<std::string> batch;
+      batch.swap (pending);
+      lock.unlock ();
+
+      VLOG (1) << "Delivering batch of " << batch.size () << " messages";
+      batches.Increment ();
+      deliver (Reduce (std::move (batch)));
+
+      lock.lock ();
+    }
+}
+
+class BcClient;
+
+/**
+ * Custom channel implementation that forwards received messages
+ * to the receivers registered with the client.
  */
 class BcChannel : public MucClient::Channel
 {
 
 private:
 
-  /** The callback for received messages.  */
-  std::function<void (const std::string&)> cb;
+  /** The client this belongs to.  */
+  BcClient& client;
+
+  /** The room's JID.  */
+  const gloox::JID room;
 
 protected:
 
-  void
-  MessageReceived (const std::string& msg) override
+  void MessageReceived (const std::string& msg) override;
+
+public:
+
+  explicit BcChannel (BcClient& c, const gloox::JID& j);
+
+};
+
+/**
+ * The MucClient used by XmppBroadcast.  With -xmppbroadcast_share_connections,
+ * one instance (and thus one XMPP connection) is shared by all broadcasts
+ * with the same account, server and game ID.  Each of them registers a
+ * receiver for its channel, to which messages received in the corresponding
+ * room are forwarded.  The client connects and runs a refresher for as long
+ * as it exists.
+ */
+class BcClient : public TypedMucClient<BcChannel>
+{
+
+public:
+
+  using Callback = std::function<void (const std::string&)>;
+
+private:
+
+  /** A receiver registered for a channel.  */
+  struct Receiver
   {
-    if (cb)
-      cb (msg);
-  }
+
+    /** The channel ID this is for.  */
+    xaya::uint256 id;
+
+    /**
+     * Lock held while invoking the callback, so that unregistering can
+     * wait for a call in progress.
+     */
+    std::mutex mut;
+
+    /** The callback, which is cleared when unregistering.  */
+    Callback cb;
+
+  };
 
 public:
 
-  explicit BcChannel (MucClient& c, const gloox::JID& j,
-                      const std::function<void (const std::string&)>& r)
-    : Channel(c, j), cb(r)
-  {}
+  /**
+   * Handle for a registered receiver.  It is only used to unregister it
+   * again later.
+   */
+  using Handle = std::shared_ptr<Receiver>;
+
+private:
+
+  /** Registered receivers by bare room JID.  */
+  std::map<std::string, std::vector<Handle>> receivers;
+
+  /** Lock for the receivers map.  */
+  std::mutex mutReceivers;
+
+  /** The refresher for this client, once started.  */
+  std::unique_ptr<Refresher> refresher;
+
+  /**
+   * Forwards a message received in the given room to all receivers
+   * registered for it.
+   */
+  void Dispatch (const gloox::JID& room, const std::string& msg);
+
+  /**
+   * Returns true if there are receivers registered for the given channel.
+   */
+  bool HasReceivers (const xaya::uint256& id);
+
+  friend class BcChannel;
+
+protected:
+
+  std::unique_ptr<BcChannel> CreateTypedChannel (const gloox::JID& j) override;
+
+public:
+
+  using TypedMucClient::TypedMucClient;
+
+  /**
+   * Disconnects before our members are destroyed, so that channels
+   * no longer dispatch messages to the receivers.
+   */
+  ~BcClient ()
+  {
+    refresher.reset ();
+    Disconnect ();
+  }
+
+  /**
+   * Connects and starts the refresher.  If connecting fails, the refresher
+   * will keep trying.
+   */
+  void Start ();
+
+  /**
+   * Registers a receiver for the given channel and joins its room
+   * (if connected; otherwise this is done by the refresher).
+   */
+  Handle Register (const xaya::uint256& id, const Callback& cb);
+
+  /**
+   * Unregisters a receiver.  Once this returns, its callback will not be
+   * invoked anymore.  If it was the last one for its channel (and no new
+   * one has been registered in the mean time), the room is left.
+   */
+  void Unregister (const Handle& h);
+
+  /**
+   * When refreshed, also make sure to explicitly instantiate the channels
+   * of all receivers, so we join them again after a reconnect.
+   */
+  void Refresh () override;
 
 };
 
+void
+BcClient::Dispatch (const gloox::JID& room, const std::string& msg)
+{
+  std::vector<Handle> targets;
+  {
+    std::lock_guard<std::mutex> lock(mutReceivers);
+    const auto mit = receivers.find (room.bare ());
+    if (mit == receivers.end ())
+      return;
+    targets = mit->second;
+  }
+
+  for (const auto& r : targets)
+    {
+      std::lock_guard<std::mutex> lock(r->mut);
+      if (r->cb)
+        r->cb (msg);
+    }
+}
+
+BcChannel::BcChannel (BcClient& c, const gloox::JID& j)
+  : Channel(c, j), client(c), room(j)
+{}
+
+void
+BcChannel::MessageReceived (const std::string& msg)
+{
+  client.Dispatch (room, msg);
+}
+
+std::unique_ptr<BcChannel>
+BcClient::CreateTypedChannel (const gloox::JID& j)
+{
+  return std::make_unique<BcChannel> (*this, j);
+}
+
+void
+BcClient::Start ()
+{
+  CHECK (refresher == nullptr) << "BcClient is already started";
+
+  if (!Connect ())
+    LOG (WARNING) << "Failed with initial client connect, will keep trying";
+  refresher = std::make_unique<Refresher> (*this);
+}
+
+BcClient::Handle
+BcClient::Register (const xaya::uint256& id, const Callback& cb)
+{
+  auto res = std::make_shared<Receiver> ();
+  res->id = id;
+  res->cb = cb;
+
+  {
+    std::lock_guard<std::mutex> lock(mutReceivers);
+    receivers[GetRoomJid (id).bare ()].push_back (res);
+  }
+
+  GetChannel (id);
+  return res;
+}
+
+void
+BcClient::Unregister (const Handle& h)
+{
+  bool last;
+  {
+    std::lock_guard<std::mutex> lock(mutReceivers);
+    const auto mit = receivers.find (GetRoomJid (h->id).bare ());
+    CHECK (mit != receivers.end ());
+    auto& list = mit->second;
+    list.erase (std::remove (list.begin (), list.end (), h), list.end ());
+    last = list.empty ();
+    if (last)
+      receivers.erase (mit);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(h->mut);
+    h->cb = nullptr;
+  }
+
+  if (last)
+    RemoveChannelIf (h->id, [this, &h] () { return !HasReceivers (h->id); });
+}
+
+void
+BcClient::Refresh ()
+{
+  MucClient::Refresh ();
+
+  std::vector<xaya::uint256> ids;
+  {
+    std::lock_guard<std::mutex> lock(mutReceivers);
+    for (const auto& entry : receivers)
+      ids.push_back (entry.second.front ()->id);
+  }
+
+  /* The last receiver of a channel may be unregistered (and its channel
+     removed) after we took the snapshot.  Thus check again after joining,
+     and remove the channel if it is no longer needed.  The check is done
+     under the client's lock for channels, so that it cannot race with
+     a new receiver being registered and joining.  */
+  for (const auto& id : ids)
+    {
+      GetChannel (id);
+      RemoveChannelIf (id, [this, &id] () { return !HasReceivers (id); });
+    }
+}
+
+bool
+BcClient::HasReceivers (const xaya::uint256& id)
+{
+  std::lock_guard<std::mutex> lock(mutReceivers);
+  return receivers.count (GetRoomJid (id).bare ()) > 0;
+}
+
+/**
+ * Returns a started client for the given account and configuration.
+ * If connections are shared, this returns an existing client for
+ * the same JID, password, server, root CA and game ID if there is one.
+ * Otherwise a new one is created.
+ */
+std::shared_ptr<BcClient>
+AcquireClient (const std::string& gameId, const std::string& jid,
+               const std::string& password, const std::string& mucServer,
+               const std::string& rootCA)
+{
+  const auto create = [&] ()
+    {
+      auto res = std::make_shared<BcClient> (gameId, gloox::JID (jid),
+                                             password, mucServer);
+      if (!rootCA.empty ())
+        res->SetRootCA (rootCA);
+      return res;
+    };
+
+  if (!FLAGS_xmppbroadcast_share_connections)
+    {
+      auto res = create ();
+      res->Start ();
+      return res;
+    }
+
+  using Key = std::tuple<std::string, std::string, std::string,
+                         std::string, std::string>;
+  static std::mutex mut;
+  static std::map<Key, std::weak_ptr<BcClient>> clients;
+
+  std::shared_ptr<BcClient> res;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    for (auto it = clients.begin (); it != clients.end (); )
+      if (it->second.expired ())
+        it = clients.erase (it);
+      else
+        ++it;
+
+    auto& entry = clients[Key (jid, password, mucServer, rootCA, gameId)];
+    res = entry.lock ();
+    if (res != nullptr)
+      return res;
+
+    res = create ();
+    entry = res;
+  }
+
+  /* Connecting may take a while, so do it without holding the lock.
+     Others acquiring the client in the mean time can already register
+     receivers, and their channels will be joined by the refresher.  */
+  LOG (INFO) << "Creating shared XMPP client for " << jid;
+  res->Start ();
+  return res;
+}
+
 } // anonymous namespace
 
-class XmppBroadcast::Impl : public MucClient
+class XmppBroadcast::Impl
 {
 
 private:
@@ -74,45 +521,102 @@ private:
   /** The main broadcast instance this belongs to.  */
   XmppBroadcast& bc;
 
-  /** Refresher for the client, if it is running.  */
-  std::unique_ptr<Refresher> refresher;
+  /* Configuration of the XMPP connection.  */
+  const std::string gameId;
+  const std::string jid;
+  const std::string password;
+  const std::string mucServer;
+  std::string rootCA;
 
-  friend class XmppBroadcast;
+  /** The client used while started.  */
+  std::shared_ptr<BcClient> client;
 
-protected:
+  /** Our receiver registered with the client.  */
+  BcClient::Handle receiver;
+
+  /**
+   * If coalescing is enabled, the instance doing it.  It is created
+   * before registering our receiver and destroyed after unregistering,
+   * so that it exists while messages may be received.
+   */
+  std::unique_ptr<Coalescer> coalescer;
 
-  std::unique_ptr<Channel> CreateChannel (const gloox::JID& j) override;
+  friend class XmppBroadcast;
 
 public:
 
-  explicit Impl (XmppBroadcast& b, const std::string& gameId,
-                 const gloox::JID& jid, const std::string& password,
+  explicit Impl (XmppBroadcast& b, const std::string& g,
+                 const std::string& j, const std::string& pwd,
                  const std::string& muc)
-    : MucClient(gameId, jid, password, muc), bc(b)
+    : bc(b), gameId(g), jid(j), password(pwd), mucServer(muc)
   {}
 
-  /**
-   * When refreshed, also make sure to explicitly instantiate the channel
-   * so we join it again after a reconnect.
-   */
-  void
-  Refresh () override
+  ~Impl ()
   {
-    MucClient::Refresh ();
-    GetChannel<BcChannel> (bc.GetChannelId ());
+    Stop ();
   }
 
+  /**
+   * Acquires the client and registers our receiver.
+   */
+  void Start ();
+
+  /**
+   * Unregisters from the client and releases it.
+   */
+  void Stop ();
+
+  /**
+   * Returns our channel, or null if it is not available.
+   */
+  BcChannel* GetChannel ();
+
 };
 
-std::unique_ptr<MucClient::Channel>
-XmppBroadcast::Impl::CreateChannel (const gloox::JID& j)
+void
+XmppBroadcast::Impl::Start ()
 {
-  return std::make_unique<BcChannel> (*this, j, [this] (const std::string& m)
+  CHECK (client == nullptr) << "XmppBroadcast is already started";
+
+  if (FLAGS_xmppbroadcast_coalesce_ms > 0)
+    coalescer = std::make_unique<Coalescer> (
+        [this] (const std::vector<std::string>& msgs)
+          {
+            bc.FeedMessages (msgs);
+          },
+        std::chrono::milliseconds (FLAGS_xmppbroadcast_coalesce_ms));
+
+  client = AcquireClient (gameId, jid, password, mucServer, rootCA);
+  receiver = client->Register (bc.GetChannelId (), [this] (const std::string& m)
     {
-      bc.FeedMessage (m);
+      if (coalescer != nullptr)
+        coalescer->Add (m);
+      else
+        bc.FeedMessage (m);
     });
 }
 
+void
+XmppBroadcast::Impl::Stop ()
+{
+  if (client != nullptr)
+    {
+      client->Unregister (receiver);
+      receiver.reset ();
+      client.reset ();
+    }
+
+  coalescer.reset ();
+}
+
+BcChannel*
+XmppBroadcast::Impl::GetChannel ()
+{
+  if (client == nullptr)
+    return nullptr;
+  return client->GetChannel (bc.GetChannelId ());
+}
+
 XmppBroadcast::XmppBroadcast (
     xaya::SynchronisedChannelManager& cm,
     const std::string& gameId,
@@ -138,7 +642,7 @@ XmppBroadcast::~XmppBroadcast () = default;
 void
 XmppBroadcast::SendMessage (const std::string& msg)
 {
-  auto* c = impl->GetChannel<BcChannel> (GetChannelId ());
+  auto* c = impl->GetChannel ();
   if (c == nullptr)
     {
       LOG (WARNING) << "Cannot send message, disconnected?";
@@ -147,29 +651,55 @@ XmppBroadcast::SendMessage (const std::string& msg)
   c->Send (msg);
 }
 
+std::future<bool>
+XmppBroadcast::SendMessageWithAck (const std::string& msg)
+{
+  auto* c = impl->GetChannel ();
+  if (c == nullptr)
+    {
+      LOG (WARNING) << "Cannot send message, disconnected?";
+      std::promise<bool> failed;
+      failed.set_value (false);
+      return failed.get_future ();
+    }
+  return c->SendWithAck (msg);
+}
+
+bool
+XmppBroadcast::SetSendWeight (const unsigned weight)
+{
+  if (impl->client == nullptr)
+    return false;
+  return impl->client->SetChannelWeight (GetChannelId (), weight);
+}
+
+void
+XmppBroadcast::FeedMessages (const std::vector<std::string>& msgs)
+{
+  for (const auto& m : msgs)
+    FeedMessage (m);
+}
+
 void
 XmppBroadcast::SetRootCA (const std::string& path)
 {
-  CHECK (!impl->IsConnected ()) << "XmppBroadcast is already connected";
-  impl->SetRootCA (path);
+  CHECK (impl->client == nullptr) << "XmppBroadcast is already started";
+  impl->rootCA = path;
 }
 
 void
 XmppBroadcast::Start ()
 {
-  if (!impl->Connect ())
-    LOG (WARNING) << "Failed with initial client connect, will keep trying";
-  impl->refresher = std::make_unique<MucClient::Refresher> (*impl);
+  impl->Start ();
 
-  /* The refresher will execute immediately, which ensures that we instantiate
-     the channel once to join it.  */
+  /* The client's refresher (or registering) makes sure that we join
+     the channel's room, also after reconnects.  */
 }
 
 void
 XmppBroadcast::Stop ()
 {
-  impl->refresher.reset ();
-  impl->Disconnect ();
+  impl->Stop ();
 }
 
 } // namespace xmppbroadcast
@@ -22,8 +22,10 @@
 #include <gamechannel/recvbroadcast.hpp>
 #include <gamechannel/syncmanager.hpp>
 
+#include <future>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace xmppbroadcast
 {
@@ -55,6 +57,15 @@ protected:
 
   void SendMessage (const std::string& msg) override;
 
+  /**
+   * Processes a batch of received messages (in the order received).  This is
+   * used instead of FeedMessage if coalescing of received messages is
+   * enabled with -xmppbroadcast_coalesce_ms.  By default, it just feeds
+   * each message.  Subclasses can override it to handle batches
+   * more efficiently.
+   */
+  virtual void FeedMessages (const std::vector<std::string>& msgs);
+
 public:
 
   explicit XmppBroadcast (
@@ -72,6 +83,22 @@ public:
    */
   void SetRootCA (const std::string& path);
 
+  /**
+   * Sends a message like SendMessage, but returns a future that tells
+   * whether or not it has been delivered to the XMPP room.  It becomes
+   * true once the room reflects the message back to us, and false
+   * if that does not happen in time or we are disconnected.
+   */
+  std::future<bool> SendMessageWithAck (const std::string& msg);
+
+  /**
+   * Sets the weight of this channel for scheduling sent messages on
+   * a connection shared with other channels (see
+   * MucClient::SetChannelWeight).  Returns false if that is not possible,
+   * e.g. because the broadcast is not started.
+   */
+  bool SetSendWeight (unsigned weight);
+
   /* We use our own custom start/stop, which connects the XMPP client
      and runs a refresher.  The XMPP receiving thread will push messages
      to us, which we feed back to OffChainBroadcast.  */
@@ -0,0 +1,444 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* End-to-end benchmarks for XmppBroadcast and the underlying MucClient,
+   sending messages through the local XMPP test server (or the in-process
+   loopback transport, to measure the client overhead alone).  */
+
+#include "xmppbroadcast.hpp"
+
+#include "benchutils.hpp"
+#include "metrics.hpp"
+#include "private/loopbacktransport.hpp"
+#include "private/mucclient.hpp"
+#include "testutils.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <gflags/gflags.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* See xmppbroadcast.cpp.  */
+#undef SendMessage
+
+namespace xmppbroadcast
+{
+
+DECLARE_int32 (xmppbroadcast_flush_window_us);
+
+namespace
+{
+
+/** Number of messages sent per iteration in the throughput benchmarks.  */
+constexpr unsigned BATCH = 100;
+
+/** Timeout for receiving all messages or joining rooms.  */
+constexpr auto TIMEOUT = std::chrono::seconds (60);
+
+/**
+ * XmppBroadcast instance used in the benchmarks, which passes received
+ * messages on to a LatencyRecorder (if there is one).
+ */
+class BenchXmppBroadcast : public XmppBroadcast
+{
+
+private:
+
+  /** The recorder for received messages, if any.  */
+  LatencyRecorder* rec;
+
+protected:
+
+  void
+  FeedMessage (const std::string& msg) override
+  {
+    if (rec != nullptr)
+      rec->Received (msg);
+  }
+
+public:
+
+  explicit BenchXmppBroadcast (const unsigned n, const xaya::uint256& id,
+                               LatencyRecorder* r)
+    : XmppBroadcast(id, "bench",
+                    GetTestJid (n).full (), GetPassword (n),
+                    GetServerConfig ().muc),
+      rec(r)
+  {
+    SetRootCA (GetTestCA ());
+    Start ();
+  }
+
+  ~BenchXmppBroadcast ()
+  {
+    Stop ();
+  }
+
+  using XmppBroadcast::SendMessage;
+
+};
+
+/**
+ * Sends messages from one XmppBroadcast to another through the same
+ * channel, with the payload size as argument.
+ */
+void
+XmppBroadcastThroughput (benchmark::State& state)
+{
+  const size_t size = state.range (0);
+  const auto id = NewChannelId ();
+  LatencyRecorder rec;
+
+  const uint64_t joins = GetRoomJoins ();
+  BenchXmppBroadcast sender(0, id, nullptr);
+  BenchXmppBroadcast receiver(1, id, &rec);
+  if (!WaitForRoomJoins (joins + 2, TIMEOUT))
+    {
+      state.SkipWithError ("failed to join rooms");
+      return;
+    }
+
+  for (auto _ : state)
+    {
+      for (unsigned i = 0; i < BATCH; ++i)
+        sender.SendMessage (rec.Prepare (size));
+      if (!rec.WaitForAll (TIMEOUT))
+        {
+          state.SkipWithError ("timeout waiting for messages");
+          break;
+        }
+    }
+
+  rec.Report (state, size);
+}
+BENCHMARK (XmppBroadcastThroughput)
+    ->Arg (32)->Arg (1'024)->Arg (16'384)
+    ->UseRealTime ()->Unit (benchmark::kMillisecond);
+
+/* ************************************************************************** */
+
+/**
+ * MUC channel that passes received messages on to a LatencyRecorder.
+ */
+class BenchChannel : public MucClient::Channel
+{
+
+private:
+
+  /** The recorder for received messages, if any.  */
+  LatencyRecorder* rec;
+
+protected:
+
+  void
+  MessageReceived (const std::string& msg) override
+  {
+    if (rec != nullptr)
+      rec->Received (msg);
+  }
+
+public:
+
+  explicit BenchChannel (MucClient& c, const gloox::JID& j,
+                         LatencyRecorder* r)
+    : Channel(c, j), rec(r)
+  {}
+
+};
+
+/**
+ * MUC client using BenchChannel instances.
+ */
+class BenchClient : public TypedMucClient<BenchChannel>
+{
+
+private:
+
+  /** The recorder passed on to channels.  */
+  LatencyRecorder* rec;
+
+protected:
+
+  std::unique_ptr<BenchChannel>
+  CreateTypedChannel (const gloox::JID& j) override
+  {
+    return std::make_unique<BenchChannel> (*this, j, rec);
+  }
+
+public:
+
+  explicit BenchClient (const unsigned n, LatencyRecorder* r)
+    : TypedMucClient("bench", GetTestJid (n), GetPassword (n),
+                     GetServerConfig ().muc),
+      rec(r)
+  {
+    SetRootCA (GetTestCA ());
+  }
+
+  explicit BenchClient (LoopbackNetwork& net, LatencyRecorder* r)
+    : TypedMucClient("bench", std::make_unique<LoopbackTransport> (net),
+                     GetServerConfig ().muc),
+      rec(r)
+  {}
+
+};
+
+/**
+ * Sends messages between two MucClient instances on the in-process loopback
+ * transport, with the payload size as argument.  This measures the overhead
+ * of the client itself (stanza encoding, queues and threads) without
+ * the network and XMPP server.
+ */
+void
+MucClientLoopbackThroughput (benchmark::State& state)
+{
+  const size_t size = state.range (0);
+  const auto id = NewChannelId ();
+
+  LatencyRecorder rec;
+  LoopbackNetwork net;
+  BenchClient sender(net, nullptr);
+  BenchClient receiver(net, &rec);
+  if (!sender.Connect () || !receiver.Connect ())
+    {
+      state.SkipWithError ("failed to connect");
+      return;
+    }
+
+  const uint64_t joins = GetRoomJoins ();
+  auto* channel = sender.GetChannel (id);
+  receiver.GetChannel (id);
+  if (channel == nullptr || !WaitForRoomJoins (joins + 2, TIMEOUT))
+    {
+      state.SkipWithError ("failed to join rooms");
+      return;
+    }
+
+  for (auto _ : state)
+    {
+      for (unsigned i = 0; i < BATCH; ++i)
+        channel->Send (rec.Prepare (size));
+      if (!rec.WaitForAll (TIMEOUT))
+        {
+          state.SkipWithError ("timeout waiting for messages");
+          break;
+        }
+    }
+
+  rec.Report (state, size);
+}
+BENCHMARK (MucClientLoopbackThroughput)
+    ->Arg (32)->Arg (1'024)->Arg (16'384)
+    ->UseRealTime ()->Unit (benchmark::kMicrosecond);
+
+/**
+ * Sends messages one by one between two MucClient instances on the loopback
+ * transport, to show the throughput / latency tradeoff of the adaptive
+ * flush window.  The first argument is the flush window in microseconds,
+ * the second the gap between sending messages (zero for sending them
+ * back-to-back, and otherwise in microseconds to simulate sparse traffic).
+ * The fraction of messages for which the sender held back its batch
+ * is reported as well.
+ */
+void
+MucClientFlushWindow (benchmark::State& state)
+{
+  constexpr size_t size = 128;
+  const int window = state.range (0);
+  const std::chrono::microseconds gap(state.range (1));
+  const auto id = NewChannelId ();
+
+  LatencyRecorder rec;
+  LoopbackNetwork net;
+  const int oldWindow = FLAGS_xmppbroadcast_flush_window_us;
+  FLAGS_xmppbroadcast_flush_window_us = window;
+  BenchClient sender(net, nullptr);
+  FLAGS_xmppbroadcast_flush_window_us = oldWindow;
+  BenchClient receiver(net, &rec);
+  if (!sender.Connect () || !receiver.Connect ())
+    {
+      state.SkipWithError ("failed to connect");
+      return;
+    }
+
+  const uint64_t joins = GetRoomJoins ();
+  auto* channel = sender.GetChannel (id);
+  receiver.GetChannel (id);
+  if (channel == nullptr || !WaitForRoomJoins (joins + 2, TIMEOUT))
+    {
+      state.SkipWithError ("failed to join rooms");
+      return;
+    }
+
+  for (auto _ : state)
+    {
+      for (unsigned i = 0; i < BATCH; ++i)
+        {
+          channel->Send (rec.Prepare (size));
+          if (gap.count () > 0)
+            std::this_thread::sleep_for (gap);
+        }
+      if (!rec.WaitForAll (TIMEOUT))
+        {
+          state.SkipWithError ("timeout waiting for messages");
+          break;
+        }
+    }
+
+  rec.Report (state, size);
+  const auto& held = MetricsRegistry::Default ().GetCounter (
+      "xmppbroadcast_flushes_held_total", "",
+      {{"room", "bench_" + id.ToHex ()}});
+  state.counters["held_per_msg"]
+      = static_cast<double> (held.Get ()) / (state.iterations () * BATCH);
+}
+BENCHMARK (MucClientFlushWindow)
+    ->ArgNames ({"window_us", "gap_us"})
+    ->ArgsProduct ({{0, 100, 500}, {0, 1'000}})
+    ->UseRealTime ()->Unit (benchmark::kMillisecond);
+
+/**
+ * Looks up existing channels on a client, with the number of channels
+ * as first argument.  The second argument selects between the statically
+ * typed lookup of TypedMucClient and the generic MucClient::GetChannel
+ * with its dynamic_cast and check.
+ */
+void
+MucClientLookup (benchmark::State& state)
+{
+  const size_t num = state.range (0);
+  const bool typed = state.range (1);
+
+  LoopbackNetwork net;
+  BenchClient client(net, nullptr);
+  if (!client.Connect ())
+    {
+      state.SkipWithError ("failed to connect");
+      return;
+    }
+
+  std::vector<xaya::uint256> ids;
+  for (size_t i = 0; i < num; ++i)
+    {
+      ids.push_back (NewChannelId ());
+      if (client.GetChannel (ids.back ()) == nullptr)
+        {
+          state.SkipWithError ("failed to create channel");
+          return;
+        }
+    }
+
+  AllocationCounter allocs;
+  size_t next = 0;
+  for (auto _ : state)
+    {
+      const auto& id = ids[next++ % num];
+      BenchChannel* c;
+      if (typed)
+        c = client.GetChannel (id);
+      else
+        c = client.MucClient::GetChannel<BenchChannel> (id);
+      benchmark::DoNotOptimize (c);
+    }
+
+  allocs.Report (state);
+}
+BENCHMARK (MucClientLookup)
+    ->ArgNames ({"channels", "typed"})
+    ->ArgsProduct ({{1, 1'000}, {0, 1}});
+
+/**
+ * Sends one message on each of many channels per iteration, with the
+ * number of channels as argument.  This also reports the memory used
+ * per joined channel on the receiving side.
+ */
+void
+MucClientChannels (benchmark::State& state)
+{
+  constexpr size_t size = 128;
+  const size_t num = state.range (0);
+
+  LatencyRecorder rec;
+  BenchClient sender(0, nullptr);
+  BenchClient receiver(1, &rec);
+  if (!sender.Connect () || !receiver.Connect ())
+    {
+      state.SkipWithError ("failed to connect");
+      return;
+    }
+
+  std::vector<xaya::uint256> ids;
+  for (size_t i = 0; i < num; ++i)
+    ids.push_back (NewChannelId ());
+
+  uint64_t joins = GetRoomJoins ();
+  std::vector<BenchChannel*> channels;
+  for (const auto& id : ids)
+    {
+      auto* c = sender.GetChannel (id);
+      if (c == nullptr)
+        {
+          state.SkipWithError ("failed to create channel");
+          return;
+        }
+      channels.push_back (c);
+    }
+  if (!WaitForRoomJoins (joins + num, TIMEOUT))
+    {
+      state.SkipWithError ("failed to join rooms");
+      return;
+    }
+
+  joins = GetRoomJoins ();
+  const size_t memBefore = GetResidentMemory ();
+  for (const auto& id : ids)
+    receiver.GetChannel (id);
+  if (!WaitForRoomJoins (joins + num, TIMEOUT))
+    {
+      state.SkipWithError ("failed to join rooms");
+      return;
+    }
+  const size_t memAfter = GetResidentMemory ();
+
+  for (auto _ : state)
+    {
+      for (auto* c : channels)
+        c->Send (rec.Prepare (size));
+      if (!rec.WaitForAll (TIMEOUT))
+        {
+          state.SkipWithError ("timeout waiting for messages");
+          break;
+        }
+    }
+
+  rec.Report (state, size);
+  if (memAfter > memBefore)
+    state.counters["mem_per_channel"]
+        = static_cast<double> (memAfter - memBefore) / num;
+}
+BENCHMARK (MucClientChannels)
+    ->RangeMultiplier (10)->Range (1, 10'000)
+    ->Iterations (10)->UseRealTime ()->Unit (benchmark::kMillisecond);
+
+} // anonymous namespace
+} // namespace xmppbroadcast
@@ -20,12 +20,19 @@
 
 #include <xayautil/hash.hpp>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include <memory>
+
 namespace xmppbroadcast
 {
 
+DECLARE_int32 (xmppbroadcast_coalesce_ms);
+DECLARE_bool (xmppbroadcast_coalesce_newest_only);
+DECLARE_bool (xmppbroadcast_share_connections);
+
 TestXmppBroadcast::TestXmppBroadcast (const unsigned n, const xaya::uint256& id)
   : TestBroadcast<XmppBroadcast>(
         id, "test",
@@ -42,6 +49,11 @@ namespace
 class XmppBroadcastTests : public testing::Test
 {
 
+private:
+
+  /** Restores all flags a test (or fixture) changes when it is done.  */
+  gflags::FlagSaver flags;
+
 protected:
 
   static const xaya::uint256 id1;
@@ -102,5 +114,122 @@ TEST_F (XmppBroadcastTests, IntermittentStop)
   bc1.ExpectMessages ({"foo", "bar"});
 }
 
+/**
+ * Test fixture with coalescing enabled for broadcasts created in it.
+ * The window is long enough that messages sent in one go end up in
+ * the same batch.
+ */
+class XmppBroadcastCoalescingTests : public XmppBroadcastTests
+{
+
+protected:
+
+  XmppBroadcastCoalescingTests ()
+  {
+    FLAGS_xmppbroadcast_coalesce_ms = 500;
+  }
+
+};
+
+TEST_F (XmppBroadcastCoalescingTests, Batches)
+{
+  TestXmppBroadcast bc1(0, id1);
+  TestXmppBroadcast bc2(1, id1);
+  SleepSome ();
+
+  bc1.SendMessage ("foo");
+  bc1.SendMessage ("bar");
+  bc1.SendMessage ("foo");
+  bc1.SendMessage ("baz");
+
+  /* Repeated messages within a batch are all passed on.  */
+  bc2.ExpectMessages ({"foo", "bar", "foo", "baz"});
+  bc1.ExpectMessages ({"foo", "bar", "foo", "baz"});
+}
+
+TEST_F (XmppBroadcastCoalescingTests, NewestOnly)
+{
+  FLAGS_xmppbroadcast_coalesce_newest_only = true;
+
+  TestXmppBroadcast bc1(0, id1);
+  TestXmppBroadcast bc2(1, id1);
+  SleepSome ();
+
+  bc1.SendMessage ("foo");
+  bc1.SendMessage ("bar");
+  bc1.SendMessage ("baz");
+  bc2.ExpectMessages ({"baz"});
+
+  bc1.SendMessage ("next");
+  bc2.ExpectMessages ({"next"});
+}
+
+/**
+ * Test fixture with shared connections enabled.
+ */
+class XmppBroadcastSharingTests : public XmppBroadcastTests
+{
+
+protected:
+
+  XmppBroadcastSharingTests ()
+  {
+    FLAGS_xmppbroadcast_share_connections = true;
+  }
+
+};
+
+TEST_F (XmppBroadcastSharingTests, MultipleChannels)
+{
+  TestXmppBroadcast bc1(0, id1);
+  TestXmppBroadcast bc2(0, id2);
+  TestXmppBroadcast other(1, id1);
+  SleepSome ();
+
+  bc1.SendMessage ("foo");
+  bc2.SendMessage ("bar");
+  other.SendMessage ("baz");
+
+  bc1.ExpectMessages ({"foo", "baz"});
+  bc2.ExpectMessages ({"bar"});
+  other.ExpectMessages ({"foo", "baz"});
+}
+
+TEST_F (XmppBroadcastSharingTests, SameChannel)
+{
+  TestXmppBroadcast bc1(0, id1);
+  TestXmppBroadcast bc2(0, id1);
+  SleepSome ();
+
+  bc1.SendMessage ("foo");
+  bc1.ExpectMessages ({"foo"});
+  bc2.ExpectMessages ({"foo"});
+}
+
+TEST_F (XmppBroadcastSharingTests, IndependentLifetimes)
+{
+  auto bc1 = std::make_unique<TestXmppBroadcast> (0, id1);
+  TestXmppBroadcast bc2(0, id2);
+  TestXmppBroadcast other(1, id1);
+  SleepSome ();
+
+  /* Destroying one instance leaves its room, but keeps the shared
+     connection for the other.  */
+  bc1.reset ();
+  SleepSome ();
+
+  bc2.SendMessage ("foo");
+  bc2.ExpectMessages ({"foo"});
+  other.SendMessage ("bar");
+  other.ExpectMessages ({"bar"});
+
+  bc2.Stop ();
+  bc2.Start ();
+  SleepSome ();
+
+  bc2.SendMessage ("baz");
+  bc2.ExpectMessages ({"baz"});
+}
+
 } // anonymous namespace
 } // namespace xmppbroadcast
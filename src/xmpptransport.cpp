@@ -0,0 +1,259 @@
+/*
+    xmppbroadcast - XMPP communication for game channels
+    Copyright (C) 2021  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/xmpptransport.hpp"
+
+#include <gloox/message.h>
+#include <gloox/mucroom.h>
+#include <gloox/mucroomhandler.h>
+
+#include <glog/logging.h>
+
+namespace xmppbroadcast
+{
+
+/* ************************************************************************** */
+
+/**
+ * A room joined through XMPP.  This wraps the gloox room and translates
+ * its callbacks to the RoomHandler interface.
+ */
+class XmppTransport::XmppRoom : public MucTransport::Room,
+                                private gloox::MUCRoomHandler
+{
+
+private:
+
+  /** The transport this room belongs to.  */
+  XmppTransport& transport;
+
+  /** The handler for events in this room.  */
+  RoomHandler& handler;
+
+  /** The gloox room handle.  */
+  std::unique_ptr<gloox::MUCRoom> room;
+
+  void handleMUCError (gloox::MUCRoom* r, gloox::StanzaError) override;
+  bool handleMUCRoomCreation (gloox::MUCRoom* r) override;
+  void handleMUCMessage (gloox::MUCRoom* r, const gloox::Message& msg,
+                         bool priv) override;
+  void handleMUCParticipantPresence (
+      gloox::MUCRoom* r, gloox::MUCRoomParticipant participant,
+      const gloox::Presence& presence) override;
+
+  void
+  handleMUCSubject (gloox::MUCRoom* r, const std::string& nick,
+                    const std::string& subject) override
+  {}
+
+  void
+  handleMUCInviteDecline (gloox::MUCRoom* r, const gloox::JID& invitee,
+                          const std::string& reason) override
+  {}
+
+  void
+  handleMUCInfo (gloox::MUCRoom* r, const int features,
+                 const std::string& name,
+                 const gloox::DataForm* infoForm) override
+  {}
+
+  void
+  handleMUCItems (gloox::MUCRoom* r,
+                  const gloox::Disco::ItemList& items) override
+  {}
+
+public:
+
+  explicit XmppRoom (XmppTransport& t, const gloox::JID& roomWithNick,
+                     RoomHandler& h);
+
+  /**
+   * Destroys the gloox room while holding the client, so that the
+   * receiving thread cannot be in one of our callbacks at the same time.
+   */
+  ~XmppRoom ();
+
+  void
+  Leave () override
+  {
+    room->leave ();
+  }
+
+};
+
+XmppTransport::XmppRoom::XmppRoom (XmppTransport& t,
+                                   const gloox::JID& roomWithNick,
+                                   RoomHandler& h)
+  : transport(t), handler(h)
+{
+  gloox::MUCRoomHandler* glooxHandler = this;
+  transport.RunWithClient ([&] (gloox::Client& c)
+    {
+      LOG (INFO) << "Attempting to join room " << roomWithNick.full ();
+      room = std::make_unique<gloox::MUCRoom> (&c, roomWithNick,
+                                               glooxHandler);
+      room->join ();
+    });
+}
+
+XmppTransport::XmppRoom::~XmppRoom ()
+{
+  transport.RunWithClient ([this] (gloox::Client& c)
+    {
+      room.reset ();
+    });
+}
+
+void
+XmppTransport::XmppRoom::handleMUCError (gloox::MUCRoom* r,
+                                         const gloox::StanzaError error)
+{
+  CHECK_EQ (r, room.get ());
+  LOG (WARNING)
+      << "Received error for MUC room " << room->name () << ": " << error;
+  handler.RoomLeft ("room_error");
+  room->leave ();
+}
+
+bool
+XmppTransport::XmppRoom::handleMUCRoomCreation (gloox::MUCRoom* r)
+{
+  CHECK_EQ (r, room.get ());
+  LOG (WARNING) << "Creating non-existing MUC room " << room->name ();
+  return true;
+}
+
+void
+XmppTransport::XmppRoom::handleMUCMessage (gloox::MUCRoom* r,
+                                           const gloox::Message& msg,
+                                           const bool priv)
+{
+  CHECK_EQ (r, room.get ());
+
+  if (priv)
+    {
+      LOG (WARNING)
+          << "Ignoring private message on room " << room->name ()
+          << " from " << msg.from ().full ();
+      return;
+    }
+
+  VLOG (1)
+      << "Received message from " << msg.from ().full ()
+      << " on room " << room->name ();
+
+  /* The extension decodes its payload lazily, so that the handler can
+     drop the message without paying for that.  It also checks validity.  */
+  const auto* ext = msg.findExtension<MessageStanza> (MessageStanza::EXT_TYPE);
+  if (ext != nullptr)
+    handler.RoomMessage (msg.from (), *ext);
+}
+
+void
+XmppTransport::XmppRoom::handleMUCParticipantPresence (
+    gloox::MUCRoom* r, const gloox::MUCRoomParticipant participant,
+    const gloox::Presence& presence)
+{
+  CHECK_EQ (r, room.get ());
+  VLOG (1)
+      << "Presence for " << participant.jid->full ()
+      << " with flags " << participant.flags
+      << " on room " << room->name ()
+      << ": " << presence.presence ();
+
+  /* We are only interested in self presence, to mark the channel as joined
+     or handle a disconnect.  */
+  if (!(participant.flags & gloox::UserSelf))
+    return;
+
+  /* Nick changes also send an unavailable presence.  We want to not consider
+     them as such, though.  */
+  bool unavailable = (presence.presence () == gloox::Presence::Unavailable);
+  if (participant.flags & gloox::UserNickChanged)
+    unavailable = false;
+
+  if (unavailable)
+    {
+      LOG (WARNING) << "We have been disconnected from " << room->name ();
+      handler.RoomLeft ("room_unavailable");
+      return;
+    }
+
+  handler.RoomJoined ();
+}
+
+/* ************************************************************************** */
+
+XmppTransport::XmppTransport (const gloox::JID& j, const std::string& password)
+  : XmppClient(j, password)
+{
+  RunWithClient ([] (gloox::Client& c)
+    {
+      c.registerStanzaExtension (new MessageStanza ());
+    });
+}
+
+std::unique_ptr<MucTransport::Room>
+XmppTransport::JoinRoom (const gloox::JID& roomWithNick, RoomHandler& handler)
+{
+  return std::make_unique<XmppRoom> (*this, roomWithNick, handler);
+}
+
+namespace
+{
+
+/**
+ * Sends messages to a room through the given (locked) gloox client.
+ */
+void
+SendWithClient (gloox::Client& c, const gloox::JID& room,
+                std::vector<std::unique_ptr<MessageStanza>>& msgs)
+{
+  for (auto& m : msgs)
+    {
+      gloox::Message glooxMsg(gloox::Message::Groupchat, room);
+      glooxMsg.addExtension (m.release ());
+      c.send (glooxMsg);
+    }
+}
+
+} // anonymous namespace
+
+void
+XmppTransport::Send (const gloox::JID& room,
+                     std::vector<std::unique_ptr<MessageStanza>> msgs)
+{
+  RunWithClient ([&] (gloox::Client& c)
+    {
+      SendWithClient (c, room, msgs);
+    });
+}
+
+void
+XmppTransport::SendAll (std::vector<Outgoing> out)
+{
+  RunWithClient ([&] (gloox::Client& c)
+    {
+      for (auto& o : out)
+        SendWithClient (c, o.room, o.msgs);
+    });
+}
+
+/* ************************************************************************** */
+
+} // namespace xmppbroadcast